@@ -2,181 +2,839 @@
  *  Blocks, rocks and the bits
  *
  *  This file will handle the low level allocation of blocks.
- *  A block is a group of bytes on disk and right now it has a length of 512,
- *  defined by COFS_BLOCK_SIZE
+ *  A block is a group of bytes on disk, 512 to 4096 of them as mkfs chose,
+ *  sb.block_size
  *
  */
 #include <linux/buffer_head.h>
+#include <linux/slab.h>
 #include "cofs_common.h"
+#include "super.h"
 #include "inode.h"
+#include "block.h"
+#include "extent.h"
+#include "journal.h"
 
 /*
- * Zero/erase a physical block on disk
+ * Gets the buffer of a block we just allocated, zeroed in memory and dirty.
+ * There is no need to read what was on disk, all of it is overwritten.
+ * Returns NULL if we are out of memory; release it with brelse.
  */
-static void cofs_block_bzero(struct super_block *sb, unsigned int block_no)
+struct buffer_head *cofs_block_zero(struct super_block *sb, unsigned int block_no)
 {
-    struct buffer_head *bh = sb_bread(sb, block_no);
-    memset(bh->b_data, 0, sizeof(bh->b_size));
-    mark_buffer_dirty(bh);
-    brelse(bh);
+    struct buffer_head *bh = sb_getblk(sb, block_no);
+
+    if (!bh)
+        return NULL;
+    lock_buffer(bh);
+    memset(bh->b_data, 0, bh->b_size);
+    set_buffer_uptodate(bh);
+    unlock_buffer(bh);
+    cofs_journal_dirty(sb, bh);
+    return bh;
+}
+
+/*
+ * Looks in one bitmap block, between bits from and to, for a run of want
+ * free bits. If there is none that long, we settle for the longest one.
+ * Returns the first bit of the run and sets *len, or -1 if all are used.
+ */
+static int cofs_find_free_run(void *map, unsigned int from, unsigned int to,
+        unsigned int want, unsigned int *len)
+{
+    unsigned int start, end;
+    int best = -1;
+
+    *len = 0;
+    while (from < to) {
+        start = find_next_zero_bit_le(map, to, from);
+        if (start >= to)
+            break;
+        end = find_next_bit_le(map, cofs_min(to, start + want), start);
+        if (end - start > *len) {
+            best = start;
+            *len = end - start;
+            if (*len == want)
+                break;
+        }
+        from = end;
+    }
+    return best;
 }
 
 /**
- * Finds a free block on disk
- * marks it as active and returns it's physical address
+ * Finds up to *count contiguous free blocks on disk, looking from goal on
+ * and wrapping around at the end of the disk. We take the first allocation
+ * group having any free block, so we stay close to goal, and the best run
+ * in it. Without a goal, we start at the first group that may have room.
+ * Only the group looked into is locked.
+ * Marks them as active, sets *count to the number of blocks we got and
+ * returns the physical address of the first one.
  * On failure, returns 0, which is not a valid block
  */
-static unsigned int cofs_block_alloc(struct super_block *sb)
+unsigned int cofs_new_blocks(struct super_block *sb, unsigned int goal,
+        unsigned int *count)
 {
+    struct cofs_sb_info *sbi = COFS_SB(sb);
+    struct cofs_group *grp;
     struct buffer_head *bh;
-    unsigned int block, scan, idx, mask;
-    cofs_superblock_t *cofs_sb = (cofs_superblock_t *) sb->s_fs_info;
-    for (block = 0; block < cofs_sb->size; block += BITS_PER_BLOCK) {
-        bh = sb_bread(sb, BITMAP_BLOCK(block, cofs_sb));
-        for (scan = 0; scan < COFS_BLOCK_SIZE / sizeof(int); scan++) {
-            if (((unsigned int *) bh->b_data)[scan] != 0xFFFFFFFF) {
-                break;
-            }
+    unsigned int bitmap,        // bitmap block (group) we are looking into
+                 base,          // first block described by it
+                 bpb = BITS_PER_BLOCK(sb->s_blocksize),
+                 from, to, len, i, n, cursor;
+    int idx;
+
+    if (!goal || goal >= sbi->s_sb->size)
+        goal = READ_ONCE(sbi->s_bmap_cursor) * bpb;
+    bitmap = cofs_block_group(sb, goal);
+    from = goal % bpb;
+    // one more round, for the bits before goal in the first bitmap block //
+    for (i = 0; i <= sbi->s_bmap_blocks; 
+            i++, bitmap = (bitmap + 1) % sbi->s_bmap_blocks, from = 0) {
+        grp = &sbi->s_groups[bitmap];
+        if (!READ_ONCE(grp->g_free_blocks))
+            continue;
+        base = bitmap * bpb;
+        to = cofs_min(bpb, sbi->s_sb->size - base);
+        bh = sbi->s_bmap[bitmap];
+        spin_lock(&grp->g_lock);
+        idx = cofs_find_free_run(bh->b_data, from, to, *count, &len);
+        if (idx < 0) {
+            spin_unlock(&grp->g_lock);
+            continue;
         }
-        if (scan != COFS_BLOCK_SIZE / sizeof(int)) {
-            for (idx = scan * 32; idx < (scan + 1) * 32; idx++) {
-                mask = 1 << (idx % 8);
-                if((bh->b_data[idx / 8] & mask) == 0) {
-                    bh->b_data[idx / 8] |= mask;
-                    mark_buffer_dirty(bh);
-                    brelse(bh);
-                    cofs_block_bzero(sb, block + idx);
-                    return block + idx;
-                }
-            }
+        for (n = 0; n < len; n++) {
+            __set_bit_le(idx + n, bh->b_data);
         }
-        brelse(bh);
+        grp->g_free_blocks -= len;
+        spin_unlock(&grp->g_lock);
+        cofs_journal_dirty(sb, bh);
+        percpu_counter_sub(&sbi->s_free_blocks, len);
+        // racing with a free, the hint may skip a group; the wrap finds it
+        cursor = READ_ONCE(sbi->s_bmap_cursor);
+        if (cursor == bitmap) {
+            while (cursor < sbi->s_bmap_blocks - 1
+                    && !READ_ONCE(sbi->s_groups[cursor].g_free_blocks))
+                cursor++;
+            WRITE_ONCE(sbi->s_bmap_cursor, cursor);
+        }
+        *count = len;
+        return base + idx;
     }
     printk("Cannot find any free block, out of space?!\n");
     return 0;
 }
 
+/**
+ * Finds a free block on disk
+ * marks it as active and returns it's physical address
+ * On failure, returns 0, which is not a valid block
+ */
+unsigned int cofs_block_alloc(struct super_block *sb)
+{
+    unsigned int count = 1;
+    return cofs_new_blocks(sb, 0, &count);
+}
+
+/**
+ * Where the next block of inode should go, without a better idea: after the
+ * last block we gave it, or for a new file, in the group of it's inode.
+ * Files made in a directory so end up close to each other.
+ */
+unsigned int cofs_inode_goal(struct inode *inode)
+{
+    struct cofs_inode_info *ci = COFS_I(inode);
+
+    if (ci->i_last_block)
+        return ci->i_last_block + 1;
+    return cofs_ino_group(inode->i_sb, inode->i_ino) * BITS_PER_BLOCK(inode->i_sb->s_blocksize);
+}
+
+/**
+ * Allocates a block for inode. goal is where we would like it to be - usually
+ * right after the block mapping the previous file block - or 0 if we do not
+ * care, in which case we continue from the last block we gave to this inode
+ * (cofs_inode_goal).
+ * A regular file takes it's blocks from a reservation window: a run of blocks
+ * allocated ahead for it, so appenders writing at the same time each get
+ * their own contiguous region. Each time a window is used up, the next one
+ * is twice as large, up to COFS_RSV_MAX blocks.
+ * The unused part of the window goes back when the file is closed for
+ * writing, truncated or evicted (cofs_discard_reservation).
+ */
+unsigned int cofs_block_alloc_inode(struct inode *inode, unsigned int goal)
+{
+    struct cofs_inode_info *ci = COFS_I(inode);
+    unsigned int block, count = 1;
+
+    if (!goal)
+        goal = cofs_inode_goal(inode);
+    if (!S_ISREG(inode->i_mode)) {
+        return ci->i_last_block = cofs_new_blocks(inode->i_sb, goal, &count);
+    }
+    if (!ci->i_rsv_len) {
+        ci->i_rsv_size = cofs_min(ci->i_rsv_size ? ci->i_rsv_size * 2 : COFS_RSV_MIN, 
+                COFS_RSV_MAX);
+        count = ci->i_rsv_size;
+        if (!(ci->i_rsv_start = cofs_new_blocks(inode->i_sb, goal, &count)))
+            return 0;
+        ci->i_rsv_len = count;
+        pr_debug("cofs: inode %lu reserves %u blocks at %u\n", 
+                inode->i_ino, count, ci->i_rsv_start);
+    }
+    block = ci->i_rsv_start++;
+    ci->i_rsv_len--;
+    ci->i_last_block = block;
+    return block;
+}
+
+/**
+ * Gives back the blocks reserved for inode and not used
+ */
+void cofs_discard_reservation(struct inode *inode)
+{
+    struct cofs_inode_info *ci = COFS_I(inode);
+
+    down_write(&ci->i_map_sem);
+    if (ci->i_rsv_len)
+        cofs_blocks_free(inode->i_sb, ci->i_rsv_start, ci->i_rsv_len);
+    ci->i_rsv_len = 0;
+    ci->i_rsv_size = 0;
+    up_write(&ci->i_map_sem);
+}
+
 int cofs_block_free(struct super_block *sb, unsigned int block)
 {
-    struct buffer_head *bh;
-    unsigned int bitmap_block, idx, mask;
-    bitmap_block = BITMAP_BLOCK(block, ((cofs_superblock_t *) sb->s_fs_info));
-    bh = sb_bread(sb, bitmap_block);
-    idx = block % BITS_PER_BLOCK;
-    mask = 1 << (idx % 8);
-    if((bh->b_data[idx / 8] & mask) == 0) {
+    struct cofs_sb_info *sbi = COFS_SB(sb);
+    unsigned int bitmap = cofs_block_group(sb, block);
+    struct cofs_group *grp;
+
+    if (block >= sbi->s_sb->size) {
+        pr_err("Freeing block %u out of the disk\n", block);
+        return -1;
+    }
+    if (cofs_journal_free(sb, block, 1))
+        return 0;
+    grp = &sbi->s_groups[bitmap];
+    spin_lock(&grp->g_lock);
+    if (!__test_and_clear_bit_le(block % BITS_PER_BLOCK(sb->s_blocksize),
+                sbi->s_bmap[bitmap]->b_data)) {
+        spin_unlock(&grp->g_lock);
         pr_err("Block %u allready free", block);
         return -1;
     }
+    grp->g_free_blocks++;
+    spin_unlock(&grp->g_lock);
     pr_debug("Freeing block %u\n", block);
-    bh->b_data[idx / 8] &= ~mask;
-    mark_buffer_dirty(bh);
-    brelse(bh);
+    cofs_journal_dirty(sb, sbi->s_bmap[bitmap]);
+    percpu_counter_inc(&sbi->s_free_blocks);
+    if (bitmap < READ_ONCE(sbi->s_bmap_cursor))
+        WRITE_ONCE(sbi->s_bmap_cursor, bitmap);
     return 0;
 }
 
-int cofs_scan_block(struct super_block *sb, unsigned int block) 
+/**
+ * Frees count contiguous blocks from block on, with one update per bitmap
+ * block they span. With a journal, they can be used again once the
+ * transaction freeing them is committed (cofs_journal_free).
+ */
+void cofs_blocks_free(struct super_block *sb, unsigned int block, unsigned int count)
+{
+    struct cofs_sb_info *sbi = COFS_SB(sb);
+
+    if (block + count > sbi->s_sb->size || block + count < block) {
+        pr_err("Freeing blocks %u-%u out of the disk\n", block, block + count - 1);
+        return;
+    }
+    if (!cofs_journal_free(sb, block, count))
+        __cofs_blocks_free(sb, block, count);
+}
+
+void __cofs_blocks_free(struct super_block *sb, unsigned int block, unsigned int count)
 {
-    struct buffer_head *bh;
-    unsigned int scan, i = 0;
-    bh = sb_bread(sb, block);
-    for(scan = 0; scan < BLOCK_SIZE / sizeof(int); scan++) {
-        if(((uint32_t *)bh->b_data)[scan] != 0) {
-            i++;
+    struct cofs_sb_info *sbi = COFS_SB(sb);
+    struct cofs_group *grp;
+    unsigned int bitmap, bit, n, i, freed, bpb = BITS_PER_BLOCK(sb->s_blocksize);
+
+    while (count) {
+        bitmap = cofs_block_group(sb, block);
+        bit = block % bpb;
+        n = cofs_min(count, bpb - bit);
+        grp = &sbi->s_groups[bitmap];
+        spin_lock(&grp->g_lock);
+        for (i = 0, freed = 0; i < n; i++) {
+            if (__test_and_clear_bit_le(bit + i, sbi->s_bmap[bitmap]->b_data))
+                freed++;
         }
+        grp->g_free_blocks += freed;
+        spin_unlock(&grp->g_lock);
+        if (freed < n)
+            pr_err("%u of blocks %u-%u allready free", n - freed, block, block + n - 1);
+        pr_debug("Freeing blocks %u-%u\n", block, block + n - 1);
+        cofs_journal_dirty(sb, sbi->s_bmap[bitmap]);
+        percpu_counter_add(&sbi->s_free_blocks, freed);
+        if (bitmap < READ_ONCE(sbi->s_bmap_cursor))
+            WRITE_ONCE(sbi->s_bmap_cursor, bitmap);
+        block += n;
+        count -= n;
+    }
+}
+
+/**
+ * Free blocks not promised to delayed allocations. The per cpu counts are
+ * only added up when they are close to running out.
+ */
+unsigned int cofs_avail_blocks(struct super_block *sb)
+{
+    struct cofs_sb_info *sbi = COFS_SB(sb);
+    s64 free = percpu_counter_read_positive(&sbi->s_free_blocks);
+    s64 dirty = percpu_counter_read_positive(&sbi->s_dirty_blocks);
+
+    if (free < dirty + COFS_COUNTER_SLACK) {
+        free = percpu_counter_sum_positive(&sbi->s_free_blocks);
+        dirty = percpu_counter_sum_positive(&sbi->s_dirty_blocks);
     }
-    brelse(bh);
+    return free > dirty ? free - dirty : 0;
+}
+
+/**
+ * Is block marked as used in the bitmap?
+ */
+int cofs_block_used(struct super_block *sb, unsigned int block)
+{
+    struct cofs_sb_info *sbi = COFS_SB(sb);
+    unsigned int bpb = BITS_PER_BLOCK(sb->s_blocksize);
 
-    return i;
+    return block < sbi->s_sb->size
+        && test_bit_le(block % bpb, sbi->s_bmap[block / bpb]->b_data);
+}
+
+/**
+ * Reads the free blocks bitmap at mount time. The bitmap blocks stay in
+ * memory until umount, together with the number of free blocks each one
+ * describes, so allocating and freeing need no I/O and statfs is cheap.
+ * Each bitmap block makes an allocation group, and the inodes are split
+ * evenly between them; a group's slice of the inode bitmap starts on a
+ * long, so two groups never change the same word.
+ */
+int cofs_bitmap_load(struct super_block *sb)
+{
+    struct cofs_sb_info *sbi = COFS_SB(sb);
+    cofs_superblock_t *cofs_sb = sbi->s_sb;
+    unsigned int i, bit, to, free = 0, bpb = BITS_PER_BLOCK(sb->s_blocksize);
+    int err;
+
+    sbi->s_bmap_blocks = DIV_ROUND_UP(cofs_sb->size, bpb);
+    sbi->s_bmap = kcalloc(sbi->s_bmap_blocks, sizeof(*sbi->s_bmap), GFP_KERNEL);
+    sbi->s_groups = kcalloc(sbi->s_bmap_blocks, sizeof(*sbi->s_groups), GFP_KERNEL);
+    if (!sbi->s_bmap || !sbi->s_groups)
+        return -ENOMEM;
+    sbi->s_inodes_per_group = round_up(DIV_ROUND_UP(cofs_sb->num_inodes, sbi->s_bmap_blocks),
+            BITS_PER_LONG);
+
+    sbi->s_bmap_cursor = sbi->s_bmap_blocks - 1;
+    for (i = 0; i < sbi->s_bmap_blocks; i++) {
+        spin_lock_init(&sbi->s_groups[i].g_lock);
+        if (!(sbi->s_bmap[i] = sb_bread(sb, cofs_sb->bitmap_start + i))) {
+            pr_err("cofs: cannot read bitmap block %u\n", i);
+            return -EIO;
+        }
+        // the last bitmap block may describe blocks beyond the disk //
+        to = cofs_min(bpb, cofs_sb->size - i * bpb);
+        bit = find_next_zero_bit_le(sbi->s_bmap[i]->b_data, to, 0);
+        while (bit < to) {
+            sbi->s_groups[i].g_free_blocks++;
+            bit = find_next_zero_bit_le(sbi->s_bmap[i]->b_data, to, bit + 1);
+        }
+        free += sbi->s_groups[i].g_free_blocks;
+        if (sbi->s_groups[i].g_free_blocks && i < sbi->s_bmap_cursor)
+            sbi->s_bmap_cursor = i;
+    }
+    if ((err = percpu_counter_init(&sbi->s_free_blocks, free, GFP_KERNEL))
+            || (err = percpu_counter_init(&sbi->s_dirty_blocks, 0, GFP_KERNEL)))
+        return err;
+    pr_debug("cofs: %u free blocks in %u groups\n", free, sbi->s_bmap_blocks);
+    return 0;
+}
+
+static int cofs_sync_bhs(struct buffer_head **bhs, unsigned int count, int wait)
+{
+    unsigned int i;
+    int err = 0;
+
+    for (i = 0; i < count; i++) {
+        if (buffer_dirty(bhs[i]))
+            write_dirty_buffer(bhs[i], REQ_SYNC);
+    }
+    if (!wait)
+        return 0;
+    for (i = 0; i < count; i++) {
+        wait_on_buffer(bhs[i]);
+        if (buffer_req(bhs[i]) && !buffer_uptodate(bhs[i]))
+            err = -EIO;
+    }
+    return err;
+}
+
+/**
+ * Writes the dirty blocks of the free blocks and inodes bitmaps, all at
+ * once, and waits for them if wait. They are shared by all the files, so
+ * this is all fsync can do; when nothing was allocated it costs no I/O.
+ */
+int cofs_bitmap_sync(struct super_block *sb, int wait)
+{
+    struct cofs_sb_info *sbi = COFS_SB(sb);
+    int err, err2;
+
+    err = cofs_sync_bhs(sbi->s_bmap, sbi->s_bmap_blocks, wait);
+    err2 = cofs_sync_bhs(sbi->s_imap, sbi->s_imap_blocks, wait);
+    return err ? err : err2;
+}
+
+void cofs_bitmap_release(struct super_block *sb)
+{
+    struct cofs_sb_info *sbi = COFS_SB(sb);
+    unsigned int i;
+
+    if (sbi->s_bmap) {
+        for (i = 0; i < sbi->s_bmap_blocks; i++)
+            brelse(sbi->s_bmap[i]);
+    }
+    kfree(sbi->s_bmap);
+    kfree(sbi->s_groups);
+    sbi->s_bmap = NULL;
+    sbi->s_groups = NULL;
+    percpu_counter_destroy(&sbi->s_free_blocks);
+    percpu_counter_destroy(&sbi->s_dirty_blocks);
+}
+
+/*
+ * How many blocks, starting with table[idx] and not past table[end - 1], are
+ * contiguous on disk too, up to max. table[idx] must be mapped.
+ */
+static unsigned int cofs_run_len(unsigned int *table, unsigned int idx,
+        unsigned int end, unsigned int max)
+{
+    unsigned int n = 1;
+
+    while (n < max && idx + n < end && table[idx + n] == table[idx] + n)
+        n++;
+    return n;
+}
+
+/*
+ * Loads the indirect table whose block number is kept in *table. If the table
+ * is missing and create is set, a block is allocated for it and the slot's
+ * owner (parent table, or the inode itself) is dirtied. A new table is only
+ * zeroed in memory, it will reach the disk with its first entry.
+ */
+static struct buffer_head *cofs_table_bread(struct inode *inode, 
+        unsigned int *table, struct buffer_head *parent, int create)
+{
+    struct buffer_head *bh;
+
+    if (*table)
+        return sb_bread(inode->i_sb, *table);
+    if (!create || !(*table = cofs_block_alloc_inode(inode, 0)))
+        return NULL;
+    if (!(bh = cofs_block_zero(inode->i_sb, *table))) {
+        cofs_block_free(inode->i_sb, *table);
+        *table = 0;
+        return NULL;
+    }
+    cofs_journal_dirty_inode(bh, inode);
+    if (parent)
+        cofs_journal_dirty_inode(parent, inode);
+    else
+        mark_inode_dirty(inode);
+    return bh;
 }
 
 /**
  * Returning the real disk block number, by giving relative block of inode.
  * Eg. block 1 of inode, that represents bytes from 512-1024 will be 
  * mapped to disk block 3059 (supposing).
- * If we try to write ouside, in an analocated block, a new free block will
- * be mapped in. Usually the read functions will not read ouside the inode size.
- * Maybe a new guard will be added - like bool extend, and only extending on 
- * write functions.
- * We will not flush the inode buffer, because on some linux errors when 
- * marking it dirty, twice. The function that calls this one and modify the inode
- * will be the write function, which also alter and mark the inode buffer as dirty
+ * If create is set and we try to write ouside, in an analocated block, a new
+ * free block will be mapped in and *new (if not NULL) is set, so the caller
+ * knows there is nothing worth reading there. Without create, an unallocated
+ * block maps to 0, which the page cache reads as zeros.
+ * If count is not NULL, it holds the most blocks the caller wants and on
+ * return, how many of them follow block_no on disk too (at least 1), so 
+ * a sequential reader maps and reads a whole run at once. A block we just
+ * allocated is always returned alone.
+ * Lookups also start reading, in background, the next indirect table the
+ * reader will need, while it is busy with the data mapped by this one.
+ * On a COFS_FEAT_EXTENTS file system the inode maps it's data by extents and
+ * the work is done in extent.c.
  */
-unsigned int cofs_get_real_block(struct inode *inode, unsigned int ino_block)
+static unsigned int __cofs_block_map(struct inode *inode, unsigned int ino_block,
+        int create, int *new, unsigned int *count)
 {
     struct super_block *sb = inode->i_sb;
-    struct buffer_head *ino_buf = NULL, // buffer to hold the inode
-                       *buf;            // generic buffer for other manipulations
- 
-    cofs_inode_t *dino = cofs_raw_inode(sb, inode->i_ino, ino_buf);
+    struct buffer_head *buf,    // generic buffer for table manipulations
+                       *tbuf;
+    unsigned int *addrs = COFS_I(inode)->i_addrs;
     unsigned int block_no = 0,  // block alocated or 0 on error
                  rel_b,         // relative block number inside a table
-                 pblock,
                  sidx,          // single indirect index 
                  didx,          // double indirect index
+                 max = 1,       // run length we are asked for
+                 run = 1,       // run length found
+                 epb = NUM_EINB(sb->s_blocksize), // entries in a table
                  *blocks;
 
+    if (COFS_HAS_FEATURE(COFS_SB(sb)->s_sb, COFS_FEAT_EXTENTS)) {
+        return cofs_ext_map(inode, ino_block, create, new, count);
+    }
+    if (count)
+        max = *count;
     // direct alocation //
     if (ino_block < NUM_DIRECT) { 
-        if (dino->addrs[ino_block] == 0) {
+        if (addrs[ino_block] == 0 && create) {
             // alocate direct data block
-            dino->addrs[ino_block] = cofs_block_alloc(sb); 
+            if ((addrs[ino_block] = cofs_block_alloc_inode(inode, 0))) {
+                mark_inode_dirty(inode);
+                if (new)
+                    *new = 1;
+                max = 1;
+            }
+        }
+        block_no = addrs[ino_block];
+        if (block_no) {
+            run = cofs_run_len(addrs, ino_block, NUM_DIRECT, max);
+            // the run reaches the end of the direct blocks
+            if (!create && ino_block + run == NUM_DIRECT && addrs[SIND_IDX])
+                sb_breadahead(sb, addrs[SIND_IDX]);
         }
-        block_no = dino->addrs[ino_block];
     } 
     // single indirect allocation //
-    else if (ino_block < NUM_DIRECT + NUM_SIND) {
-        if (dino->addrs[SIND_IDX] == 0) {
-            // alocate block for indirect table
-            dino->addrs[SIND_IDX] = cofs_block_alloc(sb); 
-        }
-        buf = sb_bread(sb, dino->addrs[SIND_IDX]); // load indirect table
+    else if (ino_block < NUM_DIRECT + epb) {
+        // load indirect table
+        if (!(buf = cofs_table_bread(inode, &addrs[SIND_IDX], NULL, create)))
+            goto out;
         blocks = (unsigned int *) buf->b_data;
         sidx = ino_block - NUM_DIRECT;
-        if (blocks[sidx] == 0) {
+        if (blocks[sidx] == 0 && create) {
             // alocate block for data
-            blocks[sidx] = cofs_block_alloc(sb);
-            mark_buffer_dirty(buf);
+            if ((blocks[sidx] = cofs_block_alloc_inode(inode, 0))) {
+                cofs_journal_dirty_inode(buf, inode);
+                if (new)
+                    *new = 1;
+                max = 1;
+            }
         }
         block_no = blocks[sidx];
+        if (block_no) {
+            run = cofs_run_len(blocks, sidx, epb, max);
+            if (!create && sidx + run == epb && addrs[DIND_IDX])
+                sb_breadahead(sb, addrs[DIND_IDX]);
+        }
         brelse(buf);
     }
     // double indirect allocation //
-    else if (ino_block < MAX_FILE_SIZE) {
-        rel_b = ino_block - NUM_DIRECT - NUM_SIND; // block relative number to this zone
+    else if (ino_block < MAX_FILE_SIZE(sb->s_blocksize)) {
+        rel_b = ino_block - NUM_DIRECT - epb; // block relative number to this zone
         // index into the first level table //
-        sidx = ino_block / NUM_EINB;
+        sidx = rel_b / epb;
         // index into the second level table //
-        didx = ino_block % NUM_EINB;
+        didx = rel_b % epb;
 
-        if (dino->addrs[DIND_IDX] == 0) {
-            // allocating a block for primary indirect table //
-            dino->addrs[DIND_IDX] = cofs_block_alloc(sb);
-        }
-        buf = sb_bread(sb, dino->addrs[DIND_IDX]);
+        // primary indirect table //
+        if (!(buf = cofs_table_bread(inode, &addrs[DIND_IDX], NULL, create)))
+            goto out;
         blocks = (unsigned int *) buf->b_data;
-        if (blocks[sidx] == 0) {
-            // allocating a block for secondary indirect table //
-            blocks[sidx] = cofs_block_alloc(sb);
-            mark_buffer_dirty(buf);
-        }
-        pblock = blocks[sidx];
+        // secondary indirect table //
+        tbuf = cofs_table_bread(inode, &blocks[sidx], buf, create);
+        // a reader entering this table will need the next one soon
+        if (tbuf && !create && didx == 0 && sidx + 1 < epb && blocks[sidx + 1])
+            sb_breadahead(sb, blocks[sidx + 1]);
         brelse(buf);
+        if (!(buf = tbuf))
+            goto out;
 
-        buf = sb_bread(sb, pblock);
         blocks = (unsigned int *) buf->b_data;
-        if (blocks[didx] == 0) {
+        if (blocks[didx] == 0 && create) {
             // finally alocating the data block //
-            blocks[didx] = cofs_block_alloc(sb);
-            mark_buffer_dirty(buf);
+            if ((blocks[didx] = cofs_block_alloc_inode(inode, 0))) {
+                cofs_journal_dirty_inode(buf, inode);
+                if (new)
+                    *new = 1;
+                max = 1;
+            }
         }
         block_no = blocks[didx];
+        if (block_no)
+            run = cofs_run_len(blocks, didx, epb, max);
         brelse(buf);
     }
     else {
-        pr_err("Inode's relative block is out of MAX_FILE_SIZE - block: %u, max: %lu\n", ino_block, MAX_FILE_SIZE);
+        pr_err("Inode's relative block is out of MAX_FILE_SIZE - block: %u, max: %lu\n",
+                ino_block, MAX_FILE_SIZE(sb->s_blocksize));
+    }
+
+out:
+    if (count)
+        *count = run;
+    return block_no;
+}
+
+/*
+ * Maps file block ino_block to block_no, a block the caller allocated and
+ * filled already; the tables on the way are allocated if needed. Returns
+ * -EEXIST if the file block was mapped meanwhile. Called with i_map_sem
+ * held exclusive.
+ */
+static int __cofs_block_set(struct inode *inode, unsigned int ino_block,
+        unsigned int block_no)
+{
+    unsigned int *addrs = COFS_I(inode)->i_addrs;
+    unsigned int epb = NUM_EINB(inode->i_sb->s_blocksize), rel_b, *blocks;
+    struct buffer_head *buf, *tbuf;
+
+    if (ino_block < NUM_DIRECT) {
+        if (addrs[ino_block])
+            return -EEXIST;
+        addrs[ino_block] = block_no;
+        mark_inode_dirty(inode);
+        return 0;
+    }
+    if (ino_block < NUM_DIRECT + epb) {
+        if (!(buf = cofs_table_bread(inode, &addrs[SIND_IDX], NULL, 1)))
+            return -ENOSPC;
+        rel_b = ino_block - NUM_DIRECT;
+    } else {
+        rel_b = ino_block - NUM_DIRECT - epb;
+        if (!(tbuf = cofs_table_bread(inode, &addrs[DIND_IDX], NULL, 1)))
+            return -ENOSPC;
+        blocks = (unsigned int *) tbuf->b_data;
+        buf = cofs_table_bread(inode, &blocks[rel_b / epb], tbuf, 1);
+        brelse(tbuf);
+        if (!buf)
+            return -ENOSPC;
+        rel_b %= epb;
+    }
+    blocks = (unsigned int *) buf->b_data;
+    if (blocks[rel_b]) {
+        brelse(buf);
+        return -EEXIST;
+    }
+    blocks[rel_b] = block_no;
+    cofs_journal_dirty_inode(buf, inode);
+    brelse(buf);
+    return 0;
+}
+
+/*
+ * The block map of an inode is read under i_map_sem shared, so the readers
+ * of a file map their blocks in parallel. Only filling a hole - a lookup
+ * came back empty - takes it exclusive, and looks again.
+ */
+static unsigned int cofs_block_map(struct inode *inode, unsigned int ino_block,
+        int create, int *new, unsigned int *count)
+{
+    struct cofs_inode_info *ci = COFS_I(inode);
+    unsigned int block_no, want = count ? *count : 1;
+
+    down_read(&ci->i_map_sem);
+    block_no = __cofs_block_map(inode, ino_block, 0, new, count);
+    up_read(&ci->i_map_sem);
+    if (block_no || !create)
+        return block_no;
+    if (count)
+        *count = want;
+    down_write(&ci->i_map_sem);
+    block_no = __cofs_block_map(inode, ino_block, 1, new, count);
+    up_write(&ci->i_map_sem);
+    return block_no;
+}
+
+/**
+ * Maps a block of a directory, allocating it if needed. Since the callers
+ * read it through the buffer cache, a newly allocated block is zeroed here,
+ * in memory - no stale data from a previous owner shows up as dirents.
+ */
+unsigned int cofs_get_real_block(struct inode *inode, unsigned int ino_block)
+{
+    struct buffer_head *bh;
+    unsigned int block_no;
+    int new = 0;
+
+    block_no = cofs_block_map(inode, ino_block, 1, &new, NULL);
+    if (block_no && new) {
+        if (!(bh = cofs_block_zero(inode->i_sb, block_no)))
+            return 0;
+        brelse(bh);
     }
-    
-    brelse(ino_buf);
     return block_no;
 }
+
+unsigned int cofs_lookup_block(struct inode *inode, unsigned int ino_block)
+{
+    return cofs_block_map(inode, ino_block, 0, NULL, NULL);
+}
+
+/**
+ * Maps the holes from file block start to end - 1, for fallocate. Extents
+ * remember the new blocks are unwritten; the block tables cannot, so a run
+ * of free blocks is zeroed on disk before it goes in the tables: neither a
+ * reader nor a commit ever sees what was there. A large range takes more
+ * than one transaction.
+ */
+int cofs_prealloc(struct inode *inode, unsigned int start, unsigned int end)
+{
+    struct super_block *sb = inode->i_sb;
+    struct cofs_inode_info *ci = COFS_I(inode);
+    unsigned int block_no, count, i;
+    int err = 0;
+
+    cofs_journal_start(sb);
+    if (COFS_HAS_FEATURE(COFS_SB(sb)->s_sb, COFS_FEAT_EXTENTS)) {
+        for (;;) {
+            down_write(&COFS_I(inode)->i_map_sem);
+            err = cofs_ext_prealloc(inode, &start, end);
+            up_write(&COFS_I(inode)->i_map_sem);
+            if (err != -EAGAIN)
+                break;
+            cofs_journal_restart(sb);
+        }
+        goto out;
+    }
+    end = cofs_min(end, MAX_FILE_SIZE(sb->s_blocksize));
+    while (start < end) {
+        if (cofs_lookup_block(inode, start)) {
+            start++;
+            continue;
+        }
+        // the hole from start, at most a bitmap block of it at once
+        for (count = 1; start + count < end && count < BITS_PER_BLOCK(sb->s_blocksize)
+                && !cofs_lookup_block(inode, start + count); count++)
+            ;
+        count = cofs_min(count, cofs_avail_blocks(sb));
+        if (!count || !(block_no = cofs_new_blocks(sb, cofs_inode_goal(inode), &count))) {
+            err = -ENOSPC;
+            break;
+        }
+        if ((err = sb_issue_zeroout(sb, block_no, count, GFP_NOFS))) {
+            cofs_blocks_free(sb, block_no, count);
+            break;
+        }
+        ci->i_last_block = block_no + count - 1;
+        for (i = 0; i < count; i++) {
+            // the run is on disk already, a restart commits no stale block
+            if (cofs_journal_extend(sb, COFS_JNL_MAP_CREDITS))
+                cofs_journal_restart(sb);
+            down_write(&ci->i_map_sem);
+            err = __cofs_block_set(inode, start + i, block_no + i);
+            up_write(&ci->i_map_sem);
+            // writeback filled it first
+            if (err == -EEXIST) {
+                cofs_block_free(sb, block_no + i);
+                err = 0;
+            } else if (err) {
+                cofs_blocks_free(sb, block_no + i, count - i);
+                goto out;
+            }
+        }
+        start += count;
+    }
+out:
+    cofs_journal_stop(sb);
+    return err;
+}
+
+/**
+ * The get_block_t callback used by the page cache helpers (mpage, 
+ * block_write_begin...). Maps file block iblock into bh_result, allocating
+ * it if create is set. Holes are left unmapped, so they read as zeros.
+ * As many already mapped blocks as the caller asks for in b_size are
+ * mapped if they are contiguous on disk, so readahead and direct I/O build
+ * large bios.
+ */
+int cofs_get_block(struct inode *inode, sector_t iblock, 
+        struct buffer_head *bh_result, int create)
+{
+    unsigned int block_no, count = 1;
+    int new = 0;
+
+    if (((loff_t) iblock) << inode->i_blkbits >= inode->i_sb->s_maxbytes) {
+        return create ? -EFBIG : 0;
+    }
+    if (bh_result->b_size > inode->i_sb->s_blocksize)
+        count = bh_result->b_size >> inode->i_blkbits;
+    // the caller may hold a page lock, so it does not wait for a commit
+    if (create)
+        cofs_journal_join(inode->i_sb);
+    block_no = cofs_block_map(inode, iblock, create, &new, &count);
+    if (create)
+        cofs_journal_stop(inode->i_sb);
+    if (!block_no) {
+        return create ? -ENOSPC : 0;
+    }
+    // writeback of a delayed block, the space it reserved is now used
+    if (buffer_delay(bh_result)) {
+        cofs_da_release(inode->i_sb, 1);
+    }
+    map_bh(bh_result, inode->i_sb, block_no);
+    bh_result->b_size = count << inode->i_blkbits;
+    if (new) {
+        set_buffer_new(bh_result);
+    }
+    return 0;
+}
+
+/*
+ * Delayed allocation (mount -o delalloc)
+ * A write into a hole only reserves a block, counted in s_dirty_blocks, and
+ * leaves the page buffer mapped to COFS_DA_BLOCK with BH_Delay set. The block
+ * is allocated when the page is written back: block_write_full_page calls
+ * cofs_get_block for delayed buffers. Pages dropped before writeback, like
+ * the ones of a deleted temporary file, give back their reservation in
+ * cofs_da_invalidatepage, without ever touching the bitmap.
+ */
+#define COFS_DA_BLOCK   (~0U)
+
+// indirect tables or extent blocks needed to map n data blocks, roughly
+#define COFS_DA_META(sb, n) ((n) / (NUM_EINB((sb)->s_blocksize) - 1) + 2)
+
+static int cofs_da_reserve(struct super_block *sb)
+{
+    struct cofs_sb_info *sbi = COFS_SB(sb);
+    s64 free = percpu_counter_read_positive(&sbi->s_free_blocks);
+    s64 want = percpu_counter_read_positive(&sbi->s_dirty_blocks) + 1;
+
+    if (free < want + COFS_DA_META(sb, want) + COFS_COUNTER_SLACK) {
+        free = percpu_counter_sum_positive(&sbi->s_free_blocks);
+        want = percpu_counter_sum_positive(&sbi->s_dirty_blocks) + 1;
+        if (free < want + COFS_DA_META(sb, want))
+            return -ENOSPC;
+    }
+    percpu_counter_inc(&sbi->s_dirty_blocks);
+    return 0;
+}
+
+void cofs_da_release(struct super_block *sb, unsigned int count)
+{
+    percpu_counter_sub(&COFS_SB(sb)->s_dirty_blocks, count);
+}
+
+/**
+ * The get_block_t of write_begin with delayed allocation. Mapped blocks are
+ * used as they are; for a hole, a block is only reserved.
+ */
+int cofs_da_get_block(struct inode *inode, sector_t iblock, 
+        struct buffer_head *bh_result, int create)
+{
+    int err;
+
+    err = cofs_get_block(inode, iblock, bh_result, 0);
+    if (err || buffer_mapped(bh_result) || !create)
+        return err;
+    if (((loff_t) iblock) << inode->i_blkbits >= inode->i_sb->s_maxbytes)
+        return -EFBIG;
+    if ((err = cofs_da_reserve(inode->i_sb)))
+        return err;
+    map_bh(bh_result, inode->i_sb, COFS_DA_BLOCK);
+    set_buffer_new(bh_result);
+    set_buffer_delay(bh_result);
+    return 0;
+}
@@ -3,10 +3,44 @@
 
 /**
  * Convert from inode relative block number (like 0, 1, 2..), to physical
- * disk block number.
+ * disk block number. cofs_get_real_block allocates the block if it's not
+ * mapped, cofs_lookup_block returns 0 for it (a hole).
  */
 unsigned int cofs_get_real_block(struct inode *inode, unsigned int ino_block);
+unsigned int cofs_lookup_block(struct inode *inode, unsigned int ino_block);
+int cofs_get_block(struct inode *inode, sector_t iblock, 
+        struct buffer_head *bh_result, int create);
+int cofs_da_get_block(struct inode *inode, sector_t iblock, 
+        struct buffer_head *bh_result, int create);
+void cofs_da_release(struct super_block *sb, unsigned int count);
+int cofs_prealloc(struct inode *inode, unsigned int start, unsigned int end);
+/**
+ * Reservation windows of regular files start at COFS_RSV_MIN blocks and 
+ * double each time one is used up, up to COFS_RSV_MAX blocks.
+ */
+#define COFS_RSV_MIN    16
+#define COFS_RSV_MAX    1024
+
+unsigned int cofs_new_blocks(struct super_block *sb, unsigned int goal,
+        unsigned int *count);
+unsigned int cofs_block_alloc(struct super_block *sb);
+unsigned int cofs_block_alloc_inode(struct inode *inode, unsigned int goal);
+unsigned int cofs_inode_goal(struct inode *inode);
+unsigned int cofs_avail_blocks(struct super_block *sb);
+void cofs_discard_reservation(struct inode *inode);
 int cofs_block_free(struct super_block *sb, unsigned int block);
-int cofs_scan_block(struct super_block *sb, unsigned int block);
+void cofs_blocks_free(struct super_block *sb, unsigned int block, unsigned int count);
+void __cofs_blocks_free(struct super_block *sb, unsigned int block, unsigned int count);
+int cofs_block_used(struct super_block *sb, unsigned int block);
+struct buffer_head *cofs_block_zero(struct super_block *sb, unsigned int block);
+/**
+ * Below this, the per cpu free block counters may be off by more than what
+ * is left: they are added up.
+ */
+#define COFS_COUNTER_SLACK  (2 * percpu_counter_batch * num_online_cpus())
+
+int cofs_bitmap_load(struct super_block *sb);
+int cofs_bitmap_sync(struct super_block *sb, int wait);
+void cofs_bitmap_release(struct super_block *sb);
 
 #endif
@@ -1,9 +1,14 @@
 #ifndef _COFS_COMMON_H
 #define _COFS_COMMON_H
 
-#ifndef COFS_BLOCK_SIZE
-#define COFS_BLOCK_SIZE 512
-#endif
+/**
+ * The block size is chosen by mkfs and kept in the superblock. All the
+ * geometry below depends on it, so the macros take it as bs.
+ * COFS_BLOCK_SIZE is the size of the original format, which has 0 in
+ * sb.block_size.
+ */
+#define COFS_BLOCK_SIZE     512
+#define COFS_MAX_BLOCK_SIZE 4096
 
 #define COFS_MAGIC 0xC0517155       /* cosiris FS magic number */
 
@@ -19,29 +24,63 @@ typedef struct cofs_superblock
     unsigned int data_block;        // TODO: add where data blocks starts
                                     // so we ensure we never allocate blocks
                                     // in bitmap or inoode zone
+    unsigned int features;          // COFS_FEAT_* on disk format flags
+    unsigned int imap_start;        // where inode bitmap starts (COFS_FEAT_IMAP)
+    unsigned int orphan_head;       // first unlinked inode not yet freed (COFS_FEAT_ORPHAN)
+    unsigned int journal_start;     // where the journal starts (COFS_FEAT_JOURNAL)
+    unsigned int journal_blocks;    // size of the journal
+    unsigned int block_size;        // bytes per block, 0 is COFS_BLOCK_SIZE
+    unsigned int inode_size;        // bytes per inode, 0 is sizeof(cofs_inode_t)
 } cofs_superblock_t;
 
+// the superblock lives in block 1, whatever the block size
+#define COFS_SB_BLOCK   1
+
+#define COFS_SB_BLOCK_SIZE(superblock) \
+    ((superblock)->block_size ? (superblock)->block_size : COFS_BLOCK_SIZE)
+#define COFS_SB_INODE_SIZE(superblock) \
+    ((superblock)->inode_size ? (superblock)->inode_size : sizeof(cofs_inode_t))
+
+/* Super block features. A zero features field is the original format */
+#define COFS_FEAT_EXTENTS   0x0001  // inodes map their data by extents
+#define COFS_FEAT_IMAP      0x0002  // used inodes are marked in a bitmap
+#define COFS_FEAT_DIR_HASH  0x0004  // new directories are hashed
+#define COFS_FEAT_FILETYPE  0x0008  // dirents keep the name length and file type
+#define COFS_FEAT_UNWRITTEN 0x0010  // extents may be preallocated, not written
+#define COFS_FEAT_ORPHAN    0x0020  // sb.orphan_head lists inodes to free
+#define COFS_FEAT_JOURNAL   0x0040  // metadata changes go through a journal
+#define COFS_FEAT_INLINE    0x0080  // small files and directories live in the inode
+#define COFS_FEAT_SUPPORTED (COFS_FEAT_EXTENTS | COFS_FEAT_IMAP | COFS_FEAT_DIR_HASH \
+        | COFS_FEAT_FILETYPE | COFS_FEAT_UNWRITTEN | COFS_FEAT_ORPHAN | COFS_FEAT_JOURNAL \
+        | COFS_FEAT_INLINE)
+
+#define COFS_HAS_FEATURE(superblock, feature) ((superblock)->features & (feature))
+
 
 /**
  * In an inode, to define data, we keep the track of allocated blocks of data;
  * We keep the block index as an unsigned int. That's it, we can allocate maximum of 
- * 2^32 blocks of COFS_BLOCK_SIZE in out filesystem ~ 2 TB limitation
+ * 2^32 blocks of bs in out filesystem ~ 2 TB limitation with 512 bytes blocks
  * We have direct allocated blocks of data, 
  * simple indirect - a block keeping pointers to allocated data
  * double indirect - a block keeping pointers to blocks of pointers containing data
  * - TODO - triple indirect
- *   So, the size limit of a file will be COFS_BLOCK_SIZE * (NUM_DIRECT + NUM_SIND + NUM_DIND)
+ *   So, the size limit of a file will be bs * (NUM_DIRECT + NUM_SIND + NUM_DIND)
  */
-#define NUM_DIRECT  6                           // number of direct blocks in the inode
-#define NUM_SIND    (COFS_BLOCK_SIZE / sizeof(int))  // number of single indirect blocks
-#define NUM_DIND    (NUM_SIND * NUM_SIND)       // number of double indidrect blocks
-#define NUM_EINB    (COFS_BLOCK_SIZE / sizeof(int)) // number of block entries in a block
+#define NUM_DIRECT      6                           // number of direct blocks in the inode
+#define NUM_SIND(bs)    ((bs) / sizeof(int))        // number of single indirect blocks
+#define NUM_DIND(bs)    (NUM_SIND(bs) * NUM_SIND(bs)) // number of double indidrect blocks
+#define NUM_EINB(bs)    ((bs) / sizeof(int))        // number of block entries in a block
 
-// max file size in blocks ~ 8 MB if COFS_BLOCK_SIZE == 512
-#define MAX_FILE_SIZE (NUM_DIRECT + NUM_SIND + NUM_DIND)
+// max file size in blocks ~ 8 MB with 512 bytes blocks, ~ 4 GB with 4 KB ones
+#define MAX_FILE_SIZE(bs) (NUM_DIRECT + NUM_SIND(bs) + NUM_DIND(bs))
+
+// Space for direct blocks to data, SIND_IDX, DIND_IDX 
+// + 1 reserved for future triple indx
+#define NUM_ADDRS   (NUM_DIRECT + 3)
 
 // The inode struct
-// Must be % COFS_BLOCK_SIZE
+// Must divide COFS_BLOCK_SIZE, sb.inode_size may make room after it
 typedef struct cofs_inode {
     unsigned short int type;            // type of inode - file, link, directory, etc. type is mode and mode is type :D
     unsigned short int major;           // for devices, major, minor
@@ -51,9 +90,7 @@ typedef struct cofs_inode {
     unsigned short int num_links;       // number of links to this inode, (aka ln -s)
     unsigned int atime, mtime, ctime;   // infos about time, not really used now
     unsigned int size;                  // file size
-    // Space for direct blocks to data, SIND_IDX, DIND_IDX 
-    // + 1 reserved for future triple indx
-    unsigned int addrs[NUM_DIRECT + 3];
+    unsigned int addrs[NUM_ADDRS];      // blocks map, or the extents root
 } cofs_inode_t;
 
 // index into inode addrs to single indirect block
@@ -62,17 +99,120 @@ typedef struct cofs_inode {
 // index into inode addrs to double indirect block
 #define DIND_IDX    NUM_DIRECT + 1
 
-// number of inodes that can fit into a block of COFS_BLOCK_SIZE //
-#define NUM_INOPB (COFS_BLOCK_SIZE / sizeof(cofs_inode_t))
+// number of inodes of isz bytes that can fit into a block of bs bytes //
+#define NUM_INOPB(bs, isz) ((bs) / (isz))
+
+// an inode on the orphan list has no links and no use for atime, which
+// holds the number of the next inode on the list (0 ends it)
+#define COFS_ORPHAN_NEXT(dino)  ((dino)->atime)
+
+/**
+ * Inline data (COFS_FEAT_INLINE). Inodes are sb.inode_size bytes: the
+ * cofs_inode_t, a tail, then room for the data of a small regular file or
+ * directory. With COFS_INODE_INLINE set the data is there, up to i_size,
+ * and addrs[] maps nothing. When it outgrows the room, it moves to blocks.
+ * An inline directory has the size of the dirents fitting in the room.
+ */
+struct cofs_inode_tail {
+    unsigned int flags;                 // COFS_INODE_*
+};
+
+#define COFS_INODE_INLINE       0x0001
+
+#define COFS_INODE_TAIL(dino)   ((struct cofs_inode_tail *) ((dino) + 1))
+#define COFS_INLINE_DATA(dino)  ((char *) (COFS_INODE_TAIL(dino) + 1))
+#define COFS_INLINE_MAX(isz)    ((isz) - sizeof(cofs_inode_t) - sizeof(struct cofs_inode_tail))
+#define COFS_INLINE_DIR_SIZE(isz) \
+    (COFS_INLINE_MAX(isz) / sizeof(struct cofs_dirent) * sizeof(struct cofs_dirent))
+
+/**
+ * Extents. On a COFS_FEAT_EXTENTS file system the addrs[] space of the inode
+ * holds the root of a tree of extents instead of block numbers.
+ * Every node of the tree (the root in the inode, the rest in blocks) starts
+ * with a header. Leaf nodes (depth 0) are followed by extents - runs of
+ * contiguous blocks, sorted by logical block. Index nodes are followed by
+ * entries pointing to the node which maps logical blocks from ei_lblock on.
+ */
+#define COFS_EXT_MAGIC  0xE7C0
+
+struct cofs_extent_header {
+    unsigned short int eh_magic;
+    unsigned short int eh_entries;      // number of used entries
+    unsigned short int eh_max;          // capacity of this node
+    unsigned short int eh_depth;        // 0 if entries are extents
+};
+
+struct cofs_extent {
+    unsigned int e_lblock;              // first file block
+    unsigned int e_len;                 // number of blocks
+    unsigned int e_pblock;              // first disk block
+};
+
+struct cofs_extent_idx {
+    unsigned int ei_lblock;             // first file block mapped below
+    unsigned int ei_block;              // disk block of the lower node
+};
+
+/*
+ * The high bit of e_len marks an unwritten extent: blocks preallocated by
+ * fallocate, which read as zeros until written. Set only with
+ * COFS_FEAT_UNWRITTEN; lengths never reach it, files are at most 2^23 blocks.
+ */
+#define COFS_EXT_UNWRITTEN      0x80000000U
+#define EXT_LEN(ex)             ((ex)->e_len & ~COFS_EXT_UNWRITTEN)
+#define EXT_UNWRITTEN(ex)       ((ex)->e_len & COFS_EXT_UNWRITTEN)
+
+#define EXT_FIRST_EXTENT(eh)    ((struct cofs_extent *) ((eh) + 1))
+#define EXT_FIRST_INDEX(eh)     ((struct cofs_extent_idx *) ((eh) + 1))
+
+// entries fitting in the inode root and in a block
+#define NUM_ROOT_BYTES  (sizeof(((cofs_inode_t *) 0)->addrs) - sizeof(struct cofs_extent_header))
+#define NUM_IEXT        (NUM_ROOT_BYTES / sizeof(struct cofs_extent))
+#define NUM_IIDX        (NUM_ROOT_BYTES / sizeof(struct cofs_extent_idx))
+#define NUM_EXTPB(bs)   (((bs) - sizeof(struct cofs_extent_header)) / sizeof(struct cofs_extent))
+#define NUM_IDXPB(bs)   (((bs) - sizeof(struct cofs_extent_header)) / sizeof(struct cofs_extent_idx))
+
+// the extent tree root of a disk inode
+#define COFS_EXT_ROOT(dino)     ((struct cofs_extent_header *) (dino)->addrs)
+
+// inode size is 32 bits, so this is the limit with extents
+#define COFS_EXT_MAX_BYTES      0xFFFFFFFFULL
+
+/**
+ * The journal (COFS_FEAT_JOURNAL), journal_blocks blocks at journal_start,
+ * is split in two halves, used in turn by the transactions written, so the
+ * previous one stays whole until the next is committed. A transaction is
+ * a descriptor block listing where up to NUM_JTAGS blocks belong, followed
+ * by copies of them, maybe more descriptors and copies, then a commit block.
+ * The commit block has the crc32 of all the blocks before it; a transaction
+ * without a matching one was not committed and is ignored.
+ */
+#define COFS_JNL_MAGIC      0xC0F5D0C5
+#define COFS_JNL_DESC       1
+#define COFS_JNL_COMMIT     2
+
+struct cofs_jnl_header {
+    unsigned int jh_magic;      // COFS_JNL_MAGIC
+    unsigned int jh_type;       // COFS_JNL_DESC or COFS_JNL_COMMIT
+    unsigned int jh_seq;        // sequence number of the transaction
+    unsigned int jh_count;      // blocks listed (descriptor), in all (commit)
+    unsigned int jh_crc;        // commit only, crc32 of the transaction
+};
 
-// number of bits a block  of COFS_BLOCK_SIZE has - used in bitmap
-#define BITS_PER_BLOCK (COFS_BLOCK_SIZE * 8)
+// block numbers following the header of a descriptor
+#define NUM_JTAGS(bs) (((bs) - sizeof(struct cofs_jnl_header)) / sizeof(unsigned int))
+
+// number of bits a block of bs bytes has - used in bitmap
+#define BITS_PER_BLOCK(bs) ((bs) * 8)
 
 // block witch contains inode n
-#define INO_BLOCK(ino, superblock)    ((ino) / NUM_INOPB + superblock.inode_start)
+#define INO_BLOCK(ino, superblock)    \
+    ((ino) / NUM_INOPB(COFS_SB_BLOCK_SIZE(superblock), COFS_SB_INODE_SIZE(superblock)) \
+     + (superblock)->inode_start)
 
 // block of bitmap containing bit for block b //
-#define BITMAP_BLOCK(block, superblock) (block / BITS_PER_BLOCK + superblock->bitmap_start)
+#define BITMAP_BLOCK(block, superblock) \
+    ((block) / BITS_PER_BLOCK(COFS_SB_BLOCK_SIZE(superblock)) + (superblock)->bitmap_start)
 
 #define COFS_FILE_NAME_MAX_LEN 28
 // a structure that describe a filename in a directory
@@ -81,10 +221,121 @@ struct cofs_dirent {
     char d_name[COFS_FILE_NAME_MAX_LEN];
 };
 
+/**
+ * The dirent on a COFS_FEAT_FILETYPE file system. Same size, but the name
+ * gives 2 bytes to it's length and the type of the inode, so readdir
+ * can tell the type without reading the inode.
+ */
+struct cofs_dirent_ft {
+    unsigned int d_ino;
+    unsigned char d_name_len;
+    unsigned char d_type;           // S_IFMT bits of the inode >> 12, a DT_*
+    char d_name[COFS_FILE_NAME_MAX_LEN - 2];
+};
+
+#define COFS_DT(mode)           (((mode) & 0170000) >> 12)
+#define COFS_NAME_MAX(ft)       ((ft) ? COFS_FILE_NAME_MAX_LEN - 2 : COFS_FILE_NAME_MAX_LEN)
+
+/**
+ * Hashed directories (COFS_FEAT_DIR_HASH), an extendible hash of the names.
+ * Block 0 of the directory starts with a struct cofs_dx_header, followed by
+ * a table of 1 << dx_depth bucket numbers, indexed by the low dx_depth bits
+ * of the name hash. The table may continue in the next blocks, up to
+ * COFS_DX_FIRST_BUCKET. Bucket n lives in block COFS_DX_FIRST_BUCKET + n and
+ * holds the names whose hash ends in it's low db_depth bits. Several table
+ * entries point to the same bucket while it's depth is below dx_depth.
+ * A full bucket is split in two, doubling the table first if needed.
+ * Both headers start with a zero inode number, so readers of dirents skip them.
+ */
+#define COFS_DX_MAGIC       0xD1C05A5E
+#define COFS_DX_MAX_DEPTH   12
+
+struct cofs_dx_header {
+    unsigned int dx_zero;       // always 0, an unused dirent
+    unsigned int dx_magic;      // COFS_DX_MAGIC
+    unsigned int dx_depth;      // the table has 1 << dx_depth entries
+    unsigned int dx_buckets;    // number of buckets
+};
+
+struct cofs_dx_bucket {
+    unsigned int db_zero;       // always 0, an unused dirent
+    unsigned int db_magic;      // COFS_DX_MAGIC
+    unsigned int db_depth;      // hash bits shared by the names in it
+};
+
+// byte offset of table entry i, in the directory
+#define COFS_DX_ENTRY_OFFSET(i) (sizeof(struct cofs_dx_header) + (i) * sizeof(unsigned int))
+// first block of buckets, after the largest table
+#define COFS_DX_FIRST_BUCKET(bs)    \
+    ((COFS_DX_ENTRY_OFFSET(1 << COFS_DX_MAX_DEPTH) + (bs) - 1) / (bs))
+
+/**
+ * Hash of a directory entry name, at most len bytes of it (FNV-1a)
+ */
+static inline unsigned int cofs_name_hash(const char *name, unsigned int len)
+{
+    unsigned int hash = 2166136261u;
+    while (len-- && *name) {
+        hash ^= (unsigned char) *name++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * Dirent helpers, ft tells if the file system has COFS_FEAT_FILETYPE
+ */
+static inline char *cofs_dirent_name(struct cofs_dirent *de, int ft)
+{
+    return ft ? ((struct cofs_dirent_ft *) de)->d_name : de->d_name;
+}
+
+static inline unsigned int cofs_dirent_namelen(struct cofs_dirent *de, int ft)
+{
+    if (ft)
+        return ((struct cofs_dirent_ft *) de)->d_name_len;
+    return strnlen(de->d_name, COFS_FILE_NAME_MAX_LEN);
+}
+
+static inline unsigned int cofs_dirent_hash(struct cofs_dirent *de, int ft)
+{
+    return cofs_name_hash(cofs_dirent_name(de, ft), cofs_dirent_namelen(de, ft));
+}
+
+// names longer than what fits in a dirent are cut
+static inline int cofs_dirent_match(struct cofs_dirent *de, int ft,
+        const char *name, unsigned int len)
+{
+    if (len > COFS_NAME_MAX(ft))
+        len = COFS_NAME_MAX(ft);
+    return cofs_dirent_namelen(de, ft) == len
+        && !memcmp(cofs_dirent_name(de, ft), name, len);
+}
+
+static inline void cofs_dirent_set(struct cofs_dirent *de, int ft, unsigned int ino,
+        const char *name, unsigned int len, unsigned int mode)
+{
+    struct cofs_dirent_ft *def = (struct cofs_dirent_ft *) de;
+
+    if (len > COFS_NAME_MAX(ft))
+        len = COFS_NAME_MAX(ft);
+    memset(de, 0, sizeof(*de));
+    de->d_ino = ino;
+    if (ft) {
+        def->d_name_len = len;
+        def->d_type = COFS_DT(mode);
+    }
+    memcpy(cofs_dirent_name(de, ft), name, len);
+}
+
 #ifndef cofs_min
     #define cofs_min(a, b) ((a) < (b) ? (a) : (b))
 #endif
 
+#ifndef cofs_max
+    #define cofs_max(a, b) ((a) > (b) ? (a) : (b))
+#endif
+
 #ifndef FS_DIRECTORY
     #define FS_DIRECTORY    0040000
 #endif
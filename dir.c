@@ -1,33 +1,507 @@
+#include <linux/bitrev.h>
 #include <linux/buffer_head.h>
+#include <linux/compat.h>
 #include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/sort.h>
 #include "cofs_common.h"
+#include "super.h"
 #include "inode.h"
 #include "block.h"
+#include "dircache.h"
+#include "orphan.h"
+#include "journal.h"
+
+/**
+ * Reads a block of a directory. If create is set, a block not mapped yet
+ * is allocated, else it's an error
+ */
+static struct buffer_head *cofs_dir_bread(struct inode *dir, unsigned int block,
+        int create)
+{
+    unsigned int block_no;
+
+    if (create)
+        block_no = cofs_get_real_block(dir, block);
+    else
+        block_no = cofs_lookup_block(dir, block);
+    if (!block_no) {
+        pr_err("cofs_dir_bread: invalid block %u, inode: %lu\n", block, dir->i_ino);
+        return NULL;
+    }
+    return sb_bread(dir->i_sb, block_no);
+}
+
+// the first bucket block of a hashed directory
+static inline unsigned int cofs_dx_first(struct inode *dir)
+{
+    return COFS_DX_FIRST_BUCKET(dir->i_sb->s_blocksize);
+}
+
+/**
+ * Is this directory hashed? Looks at the header in block 0 the first time.
+ * Lookups run in parallel, so it's done under i_dir_lock and only the
+ * final format is published. If block 0 cannot be read it stays unknown,
+ * and -EIO is returned.
+ */
+static int cofs_dir_hashed(struct inode *dir)
+{
+    struct cofs_inode_info *ci = COFS_I(dir);
+    struct cofs_dx_header *dx;
+    struct buffer_head *bh;
+    unsigned int format;
+
+    if ((format = READ_ONCE(ci->i_dir_format)) != COFS_DIR_UNKNOWN)
+        return format == COFS_DIR_HASHED;
+    mutex_lock(&ci->i_dir_lock);
+    if ((format = ci->i_dir_format) != COFS_DIR_UNKNOWN)
+        goto out;
+    format = COFS_DIR_LINEAR;
+    if (COFS_HAS_FEATURE(COFS_SB(dir->i_sb)->s_sb, COFS_FEAT_DIR_HASH)
+            && dir->i_size >= (cofs_dx_first(dir) + 1) * dir->i_sb->s_blocksize) {
+        if (!(bh = cofs_dir_bread(dir, 0, 0))) {
+            mutex_unlock(&ci->i_dir_lock);
+            return -EIO;
+        }
+        dx = (struct cofs_dx_header *) bh->b_data;
+        if (dx->dx_zero == 0 && dx->dx_magic == COFS_DX_MAGIC)
+            format = COFS_DIR_HASHED;
+        brelse(bh);
+    }
+    WRITE_ONCE(ci->i_dir_format, format);
+out:
+    mutex_unlock(&ci->i_dir_lock);
+    return format == COFS_DIR_HASHED;
+}
+
+/**
+ * A cursor over the bucket table of a hashed directory.
+ * Keeps the last table block read, entries are mostly walked in order.
+ */
+struct cofs_dx_table {
+    struct inode *dir;
+    struct buffer_head *bh;
+    unsigned int block;         // directory block in bh
+    int create;                 // allocate the table blocks, when it grows
+};
+
+static int cofs_dx_load(struct cofs_dx_table *t, unsigned int block)
+{
+    if (t->bh && t->block == block)
+        return 0;
+    brelse(t->bh);
+    if (!(t->bh = cofs_dir_bread(t->dir, block, t->create)))
+        return -EIO;
+    t->block = block;
+    return 0;
+}
+
+static struct cofs_dx_header *cofs_dx_header(struct cofs_dx_table *t)
+{
+    if (cofs_dx_load(t, 0))
+        return NULL;
+    return (struct cofs_dx_header *) t->bh->b_data;
+}
+
+static unsigned int *cofs_dx_entry(struct cofs_dx_table *t, unsigned int i)
+{
+    unsigned int offs = COFS_DX_ENTRY_OFFSET(i);
+
+    if (cofs_dx_load(t, offs / t->dir->i_sb->s_blocksize))
+        return NULL;
+    return (unsigned int *) (t->bh->b_data + offs % t->dir->i_sb->s_blocksize);
+}
+
+/**
+ * Makes dir an empty hashed directory: a table of one entry and one bucket.
+ * What block 0 held is overwritten, the caller keeps it's names.
+ */
+static int cofs_dx_create(struct inode *dir)
+{
+    struct buffer_head *bh;
+    struct cofs_dx_header *dx;
+    struct cofs_dx_bucket *db;
+
+    if (!(bh = cofs_dir_bread(dir, 0, 1)))
+        return -EIO;
+    memset(bh->b_data, 0, dir->i_sb->s_blocksize);
+    dx = (struct cofs_dx_header *) bh->b_data;
+    dx->dx_magic = COFS_DX_MAGIC;
+    dx->dx_depth = 0;
+    dx->dx_buckets = 1;     // and table entry 0 points to bucket 0
+    cofs_journal_dirty_inode(bh, dir);
+    brelse(bh);
+
+    if (!(bh = cofs_dir_bread(dir, cofs_dx_first(dir), 1)))
+        return -EIO;
+    memset(bh->b_data, 0, dir->i_sb->s_blocksize);
+    db = (struct cofs_dx_bucket *) bh->b_data;
+    db->db_magic = COFS_DX_MAGIC;
+    db->db_depth = 0;
+    cofs_journal_dirty_inode(bh, dir);
+    brelse(bh);
+
+    dir->i_size = (cofs_dx_first(dir) + 1) * dir->i_sb->s_blocksize;
+    WRITE_ONCE(COFS_I(dir)->i_dir_format, COFS_DIR_HASHED);
+    return 0;
+}
+
+/**
+ * Reads the bucket where names with this hash live
+ */
+static struct buffer_head *cofs_dx_bucket(struct inode *dir, unsigned int hash,
+        unsigned int *bucket)
+{
+    struct cofs_dx_table t = { .dir = dir };
+    struct cofs_dx_header *dx;
+    unsigned int *entry;
+
+    if (!(dx = cofs_dx_header(&t)))
+        return NULL;
+    entry = cofs_dx_entry(&t, hash & ((1U << dx->dx_depth) - 1));
+    if (entry)
+        *bucket = *entry;
+    brelse(t.bh);
+    if (!entry)
+        return NULL;
+    return cofs_dir_bread(dir, cofs_dx_first(dir) + *bucket, 0);
+}
+
+/**
+ * Looks for name in a hashed directory. On success the bucket is left
+ * in bh, for the caller to release. Returns NULL if there is no such name,
+ * or an error if the bucket cannot be read.
+ */
+static struct cofs_dirent *cofs_dx_find(struct inode *dir, const char *name,
+        unsigned int len, struct buffer_head **bh)
+{
+    int ft = cofs_has_filetype(dir->i_sb);
+    unsigned int hash, bucket;
+    struct cofs_dirent *cdir;
+
+    hash = cofs_name_hash(name, cofs_min(len, COFS_NAME_MAX(ft)));
+
+    if (!(*bh = cofs_dx_bucket(dir, hash, &bucket)))
+        return ERR_PTR(-EIO);
+    // first slot holds the bucket header
+    cdir = (struct cofs_dirent *) (*bh)->b_data + 1;
+    while (cdir < (struct cofs_dirent *) ((*bh)->b_data + dir->i_sb->s_blocksize)) {
+        if (cdir->d_ino && cofs_dirent_match(cdir, ft, name, len))
+            return cdir;
+        cdir++;
+    }
+    brelse(*bh);
+    *bh = NULL;
+    return NULL;
+}
+
+/**
+ * Splits a full bucket, moving the names with the next hash bit set into
+ * a new bucket. When the bucket already uses all the table bits, the table
+ * is doubled first. hash is the hash of a name that maps to this bucket.
+ */
+static int cofs_dx_split(struct inode *dir, unsigned int bucket, unsigned int hash)
+{
+    struct cofs_dx_table t = { .dir = dir, .create = 1 }, src = { .dir = dir };
+    struct cofs_dx_header *dx;
+    struct cofs_dx_bucket *db, *ndb;
+    struct buffer_head *bh = NULL, *nbh = NULL;
+    struct cofs_dirent *cdir, *ndir, *end;
+    unsigned int depth, nbucket, ldepth, i, *entry, *from;
+    int ft = cofs_has_filetype(dir->i_sb);
+    int err = -EIO;
+
+    if (!(dx = cofs_dx_header(&t)))
+        goto out;
+    depth = dx->dx_depth;
+    nbucket = dx->dx_buckets;
+    if (!(bh = cofs_dir_bread(dir, cofs_dx_first(dir) + bucket, 0)))
+        goto out;
+    db = (struct cofs_dx_bucket *) bh->b_data;
+    ldepth = db->db_depth;
+
+    if (ldepth == depth) {
+        if (depth == COFS_DX_MAX_DEPTH) {
+            pr_debug("cofs_dx_split: directory %lu is full\n", dir->i_ino);
+            err = -ENOSPC;
+            goto out;
+        }
+        // the new half of the table is a copy of the old one
+        for (i = 0; i < (1U << depth); i++) {
+            if (!(from = cofs_dx_entry(&src, i)))
+                goto out;
+            if (!(entry = cofs_dx_entry(&t, i + (1U << depth))))
+                goto out;
+            *entry = *from;
+            cofs_journal_dirty_inode(t.bh, dir);
+        }
+        depth++;
+        if (!(dx = cofs_dx_header(&t)))
+            goto out;
+        dx->dx_depth = depth;
+        cofs_journal_dirty_inode(t.bh, dir);
+        pr_debug("cofs_dx_split: directory %lu table depth %u\n", dir->i_ino, depth);
+    }
+
+    if (!(nbh = cofs_dir_bread(dir, cofs_dx_first(dir) + nbucket, 1)))
+        goto out;
+    memset(nbh->b_data, 0, dir->i_sb->s_blocksize);
+    ndb = (struct cofs_dx_bucket *) nbh->b_data;
+    ndb->db_magic = COFS_DX_MAGIC;
+    ndb->db_depth = ldepth + 1;
+    db->db_depth = ldepth + 1;
+
+    cdir = (struct cofs_dirent *) bh->b_data + 1;
+    ndir = (struct cofs_dirent *) nbh->b_data + 1;
+    end = (struct cofs_dirent *) (bh->b_data + dir->i_sb->s_blocksize);
+    for (; cdir < end; cdir++) {
+        if (!cdir->d_ino)
+            continue;
+        if ((cofs_dirent_hash(cdir, ft) >> ldepth) & 1) {
+            *ndir++ = *cdir;
+            memset(cdir, 0, sizeof(*cdir));
+        }
+    }
+    cofs_journal_dirty_inode(bh, dir);
+    cofs_journal_dirty_inode(nbh, dir);
+
+    // entries ending in the bucket bits plus a set next bit, go to the new one
+    hash &= (1U << ldepth) - 1;
+    for (i = hash | (1U << ldepth); i < (1U << depth); i += 1U << (ldepth + 1)) {
+        if (!(entry = cofs_dx_entry(&t, i)))
+            goto out;
+        *entry = nbucket;
+        cofs_journal_dirty_inode(t.bh, dir);
+    }
+    if (!(dx = cofs_dx_header(&t)))
+        goto out;
+    dx->dx_buckets = nbucket + 1;
+    cofs_journal_dirty_inode(t.bh, dir);
+    dir->i_size = (cofs_dx_first(dir) + nbucket + 1) * dir->i_sb->s_blocksize;
+    err = 0;
+out:
+    brelse(nbh);
+    brelse(bh);
+    brelse(src.bh);
+    brelse(t.bh);
+    return err;
+}
+
+/**
+ * Adds name to a hashed directory, splitting it's bucket while full
+ */
+static int cofs_dx_link(struct inode *dir, unsigned int ino, const char *name,
+        unsigned int len, umode_t mode)
+{
+    int ft = cofs_has_filetype(dir->i_sb);
+    unsigned int hash, bucket;
+    struct buffer_head *bh;
+    struct cofs_dirent *cdir;
+    int err;
+
+    hash = cofs_name_hash(name, cofs_min(len, COFS_NAME_MAX(ft)));
+    for (;;) {
+        if (!(bh = cofs_dx_bucket(dir, hash, &bucket)))
+            return -EIO;
+        cdir = (struct cofs_dirent *) bh->b_data + 1;
+        while (cdir < (struct cofs_dirent *) (bh->b_data + dir->i_sb->s_blocksize)) {
+            if (cdir->d_ino == 0) {
+                cofs_dirent_set(cdir, ft, ino, name, len, mode);
+                cofs_journal_dirty_inode(bh, dir);
+                brelse(bh);
+                return 0;
+            }
+            cdir++;
+        }
+        brelse(bh);
+        if ((err = cofs_dx_split(dir, bucket, hash)))
+            return err;
+    }
+}
+
+/*
+ * readdir positions in a hashed directory: the name hash with it's bits
+ * reversed, then how many names of that hash were read already. A 32 bit
+ * caller (compat getdents, NFSv2/v3 cookies) keeps 31 bits: the top 24 bits
+ * of the hash, then how many names sharing them were read.
+ */
+#define COFS_DX_HBITS(b32)      ((b32) ? 24 : 32)
+#define COFS_DX_KBITS(b32)      ((b32) ? 7 : 16)
+#define COFS_DX_POS(b32, g, k)  (((loff_t) (g) << COFS_DX_KBITS(b32)) | (k))
+#define COFS_DX_POS_END(b32)    ((b32) ? 0x7fffffffLL : COFS_DX_POS(0, 1ULL << 32, 0))
+
+// like ext4, NFS tells what it wants, else it's the size of the syscall
+static int cofs_dx_32bit(struct file *file)
+{
+    if (file->f_mode & FMODE_32BITHASH)
+        return 1;
+    if (file->f_mode & FMODE_64BITHASH)
+        return 0;
+#ifdef CONFIG_COMPAT
+    return in_compat_syscall();
+#else
+    return BITS_PER_LONG == 32;
+#endif
+}
+
+static int cofs_dx_key_cmp(const void *a, const void *b)
+{
+    u64 x = *(const u64 *) a, y = *(const u64 *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * Reads a hashed directory in hash order. A bucket holds the names ending
+ * in the same hash bits; with the bits reversed, it's a range of positions,
+ * and a split cuts that range in two. So names moved by a split between
+ * two calls are neither shown twice nor missed.
+ */
+static int cofs_dx_readdir(struct file *file, struct dir_context *ctx)
+{
+    struct inode *dir = file_inode(file);
+    struct super_block *sb = dir->i_sb;
+    int ft = cofs_has_filetype(sb), b32 = cofs_dx_32bit(file);
+    unsigned int nslots = sb->s_blocksize / sizeof(struct cofs_dirent);
+    unsigned int gshift = 32 - COFS_DX_HBITS(b32);
+    unsigned int rhash, k, dup, g, mask, bucket, i, n;
+    loff_t end = COFS_DX_POS_END(b32);
+    struct buffer_head *bh;
+    struct cofs_dirent *cdir, *de;
+    u64 *keys;
+    int err = 0;
+
+    if (ctx->pos >= end)
+        return 0;
+    // bit reversed hash and slot of the names of a bucket, to sort them
+    if (!(keys = kmalloc_array(nslots, sizeof(*keys), GFP_KERNEL)))
+        return -ENOMEM;
+    while (ctx->pos < end) {
+        rhash = (unsigned int) (ctx->pos >> COFS_DX_KBITS(b32)) << gshift;
+        k = ctx->pos & ((1U << COFS_DX_KBITS(b32)) - 1);
+        if (!(bh = cofs_dx_bucket(dir, bitrev32(rhash), &bucket))) {
+            err = -EIO;
+            break;
+        }
+        // the bucket covers the positions up to rhash | mask
+        mask = ~0U >> ((struct cofs_dx_bucket *) bh->b_data)->db_depth;
+        // first slot holds the bucket header
+        cdir = (struct cofs_dirent *) bh->b_data;
+        for (i = 1, n = 0; i < nslots; i++) {
+            if (!cdir[i].d_ino)
+                continue;
+            g = bitrev32(cofs_dirent_hash(&cdir[i], ft));
+            if (g >= rhash)
+                keys[n++] = (u64) g << 32 | i;
+        }
+        sort(keys, n, sizeof(*keys), cofs_dx_key_cmp, NULL);
+        for (i = 0, dup = 0; i < n; i++) {
+            g = keys[i] >> (32 + gshift);
+            dup = i && g == keys[i - 1] >> (32 + gshift) ? dup + 1 : 0;
+            if (g == rhash >> gshift && dup < k)
+                continue;
+            de = &cdir[(u32) keys[i]];
+            ctx->pos = COFS_DX_POS(b32, g, dup);
+            // stop when the user buffer is full, we continue from ctx->pos
+            if (!dir_emit(ctx, cofs_dirent_name(de, ft), cofs_dirent_namelen(de, ft),
+                        de->d_ino, ft ? ((struct cofs_dirent_ft *) de)->d_type : DT_UNKNOWN)) {
+                brelse(bh);
+                goto out;
+            }
+            ctx->pos = COFS_DX_POS(b32, g, dup + 1);
+        }
+        brelse(bh);
+        // buckets are at most COFS_DX_MAX_DEPTH bits deep, they end on a group
+        ctx->pos = (rhash | mask) == ~0U ? end
+            : COFS_DX_POS(b32, ((rhash | mask) + 1) >> gshift, 0);
+    }
+out:
+    kfree(keys);
+    return err;
+}
+
+/**
+ * A linear directory outgrows block 0: make it hashed and move the names in
+ * buckets. If that fails, block 0 is put back and the buckets dropped.
+ */
+static int cofs_dx_convert(struct inode *dir)
+{
+    struct cofs_inode_info *ci = COFS_I(dir);
+    unsigned int bs = dir->i_sb->s_blocksize;
+    int ft = cofs_has_filetype(dir->i_sb);
+    struct cofs_dirent *names, *cdir;
+    struct buffer_head *bh;
+    int err = -EIO;
+
+    if (!(names = kmalloc(bs, GFP_NOFS)))
+        return -ENOMEM;
+    if (!(bh = cofs_dir_bread(dir, 0, 0)))
+        goto out;
+    memcpy(names, bh->b_data, bs);
+    brelse(bh);
+    if ((err = cofs_dx_create(dir)))
+        goto undo;
+    for (cdir = names; cdir < names + bs / sizeof(*cdir); cdir++) {
+        if (cdir->d_ino && (err = cofs_dx_link(dir, cdir->d_ino, cofs_dirent_name(cdir, ft),
+                        cofs_dirent_namelen(cdir, ft),
+                        ft ? ((struct cofs_dirent_ft *) cdir)->d_type << 12 : 0)))
+            goto undo;
+    }
+    // positions of names in block 0 mean nothing now
+    mutex_lock(&ci->i_dir_lock);
+    cofs_dircache_release(dir);
+    mutex_unlock(&ci->i_dir_lock);
+    pr_debug("cofs_dx_convert: directory %lu is hashed\n", dir->i_ino);
+    mark_inode_dirty(dir);
+    goto out;
+undo:
+    if ((bh = cofs_dir_bread(dir, 0, 0))) {
+        memcpy(bh->b_data, names, bs);
+        cofs_journal_dirty_inode(bh, dir);
+        brelse(bh);
+    }
+    WRITE_ONCE(ci->i_dir_format, COFS_DIR_LINEAR);
+    dir->i_size = bs;
+    cofs_truncate(dir, bs, dir->i_sb->s_maxbytes);
+out:
+    kfree(names);
+    return err;
+}
 
 static int cofs_readdir(struct file *file, struct dir_context *ctx)
 {
     struct buffer_head *bh = NULL;
     struct inode *inode = file_inode(file);
-    unsigned int block_no;
-    int offs, total;
-    struct cofs_dirent *cdir;
+    int offs;
+    struct cofs_dirent *cdir, *end;
+    int ft = cofs_has_filetype(inode->i_sb);
+    int hashed = cofs_dir_hashed(inode);
     
+    if (hashed < 0)
+        return hashed;
+    if (hashed)
+        return cofs_dx_readdir(file, ctx);
+
     while (ctx->pos < inode->i_size) {
-        block_no = cofs_get_real_block(inode, ctx->pos / COFS_BLOCK_SIZE);
-        offs = ctx->pos % COFS_BLOCK_SIZE;
-        bh = sb_bread(inode->i_sb, block_no);
-        total = 0;
-        do {
-            cdir = (struct cofs_dirent *) (bh->b_data + offs);
-            if (cdir->d_ino) {
-                dir_emit(ctx, cdir->d_name, COFS_FILE_NAME_MAX_LEN, cdir->d_ino, 
-                        DT_UNKNOWN);
+        offs = ctx->pos & (inode->i_sb->s_blocksize - 1);
+        cdir = cofs_dir_block(inode, ctx->pos >> inode->i_blkbits, &bh, &end);
+        if (IS_ERR(cdir))
+            return PTR_ERR(cdir);
+        // a hole has no entries
+        if (!cdir) {
+            ctx->pos += inode->i_sb->s_blocksize - offs;
+            continue;
+        }
+        for (cdir += offs / sizeof(*cdir); cdir < end; cdir++) {
+            // stop when the user buffer is full, we continue from ctx->pos
+            if (cdir->d_ino && !dir_emit(ctx, cofs_dirent_name(cdir, ft), 
+                        cofs_dirent_namelen(cdir, ft), cdir->d_ino, 
+                        ft ? ((struct cofs_dirent_ft *) cdir)->d_type : DT_UNKNOWN)) {
+                brelse(bh);
+                return 0;
             }
-            offs += sizeof(*cdir);
-            total += sizeof(*cdir);
-        } while (offs < COFS_BLOCK_SIZE);
-
-        ctx->pos += total;
+            ctx->pos += sizeof(*cdir);
+        }
         brelse(bh);
     }
 
@@ -38,88 +512,185 @@ static int cofs_readdir(struct file *file, struct dir_context *ctx)
  * This file is called when kernel is resolving a path. 
  * dir is the inode of the parent, in dentry we find the name is looking for
  * It is querying the parent inode and check for the file name in dentry.
- * If it founds one, it populates it's inode by calling d_add
+ * If it founds one, it populates it's inode by calling d_add. If not, the
+ * dentry is added without an inode, so the kernel remembers the name is
+ * missing and does not ask again.
  */
 struct dentry *cofs_lookup(struct inode *dir, struct dentry *dentry, 
         unsigned int what)
 {
     struct buffer_head *bh;
-    unsigned int num_blocks, block, block_no;
-    struct inode *inode;
-    struct cofs_dirent *cdir;
+    unsigned int num_blocks, block, ino = 0, pos;
+    struct inode *inode = NULL;
+    struct cofs_dirent *cdir, *end;
+    const char *name = (const char *) dentry->d_name.name;
+    unsigned int len = dentry->d_name.len;
+    int ft = cofs_has_filetype(dir->i_sb);
+    int err;
     
-    num_blocks = dir->i_size / COFS_BLOCK_SIZE;
+    if ((err = cofs_dir_hashed(dir)) < 0)
+        return ERR_PTR(err);
+    if (err) {
+        cdir = cofs_dx_find(dir, name, len, &bh);
+        // an error must not be cached as a negative dentry
+        if (IS_ERR(cdir))
+            return ERR_CAST(cdir);
+        if (cdir)
+            goto found;
+        goto out;
+    }
+    err = cofs_dircache_lookup(dir, name, len, &ino, &pos);
+    if (err == 0 || err == -ENOENT)
+        goto out;
+    // no memory for the names cache, read the directory
+    num_blocks = DIV_ROUND_UP(dir->i_size, dir->i_sb->s_blocksize);
     for (block = 0; block < num_blocks; block++) {
-        if (!(block_no = cofs_get_real_block(dir, block))) {
-            pr_err("cofs_lookup: invalid block %u, inode: %lu\n", block, dir->i_ino);
-            return NULL;
-        }
-        bh = sb_bread(dir->i_sb, block_no);
-        cdir = (struct cofs_dirent *) bh->b_data;
-        while (cdir < (struct cofs_dirent *) (bh->b_data + COFS_BLOCK_SIZE)) {
+        cdir = cofs_dir_block(dir, block, &bh, &end);
+        if (IS_ERR(cdir))
+            return ERR_CAST(cdir);
+        if (!cdir)
+            continue;   // a hole
+        while (cdir < end) {
             if(cdir->d_ino != 0) {
-                if(!strncmp(cdir->d_name, dentry->d_name.name, COFS_FILE_NAME_MAX_LEN)) {
-                    inode = cofs_iget(dir->i_sb, cdir->d_ino);
-                    d_add(dentry, inode);
-                    return NULL;
-                }
+                if (cofs_dirent_match(cdir, ft, name, len))
+                    goto found;
             }
             cdir++;
         }
         brelse(bh);
     }
+    goto out;
+found:
+    ino = cdir->d_ino;
+    brelse(bh);
+out:
+    if (ino) {
+        inode = cofs_iget(dir->i_sb, ino);
+        if (IS_ERR(inode))
+            return ERR_CAST(inode);
+    }
+    d_add(dentry, inode);
     return NULL;
 }
 
+/**
+ * Moves the dirents of an inline directory, full now, into block 0
+ */
+static int cofs_dir_expand(struct inode *dir)
+{
+    struct buffer_head *bh, *ibh;
+    unsigned int bs = dir->i_sb->s_blocksize;
+    char *data;
+
+    if (!(data = cofs_inline_data(dir, &ibh)))
+        return -EIO;
+    COFS_I(dir)->i_flags &= ~COFS_INODE_INLINE;
+    if (!(bh = cofs_dir_bread(dir, 0, 1))) {
+        COFS_I(dir)->i_flags |= COFS_INODE_INLINE;
+        brelse(ibh);
+        return -EIO;
+    }
+    memcpy(bh->b_data, data, dir->i_size);
+    memset(bh->b_data + dir->i_size, 0, bs - dir->i_size);
+    cofs_journal_dirty_inode(bh, dir);
+    brelse(bh);
+    memset(data, 0, cofs_inline_max(dir->i_sb));
+    cofs_journal_dirty_inode(ibh, dir);
+    brelse(ibh);
+    pr_debug("cofs_dir_expand: directory %lu moved to block 0\n", dir->i_ino);
+    dir->i_size = bs;
+    mark_inode_dirty(dir);
+    return 0;
+}
+
 /**
  * Adds an entry into parent inode to this inode, with name 
  * The function do not check if this inode number is already linked, that's
  * the responsability of the caller
  */
-static int cofs_dir_link(struct inode *dir, unsigned int ino, const char *name)
+static int cofs_dir_link(struct inode *dir, unsigned int ino, const char *name,
+        unsigned int len, umode_t mode)
 {
     struct buffer_head *bh;
     unsigned int num_blocks,    // total number of blocks this file has
                  block,         // used for iteration
-                 block_no;      // physical block number (on disk)
-    struct cofs_dirent *cdir;
+                 block_no,      // physical block number (on disk)
+                 pos;           // offset of the new dirent
+    struct cofs_dirent *cdir, *first, *end;
+    int ft = cofs_has_filetype(dir->i_sb);
+    int hashed;
     
     pr_debug("cofs_dir_link: linking inode %u, name %s, to it's parent %lu\n", 
             ino, name, dir->i_ino);
 
-    num_blocks = dir->i_size / COFS_BLOCK_SIZE;
+    if ((hashed = cofs_dir_hashed(dir)) < 0)
+        return -1;
+    if (hashed) {
+        if (cofs_dx_link(dir, ino, name, len, mode))
+            return -1;
+        goto linked;
+    }
+    if (cofs_inode_inline(dir)) {
+        block = 0;
+        num_blocks = 1;
+        first = cofs_dir_block(dir, 0, &bh, &end);
+        if (IS_ERR(first))
+            return -1;
+        for (cdir = first; cdir < end; cdir++) {
+            if (cdir->d_ino == 0)
+                goto found;
+        }
+        brelse(bh);
+        // no room left in the inode
+        if (cofs_dir_expand(dir))
+            return -1;
+    }
+    num_blocks = dir->i_size >> dir->i_blkbits;
 
     // yes, block <= num_blocks. 
     // If we pass the boundary, a new block will be allocated //
-    for (block = 0; block <= num_blocks; block++) {
+    // The names cache knows there is no free dirent before it's c_free
+    for (block = cofs_dircache_free_pos(dir) >> dir->i_blkbits; 
+            block <= num_blocks; block++) {
+        // rather than a second block, a hashed directory
+        if (block == 1 && num_blocks == 1
+                && COFS_HAS_FEATURE(COFS_SB(dir->i_sb)->s_sb, COFS_FEAT_DIR_HASH)) {
+            if (cofs_dx_convert(dir) || cofs_dx_link(dir, ino, name, len, mode))
+                return -1;
+            goto linked;
+        }
         if (!(block_no = cofs_get_real_block(dir, block))) {
             printk("cofs_dir_link: invalid block for %s, block: %u", name, block_no);
             return -1;
         }
         bh = sb_bread(dir->i_sb, block_no);
-        cdir = (struct cofs_dirent *) bh->b_data;
-        while(cdir < (struct cofs_dirent *) (bh->b_data + COFS_BLOCK_SIZE)) {
-            if (cdir->d_ino == 0) {
-                cdir->d_ino = ino;
-                strncpy(cdir->d_name, name, COFS_FILE_NAME_MAX_LEN);
-                mark_buffer_dirty(bh);
-                brelse(bh);
-                // if is a newly allocated buffer, update it's size
-                if (block == num_blocks) {
-                    pr_debug("cofs_dir_link: a new block was alocated: %u\n", block_no);
-                    dir->i_size += COFS_BLOCK_SIZE;
-                }
-                inc_nlink(dir);
-                pr_debug("cofs_dir_link: inode: %lu, no links: %u\n", 
-                        dir->i_ino, dir->i_nlink);
-                cofs_iput(dir);
-                return 0;
-            }
-            cdir++;
+        first = (struct cofs_dirent *) bh->b_data;
+        end = (struct cofs_dirent *) (bh->b_data + dir->i_sb->s_blocksize);
+        for (cdir = first; cdir < end; cdir++) {
+            if (cdir->d_ino == 0)
+                goto found;
         }
         brelse(bh);
     }
     return -1;
+found:
+    cofs_dirent_set(cdir, ft, ino, name, len, mode);
+    pos = block * dir->i_sb->s_blocksize + (cdir - first) * sizeof(*cdir);
+    cofs_journal_dirty_inode(bh, dir);
+    brelse(bh);
+    cofs_dircache_add(dir, name, len, ino, pos);
+    // if is a newly allocated buffer, update it's size
+    if (block == num_blocks) {
+        pr_debug("cofs_dir_link: a new block was alocated: %u\n", block);
+        dir->i_size += dir->i_sb->s_blocksize;
+    }
+linked:
+    inc_nlink(dir);
+    dir->i_mtime = dir->i_ctime = current_time(dir);
+    pr_debug("cofs_dir_link: inode: %lu, no links: %u\n", 
+            dir->i_ino, dir->i_nlink);
+    mark_inode_dirty(dir);
+    return 0;
 }
 
 static int cofs_mknod(struct inode *dir, struct dentry *dentry, umode_t mode, dev_t dev)
@@ -127,15 +698,21 @@ static int cofs_mknod(struct inode *dir, struct dentry *dentry, umode_t mode, de
     unsigned int m = mode & S_IFMT;
     struct inode *inode;
 
-    inode = cofs_inode_alloc(dir->i_sb, m);
+    cofs_journal_start(dir->i_sb);
+    inode = cofs_inode_alloc(dir, m);
     inode->i_mode = mode;
     set_nlink(inode, 1);
-    d_add(dentry, inode); // do we need this?
+    // starts linear, or inline; hashed once it outgrows block 0
     if (m & S_IFDIR) {
-        cofs_dir_link(inode, inode->i_ino, ".");    // add an entry to itself
-        cofs_dir_link(inode, dir->i_ino, "..");     // add an entry to it's parent
+        cofs_dir_link(inode, inode->i_ino, ".", 1, S_IFDIR);   // add an entry to itself
+        cofs_dir_link(inode, dir->i_ino, "..", 2, S_IFDIR);    // add an entry to it's parent
     }
-    cofs_dir_link(dir, inode->i_ino, dentry->d_name.name); // self link to parent
+    // self link to parent
+    cofs_dir_link(dir, inode->i_ino, (const char *) dentry->d_name.name, 
+            dentry->d_name.len, mode);
+    // dentry may be a negative one from lookup, already hashed
+    d_instantiate(dentry, inode);
+    cofs_journal_stop(dir->i_sb);
 
     pr_debug("cofs: mknod %s, inode: %lu, mode: %d\n", 
             dentry->d_name.name, inode->i_ino, mode);
@@ -156,50 +733,93 @@ static int cofs_create(struct inode *dir, struct dentry *dentry, umode_t mode, b
     return cofs_mknod(dir, dentry, mode | S_IFREG, 0);
 }
 
-static int cofs_unlink(struct inode *dir, struct dentry *dentry)
+static int __cofs_unlink(struct inode *dir, struct dentry *dentry)
 {
     struct buffer_head *bh;
-    unsigned int num_blocks, block, block_no;
-    struct cofs_dirent *cdir;
+    unsigned int num_blocks, block, ino, pos = 0;
+    struct cofs_dirent *cdir, *first, *end;
+    const char *name = (const char *) dentry->d_name.name;
+    unsigned int len = dentry->d_name.len;
+    int hashed;
 
     pr_debug("cofs_unlink called for: parent inode: %lu, name: %s, ino: %lu\n",
             dir->i_ino, dentry->d_name.name, dentry->d_inode->i_ino);
     
-    num_blocks = dir->i_size / COFS_BLOCK_SIZE;
-    for (block = 0; block < num_blocks; block++) {
-        if (!(block_no = cofs_get_real_block(dir, block))) {
+    if ((hashed = cofs_dir_hashed(dir)) < 0)
+        return hashed;
+    if (hashed) {
+        cdir = cofs_dx_find(dir, name, len, &bh);
+        if (IS_ERR(cdir))
+            return PTR_ERR(cdir);
+        if (cdir && cdir->d_ino == dentry->d_inode->i_ino)
+            goto found;
+        brelse(bh);
+        return -1;
+    }
+    if (!cofs_dircache_lookup(dir, name, len, &ino, &pos) 
+            && ino == dentry->d_inode->i_ino) {
+        cdir = cofs_dir_block(dir, pos >> dir->i_blkbits, &bh, &end);
+        if (IS_ERR_OR_NULL(cdir)) {
             pr_err("cofs_unlink: invalid block %u, inode %lu\n", 
-                    block, dir->i_ino);
+                    pos >> dir->i_blkbits, dir->i_ino);
             return -1;
         }
-        bh = sb_bread(dir->i_sb, block_no);
-        cdir = (struct cofs_dirent *) bh->b_data;
-        while (cdir < (struct cofs_dirent *) (bh->b_data + COFS_BLOCK_SIZE)) {
+        cdir += pos % dir->i_sb->s_blocksize / sizeof(*cdir);
+        if (cdir->d_ino == ino)
+            goto found;
+        brelse(bh);
+    }
+    num_blocks = DIV_ROUND_UP(dir->i_size, dir->i_sb->s_blocksize);
+    for (block = 0; block < num_blocks; block++) {
+        first = cofs_dir_block(dir, block, &bh, &end);
+        if (IS_ERR(first))
+            return PTR_ERR(first);
+        if (!first)
+            continue;   // a hole
+        for (cdir = first; cdir < end; cdir++) {
             if (cdir->d_ino == dentry->d_inode->i_ino) {
-                pr_debug("cofs_unlink: inode %u, name: %s, n_links: %u\n", 
-                        cdir->d_ino, cdir->d_name, dentry->d_inode->i_nlink);
-                memset(cdir, 0, sizeof(*cdir));
-                mark_buffer_dirty(bh);
-                brelse(bh);
-                inode_dec_link_count(dentry->d_inode);
-                mark_inode_dirty(dentry->d_inode);
-#if 0
-                if (dentry->d_inode->i_nlink > 1) {
-                    pr_debug("links > 1: %d, not deleting inode\n", dentry->d_inode->i_nlink);
-                    set_nlink(dentry->d_inode, dentry->d_inode->i_nlink-1);
-                    cofs_iput(dentry->d_inode);
-                } else {
-                    pr_debug("links %d, deleting\n", dentry->d_inode->i_nlink);
-                    cofs_inode_delete(dentry->d_inode);
-                }
-#endif
-                return 0;
+                pos = block * dir->i_sb->s_blocksize + (cdir - first) * sizeof(*cdir);
+                goto found;
             }
-            cdir++;
         }
         brelse(bh);
     }
     return -1;
+found:
+    pr_debug("cofs_unlink: inode %u, name: %s, n_links: %u\n", 
+            cdir->d_ino, name, dentry->d_inode->i_nlink);
+    memset(cdir, 0, sizeof(*cdir));
+    cofs_journal_dirty_inode(bh, dir);
+    brelse(bh);
+    cofs_dircache_remove(dir, name, len, pos);
+    dir->i_mtime = dir->i_ctime = current_time(dir);
+    mark_inode_dirty(dir);
+    dentry->d_inode->i_ctime = dir->i_ctime;
+    inode_dec_link_count(dentry->d_inode);
+    if (!dentry->d_inode->i_nlink)
+        cofs_orphan_add(dentry->d_inode);
+    mark_inode_dirty(dentry->d_inode);
+#if 0
+    if (dentry->d_inode->i_nlink > 1) {
+        pr_debug("links > 1: %d, not deleting inode\n", dentry->d_inode->i_nlink);
+        set_nlink(dentry->d_inode, dentry->d_inode->i_nlink-1);
+        mark_inode_dirty(dentry->d_inode);
+    } else {
+        pr_debug("links %d, deleting\n", dentry->d_inode->i_nlink);
+        cofs_inode_delete(dentry->d_inode);
+    }
+#endif
+    return 0;
+}
+
+static int cofs_unlink(struct inode *dir, struct dentry *dentry)
+{
+    int err;
+
+    cofs_journal_start(dir->i_sb);
+    err = __cofs_unlink(dir, dentry);
+    cofs_journal_stop(dir->i_sb);
+    return err;
 }
 
 #if 0
@@ -223,10 +843,22 @@ struct inode_operations cofs_dir_inode_ops = {
     //.rename         = simple_rename,
 };
 
+/*
+ * Positions in a hashed directory are hashes, past the end of the file
+ */
+static loff_t cofs_dir_llseek(struct file *file, loff_t offset, int whence)
+{
+    loff_t end = COFS_DX_POS_END(cofs_dx_32bit(file));
+
+    if (cofs_dir_hashed(file_inode(file)) > 0)
+        return generic_file_llseek_size(file, offset, whence, end, end);
+    return generic_file_llseek(file, offset, whence);
+}
+
 struct file_operations cofs_dir_operations = {
-    .llseek     = generic_file_llseek,
+    .llseek     = cofs_dir_llseek,
     //.read       = generic_read_dir,
     .iterate    = cofs_readdir,
-    .fsync		= generic_file_fsync
+    .fsync      = cofs_fsync,
 };
 
@@ -0,0 +1,257 @@
+#include <linux/buffer_head.h>
+#include <linux/fs.h>
+#include <linux/slab.h>
+#include "cofs_common.h"
+#include "super.h"
+#include "inode.h"
+#include "dircache.h"
+
+#define COFS_DIRCACHE_MIN_BITS  4
+#define COFS_DIRCACHE_MAX_BITS  16
+
+struct cofs_dircache_entry {
+    struct hlist_node e_node;
+    unsigned int e_ino;
+    unsigned int e_pos;         // offset of the dirent in the directory
+    unsigned int e_len;
+    char e_name[COFS_FILE_NAME_MAX_LEN];
+};
+
+static struct hlist_head *cofs_dircache_chain(struct cofs_dircache *dc,
+        const char *name, unsigned int len)
+{
+    unsigned int hash = cofs_name_hash(name, len);
+    return &dc->c_hash[hash & ((1U << dc->c_bits) - 1)];
+}
+
+static struct cofs_dircache_entry *cofs_dircache_find(struct cofs_dircache *dc,
+        const char *name, unsigned int len)
+{
+    struct cofs_dircache_entry *e;
+
+    hlist_for_each_entry(e, cofs_dircache_chain(dc, name, len), e_node) {
+        if (e->e_len == len && !memcmp(e->e_name, name, len))
+            return e;
+    }
+    return NULL;
+}
+
+/**
+ * Doubles the chains when they get long. If there is no memory for it,
+ * we just keep the long chains.
+ */
+static void cofs_dircache_grow(struct cofs_dircache *dc)
+{
+    struct hlist_head *old = dc->c_hash, *hash;
+    struct cofs_dircache_entry *e;
+    struct hlist_node *tmp;
+    unsigned int i, n = 1U << dc->c_bits;
+
+    if (dc->c_count < 2 * n || dc->c_bits == COFS_DIRCACHE_MAX_BITS)
+        return;
+    if (!(hash = kmalloc_array(2 * n, sizeof(*hash), GFP_NOFS)))
+        return;
+    for (i = 0; i < 2 * n; i++)
+        INIT_HLIST_HEAD(&hash[i]);
+    dc->c_hash = hash;
+    dc->c_bits++;
+    for (i = 0; i < n; i++) {
+        hlist_for_each_entry_safe(e, tmp, &old[i], e_node) {
+            hlist_del(&e->e_node);
+            hlist_add_head(&e->e_node, cofs_dircache_chain(dc, e->e_name, e->e_len));
+        }
+    }
+    kfree(old);
+}
+
+static int cofs_dircache_insert(struct cofs_dircache *dc, const char *name,
+        unsigned int len, unsigned int ino, unsigned int pos)
+{
+    struct cofs_dircache_entry *e;
+
+    if (!(e = kmalloc(sizeof(*e), GFP_NOFS)))
+        return -ENOMEM;
+    e->e_ino = ino;
+    e->e_pos = pos;
+    e->e_len = len;
+    memcpy(e->e_name, name, len);
+    hlist_add_head(&e->e_node, cofs_dircache_chain(dc, name, len));
+    dc->c_count++;
+    cofs_dircache_grow(dc);
+    return 0;
+}
+
+static void cofs_dircache_destroy(struct cofs_dircache *dc)
+{
+    struct cofs_dircache_entry *e;
+    struct hlist_node *tmp;
+    unsigned int i;
+
+    for (i = 0; i < (1U << dc->c_bits); i++) {
+        hlist_for_each_entry_safe(e, tmp, &dc->c_hash[i], e_node) {
+            kfree(e);
+        }
+    }
+    kfree(dc->c_hash);
+    kfree(dc);
+}
+
+/**
+ * Reads all the dirents of dir into a new cache
+ */
+static struct cofs_dircache *cofs_dircache_build(struct inode *dir)
+{
+    struct cofs_dircache *dc;
+    struct buffer_head *bh = NULL;
+    struct cofs_dirent *cdir, *first = NULL, *end;
+    unsigned int pos, i, bs = dir->i_sb->s_blocksize;
+    int ft = cofs_has_filetype(dir->i_sb);
+
+    if (!(dc = kmalloc(sizeof(*dc), GFP_NOFS)))
+        return NULL;
+    dc->c_bits = COFS_DIRCACHE_MIN_BITS;
+    dc->c_count = 0;
+    dc->c_free = dir->i_size;
+    if (!(dc->c_hash = kmalloc_array(1U << dc->c_bits, sizeof(*dc->c_hash), GFP_NOFS))) {
+        kfree(dc);
+        return NULL;
+    }
+    for (i = 0; i < (1U << dc->c_bits); i++)
+        INIT_HLIST_HEAD(&dc->c_hash[i]);
+
+    for (pos = 0; pos < dir->i_size; pos += sizeof(*cdir)) {
+        if (pos % bs == 0) {
+            brelse(bh);
+            bh = NULL;
+            first = cofs_dir_block(dir, pos / bs, &bh, &end);
+            if (IS_ERR(first)) {
+                bh = NULL;
+                goto failed;
+            }
+            // a hole is free space for new dirents
+            if (!first) {
+                if (pos < dc->c_free)
+                    dc->c_free = pos;
+                pos += bs - sizeof(*cdir);
+                continue;
+            }
+        }
+        cdir = first + pos % bs / sizeof(*cdir);
+        if (!cdir->d_ino) {
+            if (pos < dc->c_free)
+                dc->c_free = pos;
+            continue;
+        }
+        if (cofs_dircache_insert(dc, cofs_dirent_name(cdir, ft),
+                    cofs_dirent_namelen(cdir, ft), cdir->d_ino, pos))
+            goto failed;
+    }
+    brelse(bh);
+    pr_debug("cofs_dircache_build: directory %lu, %u names\n", dir->i_ino, dc->c_count);
+    return dc;
+failed:
+    brelse(bh);
+    cofs_dircache_destroy(dc);
+    return NULL;
+}
+
+/**
+ * Looks for name in the cache of dir, building it if needed.
+ * Returns 0 and the inode and dirent offset if found, -ENOENT if there is no
+ * such name, or another error when the cache cannot be built and the caller
+ * should read the directory.
+ */
+int cofs_dircache_lookup(struct inode *dir, const char *name, unsigned int len,
+        unsigned int *ino, unsigned int *pos)
+{
+    struct cofs_inode_info *ci = COFS_I(dir);
+    struct cofs_dircache_entry *e;
+    int err = -ENOENT;
+
+    len = cofs_min(len, COFS_NAME_MAX(cofs_has_filetype(dir->i_sb)));
+    mutex_lock(&ci->i_dir_lock);
+    if (!ci->i_dircache && !(ci->i_dircache = cofs_dircache_build(dir))) {
+        err = -ENOMEM;
+        goto out;
+    }
+    if ((e = cofs_dircache_find(ci->i_dircache, name, len))) {
+        *ino = e->e_ino;
+        *pos = e->e_pos;
+        err = 0;
+    }
+out:
+    mutex_unlock(&ci->i_dir_lock);
+    return err;
+}
+
+/**
+ * A name was linked at offset pos of dir
+ */
+void cofs_dircache_add(struct inode *dir, const char *name, unsigned int len,
+        unsigned int ino, unsigned int pos)
+{
+    struct cofs_inode_info *ci = COFS_I(dir);
+    struct cofs_dircache *dc;
+
+    len = cofs_min(len, COFS_NAME_MAX(cofs_has_filetype(dir->i_sb)));
+    mutex_lock(&ci->i_dir_lock);
+    if ((dc = ci->i_dircache)) {
+        if (cofs_dircache_insert(dc, name, len, ino, pos)) {
+            // out of sync, the next lookup builds it again
+            cofs_dircache_destroy(dc);
+            ci->i_dircache = NULL;
+        } else if (pos == dc->c_free) {
+            dc->c_free = pos + sizeof(struct cofs_dirent);
+        }
+    }
+    mutex_unlock(&ci->i_dir_lock);
+}
+
+/**
+ * The dirent at offset pos of dir, linking name, was cleared
+ */
+void cofs_dircache_remove(struct inode *dir, const char *name, unsigned int len,
+        unsigned int pos)
+{
+    struct cofs_inode_info *ci = COFS_I(dir);
+    struct cofs_dircache_entry *e;
+    struct cofs_dircache *dc;
+
+    len = cofs_min(len, COFS_NAME_MAX(cofs_has_filetype(dir->i_sb)));
+    mutex_lock(&ci->i_dir_lock);
+    if ((dc = ci->i_dircache)) {
+        if ((e = cofs_dircache_find(dc, name, len)) && e->e_pos == pos) {
+            hlist_del(&e->e_node);
+            kfree(e);
+            dc->c_count--;
+        }
+        if (pos < dc->c_free)
+            dc->c_free = pos;
+    }
+    mutex_unlock(&ci->i_dir_lock);
+}
+
+/**
+ * Where to start looking for a free dirent in dir
+ */
+unsigned int cofs_dircache_free_pos(struct inode *dir)
+{
+    struct cofs_inode_info *ci = COFS_I(dir);
+    unsigned int pos = 0;
+
+    mutex_lock(&ci->i_dir_lock);
+    if (ci->i_dircache)
+        pos = ci->i_dircache->c_free;
+    mutex_unlock(&ci->i_dir_lock);
+    return pos;
+}
+
+void cofs_dircache_release(struct inode *dir)
+{
+    struct cofs_inode_info *ci = COFS_I(dir);
+
+    if (ci->i_dircache) {
+        cofs_dircache_destroy(ci->i_dircache);
+        ci->i_dircache = NULL;
+    }
+}
@@ -0,0 +1,25 @@
+#ifndef _DIRCACHE_H
+#define _DIRCACHE_H
+
+/**
+ * In memory index of the names in a linear directory, so lookups need
+ * no scan. It's built by the first lookup, kept in sync by link and unlink
+ * and dropped when the directory inode is evicted.
+ */
+struct cofs_dircache {
+    struct hlist_head *c_hash;
+    unsigned int c_bits;        // c_hash has 1 << c_bits chains
+    unsigned int c_count;       // number of names
+    unsigned int c_free;        // no free dirent before this offset
+};
+
+int cofs_dircache_lookup(struct inode *dir, const char *name, unsigned int len,
+        unsigned int *ino, unsigned int *pos);
+void cofs_dircache_add(struct inode *dir, const char *name, unsigned int len,
+        unsigned int ino, unsigned int pos);
+void cofs_dircache_remove(struct inode *dir, const char *name, unsigned int len,
+        unsigned int pos);
+unsigned int cofs_dircache_free_pos(struct inode *dir);
+void cofs_dircache_release(struct inode *dir);
+
+#endif
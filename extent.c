@@ -0,0 +1,680 @@
+/**
+ *  Extents
+ *
+ *  On a file system formated with COFS_FEAT_EXTENTS, the inode addrs[] space
+ *  keeps the root of a small B+tree instead of the direct/indirect tables.
+ *  A leaf entry maps a run of contiguous blocks, so a file written
+ *  sequentially is mapped by one extent, found with a single lookup.
+ *  When the root is full, it's entries are moved into a new block and the
+ *  root becomes an index pointing to it (the tree grows in height).
+ *  Full nodes below the root are split in two.
+ */
+#include <linux/buffer_head.h>
+#include "cofs_common.h"
+#include "super.h"
+#include "inode.h"
+#include "block.h"
+#include "extent.h"
+#include "journal.h"
+
+// deep enough for 2^32 blocks, even with 512 bytes blocks
+#define COFS_EXT_MAX_DEPTH  5
+
+// One step of the walk from the root to a leaf
+struct cofs_ext_path {
+    struct buffer_head *bh;         // buffer holding this node, NULL for the root
+    struct cofs_extent_header *eh;  // the node
+    int idx;                        // entry we followed, -1 if none
+};
+
+static void cofs_ext_path_release(struct cofs_ext_path *path, int depth)
+{
+    int level;
+    for (level = 0; level <= depth; level++) {
+        brelse(path[level].bh);
+        path[level].bh = NULL;
+    }
+}
+
+// the root lives in the in memory inode, cofs_write_inode saves it
+static inline struct cofs_extent_header *cofs_ext_root(struct inode *inode)
+{
+    return (struct cofs_extent_header *) COFS_I(inode)->i_addrs;
+}
+
+static void cofs_ext_dirty(struct inode *inode, struct buffer_head *bh)
+{
+    if (bh)
+        cofs_journal_dirty_inode(bh, inode);
+    else
+        mark_inode_dirty(inode);
+}
+
+/*
+ * A freshly allocated inode has zeroed addrs[]; make it an empty leaf
+ */
+static void cofs_ext_init_root(struct cofs_extent_header *eh)
+{
+    eh->eh_magic = COFS_EXT_MAGIC;
+    eh->eh_entries = 0;
+    eh->eh_max = NUM_IEXT;
+    eh->eh_depth = 0;
+}
+
+// last index entry with ei_lblock <= lblock, or the first one
+static int cofs_ext_search_idx(struct cofs_extent_header *eh, unsigned int lblock)
+{
+    struct cofs_extent_idx *ix = EXT_FIRST_INDEX(eh);
+    int l = 1, r = eh->eh_entries - 1, m;
+
+    while (l <= r) {
+        m = (l + r) / 2;
+        if (ix[m].ei_lblock <= lblock)
+            l = m + 1;
+        else
+            r = m - 1;
+    }
+    return l - 1;
+}
+
+// last extent starting at or before lblock, -1 if none
+static int cofs_ext_search_ext(struct cofs_extent_header *eh, unsigned int lblock)
+{
+    struct cofs_extent *ex = EXT_FIRST_EXTENT(eh);
+    int l = 0, r = eh->eh_entries - 1, m;
+
+    while (l <= r) {
+        m = (l + r) / 2;
+        if (ex[m].e_lblock <= lblock)
+            l = m + 1;
+        else
+            r = m - 1;
+    }
+    return l - 1;
+}
+
+/**
+ * Walks the tree of inode from the root to the leaf that should map lblock.
+ * The caller fills path[0] with the root; we read the lower nodes.
+ * Returns the depth of the tree (the level of the leaf), or a negative errno.
+ * Release the path with cofs_ext_path_release, even on error.
+ */
+static int cofs_ext_find(struct super_block *sb, struct cofs_ext_path *path,
+        unsigned int lblock)
+{
+    struct cofs_extent_header *eh = path[0].eh;
+    struct buffer_head *bh;
+    int level, depth = eh->eh_depth;
+
+    if (depth > COFS_EXT_MAX_DEPTH) {
+        pr_err("cofs: extent tree too deep: %d\n", depth);
+        return -EIO;
+    }
+    for (level = 0; level < depth; level++) {
+        path[level].idx = cofs_ext_search_idx(eh, lblock);
+        bh = sb_bread(sb, EXT_FIRST_INDEX(eh)[path[level].idx].ei_block);
+        if (!bh)
+            return -EIO;
+        eh = (struct cofs_extent_header *) bh->b_data;
+        path[level + 1].bh = bh;
+        path[level + 1].eh = eh;
+        if (eh->eh_magic != COFS_EXT_MAGIC || eh->eh_depth != depth - level - 1) {
+            pr_err("cofs: bad extent block %llu\n", (unsigned long long) bh->b_blocknr);
+            return -EIO;
+        }
+    }
+    path[depth].idx = cofs_ext_search_ext(eh, lblock);
+    return depth;
+}
+
+/*
+ * Gets a zeroed block for a new tree node, without reading it from disk
+ */
+static struct buffer_head *cofs_ext_new_node(struct super_block *sb,
+        unsigned short int depth)
+{
+    struct buffer_head *bh;
+    struct cofs_extent_header *eh;
+    unsigned int block = cofs_block_alloc(sb);
+
+    if (!block)
+        return NULL;
+    bh = cofs_block_zero(sb, block);
+    if (!bh) {
+        cofs_block_free(sb, block);
+        return NULL;
+    }
+    eh = (struct cofs_extent_header *) bh->b_data;
+    eh->eh_magic = COFS_EXT_MAGIC;
+    eh->eh_max = depth ? NUM_IDXPB(sb->s_blocksize) : NUM_EXTPB(sb->s_blocksize);
+    eh->eh_depth = depth;
+    return bh;
+}
+
+/*
+ * The root is full: move it's entries into a new block and make the root
+ * an index with a single entry, pointing to it.
+ */
+static int cofs_ext_grow(struct inode *inode, struct cofs_ext_path *path)
+{
+    struct cofs_extent_header *root = path[0].eh, *eh;
+    struct buffer_head *bh;
+    unsigned int entry_size, first;
+
+    bh = cofs_ext_new_node(inode->i_sb, root->eh_depth);
+    if (!bh)
+        return -ENOSPC;
+    eh = (struct cofs_extent_header *) bh->b_data;
+    entry_size = root->eh_depth ? sizeof(struct cofs_extent_idx) : sizeof(struct cofs_extent);
+    memcpy(eh + 1, root + 1, root->eh_entries * entry_size);
+    eh->eh_entries = root->eh_entries;
+    first = root->eh_depth ? EXT_FIRST_INDEX(root)->ei_lblock : EXT_FIRST_EXTENT(root)->e_lblock;
+    cofs_journal_dirty_inode(bh, inode);
+
+    memset(root + 1, 0, NUM_ROOT_BYTES);
+    root->eh_entries = 1;
+    root->eh_max = NUM_IIDX;
+    root->eh_depth++;
+    EXT_FIRST_INDEX(root)->ei_lblock = first;
+    EXT_FIRST_INDEX(root)->ei_block = bh->b_blocknr;
+    cofs_ext_dirty(inode, path[0].bh);
+    pr_debug("cofs: extent tree grows to depth %u in block %llu\n",
+            root->eh_depth, (unsigned long long) bh->b_blocknr);
+    brelse(bh);
+    return 0;
+}
+
+/*
+ * Splits the full node at level in two, adding an entry for the new node in
+ * it's parent, which must have room. When we append at the end of the node,
+ * only the last entry is moved, so sequential files keep full nodes.
+ */
+static int cofs_ext_split(struct inode *inode, struct cofs_ext_path *path, int level)
+{
+    struct cofs_extent_header *eh = path[level].eh, *neh, *parent = path[level - 1].eh;
+    struct cofs_extent_idx *pix;
+    struct buffer_head *bh;
+    unsigned int entry_size, move, first, pidx;
+    char *from;
+
+    bh = cofs_ext_new_node(inode->i_sb, eh->eh_depth);
+    if (!bh)
+        return -ENOSPC;
+    neh = (struct cofs_extent_header *) bh->b_data;
+    if (path[level].idx == eh->eh_entries - 1)
+        move = 1;
+    else
+        move = eh->eh_entries / 2;
+
+    entry_size = eh->eh_depth ? sizeof(struct cofs_extent_idx) : sizeof(struct cofs_extent);
+    from = (char *) (eh + 1) + (eh->eh_entries - move) * entry_size;
+    first = eh->eh_depth ? ((struct cofs_extent_idx *) from)->ei_lblock
+                         : ((struct cofs_extent *) from)->e_lblock;
+    memcpy(neh + 1, from, move * entry_size);
+    memset(from, 0, move * entry_size);
+    neh->eh_entries = move;
+    eh->eh_entries -= move;
+    cofs_journal_dirty_inode(bh, inode);
+    cofs_journal_dirty_inode(path[level].bh, inode);
+
+    // the new node goes right after the split one, in the parent
+    pidx = path[level - 1].idx + 1;
+    pix = EXT_FIRST_INDEX(parent);
+    memmove(pix + pidx + 1, pix + pidx, (parent->eh_entries - pidx) * sizeof(*pix));
+    pix[pidx].ei_lblock = first;
+    pix[pidx].ei_block = bh->b_blocknr;
+    parent->eh_entries++;
+    cofs_ext_dirty(inode, path[level - 1].bh);
+    brelse(bh);
+    return 0;
+}
+
+/*
+ * The leaf of path is full. Split the lowest node having a parent
+ * with room, or grow the tree if all the nodes up to the root are full.
+ * After this, the path must be looked up again.
+ */
+static int cofs_ext_make_room(struct inode *inode, struct cofs_ext_path *path, int depth)
+{
+    int level;
+    for (level = depth; level > 0; level--) {
+        if (path[level - 1].eh->eh_entries < path[level - 1].eh->eh_max)
+            return cofs_ext_split(inode, path, level);
+    }
+    if (depth == COFS_EXT_MAX_DEPTH)
+        return -ENOSPC;
+    return cofs_ext_grow(inode, path);
+}
+
+/*
+ * Adds the mapping lblock -> pblock, len blocks long, to the leaf of path.
+ * len may carry COFS_EXT_UNWRITTEN. lblock must not be mapped. Merges with
+ * the neighbours when they are contiguous, both in the file and on disk, and
+ * in the same state. Returns 1 if the tree must be looked up again and the
+ * insert retried.
+ */
+static int cofs_ext_insert(struct inode *inode, struct cofs_ext_path *path, int depth,
+        unsigned int lblock, unsigned int pblock, unsigned int len)
+{
+    struct cofs_extent_header *eh = path[depth].eh;
+    struct cofs_extent *ex = EXT_FIRST_EXTENT(eh);
+    unsigned int state = len & COFS_EXT_UNWRITTEN, blocks = len & ~COFS_EXT_UNWRITTEN;
+    int idx = path[depth].idx, err;
+
+    // append to the left extent //
+    if (idx >= 0 && EXT_UNWRITTEN(&ex[idx]) == state 
+            && ex[idx].e_lblock + EXT_LEN(&ex[idx]) == lblock
+            && ex[idx].e_pblock + EXT_LEN(&ex[idx]) == pblock) {
+        ex[idx].e_len += blocks;
+        cofs_ext_dirty(inode, path[depth].bh);
+        return 0;
+    }
+    // prepend to the right extent //
+    if (idx + 1 < eh->eh_entries && EXT_UNWRITTEN(&ex[idx + 1]) == state 
+            && lblock + blocks == ex[idx + 1].e_lblock
+            && pblock + blocks == ex[idx + 1].e_pblock) {
+        ex[idx + 1].e_lblock = lblock;
+        ex[idx + 1].e_pblock = pblock;
+        ex[idx + 1].e_len += blocks;
+        cofs_ext_dirty(inode, path[depth].bh);
+        return 0;
+    }
+    if (eh->eh_entries == eh->eh_max) {
+        err = cofs_ext_make_room(inode, path, depth);
+        return err ? err : 1;
+    }
+    idx++;
+    memmove(ex + idx + 1, ex + idx, (eh->eh_entries - idx) * sizeof(*ex));
+    ex[idx].e_lblock = lblock;
+    ex[idx].e_len = len;
+    ex[idx].e_pblock = pblock;
+    eh->eh_entries++;
+    cofs_ext_dirty(inode, path[depth].bh);
+    return 0;
+}
+
+/*
+ * ino_block, inside the unwritten extent of path, is about to be written.
+ * Marks it written, splitting the extent in up to three; the leaf must have
+ * room for two more entries first. A block written right after a written
+ * extent joins it instead, so a preallocated file filled sequentially stays
+ * two extents: the written part and the rest.
+ * Returns 1 if the tree must be looked up again.
+ */
+static int cofs_ext_convert(struct inode *inode, struct cofs_ext_path *path, int depth,
+        unsigned int ino_block, unsigned int *pblock)
+{
+    struct cofs_extent_header *eh = path[depth].eh;
+    int idx = path[depth].idx, err;
+    struct cofs_extent *ex = EXT_FIRST_EXTENT(eh) + idx;
+    unsigned int off = ino_block - ex->e_lblock, len = EXT_LEN(ex);
+
+    *pblock = ex->e_pblock + off;
+    if (len == 1) {
+        ex->e_len = 1;
+        cofs_ext_dirty(inode, path[depth].bh);
+        return 0;
+    }
+    if (eh->eh_entries + 2 > eh->eh_max) {
+        err = cofs_ext_make_room(inode, path, depth);
+        return err ? err : 1;
+    }
+    if (off == 0) {
+        // the insert below appends it to the left extent, if it can
+        ex->e_lblock++;
+        ex->e_pblock++;
+        ex->e_len--;
+        path[depth].idx--;
+    } else if (off == len - 1) {
+        ex->e_len--;
+    } else {
+        ex->e_len = off | COFS_EXT_UNWRITTEN;
+        err = cofs_ext_insert(inode, path, depth, ino_block + 1, *pblock + 1,
+                (len - off - 1) | COFS_EXT_UNWRITTEN);
+        if (err)
+            return err;
+    }
+    return cofs_ext_insert(inode, path, depth, ino_block, *pblock, 1);
+}
+
+/*
+ * First file block mapped after the extent of path, or COFS_EXT_END
+ */
+static unsigned int cofs_ext_next(struct cofs_ext_path *path, int depth)
+{
+    struct cofs_extent_header *eh = path[depth].eh;
+    int level;
+
+    if (path[depth].idx + 1 < eh->eh_entries)
+        return EXT_FIRST_EXTENT(eh)[path[depth].idx + 1].e_lblock;
+    for (level = depth - 1; level >= 0; level--) {
+        eh = path[level].eh;
+        if (path[level].idx + 1 < eh->eh_entries)
+            return EXT_FIRST_INDEX(eh)[path[level].idx + 1].ei_lblock;
+    }
+    return COFS_EXT_END;
+}
+
+/*
+ * A reader got to the last extent of a leaf: start reading the next leaf,
+ * it will be needed after the data mapped by this one.
+ */
+static void cofs_ext_prefetch(struct super_block *sb, 
+        struct cofs_ext_path *path, int depth)
+{
+    struct cofs_extent_header *parent;
+
+    if (!depth || path[depth].idx != path[depth].eh->eh_entries - 1)
+        return;
+    parent = path[depth - 1].eh;
+    if (path[depth - 1].idx + 1 < parent->eh_entries)
+        sb_breadahead(sb, EXT_FIRST_INDEX(parent)[path[depth - 1].idx + 1].ei_block);
+}
+
+/**
+ * Extent version of the block mapping - see cofs_block_map
+ */
+unsigned int cofs_ext_map(struct inode *inode, unsigned int ino_block,
+        int create, int *new, unsigned int *count)
+{
+    struct super_block *sb = inode->i_sb;
+    struct cofs_ext_path path[COFS_EXT_MAX_DEPTH + 1];
+    struct cofs_extent *ex;
+    unsigned int block_no = 0, goal = 0;
+    int depth, err;
+
+    memset(path, 0, sizeof(path));
+    path[0].eh = cofs_ext_root(inode);
+    if (path[0].eh->eh_magic != COFS_EXT_MAGIC) {
+        if (!create)
+            goto out;
+        cofs_ext_init_root(path[0].eh);
+        mark_inode_dirty(inode);
+    }
+again:
+    depth = cofs_ext_find(sb, path, ino_block);
+    if (depth < 0)
+        goto out;
+    if (path[depth].idx >= 0) {
+        ex = EXT_FIRST_EXTENT(path[depth].eh) + path[depth].idx;
+        if (ino_block < ex->e_lblock + EXT_LEN(ex) && EXT_UNWRITTEN(ex)) {
+            // preallocated: a hole for readers, a new block for writers
+            if (!create)
+                goto out;
+            err = cofs_ext_convert(inode, path, depth, ino_block, &block_no);
+            if (err == 1) {
+                cofs_ext_path_release(path + 1, depth - 1);
+                goto again;
+            }
+            if (err)
+                goto out;
+            goto mapped;
+        }
+        if (ino_block < ex->e_lblock + EXT_LEN(ex)) {
+            block_no = ex->e_pblock + (ino_block - ex->e_lblock);
+            if (count)
+                *count = cofs_min(*count, ex->e_lblock + EXT_LEN(ex) - ino_block);
+            if (!create)
+                cofs_ext_prefetch(sb, path, depth);
+            goto out;
+        }
+    }
+    if (!create)
+        goto out;
+
+    if (!block_no) {
+        // try to continue the extent on the left, on disk too
+        if (path[depth].idx >= 0) {
+            ex = EXT_FIRST_EXTENT(path[depth].eh) + path[depth].idx;
+            goal = ex->e_pblock + (ino_block - ex->e_lblock);
+        }
+        if (!(block_no = cofs_block_alloc_inode(inode, goal)))
+            goto out;
+    }
+    err = cofs_ext_insert(inode, path, depth, ino_block, block_no, 1);
+    if (err == 1) {
+        cofs_ext_path_release(path + 1, depth - 1);
+        goto again;
+    }
+    if (err) {
+        pr_err("cofs: cannot insert extent for inode %lu: %d\n", inode->i_ino, err);
+        cofs_block_free(sb, block_no);
+        block_no = 0;
+        goto out;
+    }
+mapped:
+    if (new)
+        *new = 1;
+    if (count)
+        *count = 1;
+out:
+    cofs_ext_path_release(path, COFS_EXT_MAX_DEPTH);
+    return block_no;
+}
+
+/*
+ * Frees everything mapping blocks from start on, in the node eh.
+ * Empty nodes below eh are freed too. Nodes are emptied from the right,
+ * so the tree is whole when the journal is full (-EAGAIN) half way.
+ */
+static int cofs_ext_remove(struct inode *inode, struct buffer_head *bh,
+        struct cofs_extent_header *eh, unsigned int start)
+{
+    struct super_block *sb = inode->i_sb;
+    struct cofs_extent *ex;
+    struct cofs_extent_idx *ix;
+    struct buffer_head *cbh;
+    struct cofs_extent_header *ceh;
+    unsigned int key;
+    int i, err = 0;
+
+    if (eh->eh_depth == 0) {
+        ex = EXT_FIRST_EXTENT(eh);
+        for (i = eh->eh_entries - 1; i >= 0; i--) {
+            if (ex[i].e_lblock >= start) {
+                cofs_blocks_free(sb, ex[i].e_pblock, EXT_LEN(&ex[i]));
+                memset(&ex[i], 0, sizeof(*ex));
+                eh->eh_entries--;
+            } else {
+                if (ex[i].e_lblock + EXT_LEN(&ex[i]) > start) {
+                    cofs_blocks_free(sb, ex[i].e_pblock + start - ex[i].e_lblock,
+                            ex[i].e_lblock + EXT_LEN(&ex[i]) - start);
+                    ex[i].e_len = (start - ex[i].e_lblock) | EXT_UNWRITTEN(&ex[i]);
+                }
+                break;
+            }
+        }
+        cofs_ext_dirty(inode, bh);
+        return 0;
+    }
+
+    ix = EXT_FIRST_INDEX(eh);
+    for (i = eh->eh_entries - 1; i >= 0; i--) {
+        key = ix[i].ei_lblock;
+        if ((err = cofs_journal_extend(sb, COFS_JNL_MAP_CREDITS)))
+            break;
+        if (!(cbh = sb_bread(sb, ix[i].ei_block))) {
+            err = -EIO;
+            break;
+        }
+        ceh = (struct cofs_extent_header *) cbh->b_data;
+        if (ceh->eh_magic != COFS_EXT_MAGIC) {
+            brelse(cbh);
+            err = -EIO;
+            break;
+        }
+        if ((err = cofs_ext_remove(inode, cbh, ceh, start))) {
+            brelse(cbh);
+            break;
+        }
+        if (ceh->eh_entries == 0) {
+            bforget(cbh);
+            cofs_block_free(sb, ix[i].ei_block);
+            memset(&ix[i], 0, sizeof(*ix));
+            eh->eh_entries--;
+        } else {
+            brelse(cbh);
+        }
+        // the nodes on the left map only blocks before key
+        if (key <= start)
+            break;
+    }
+    cofs_ext_dirty(inode, bh);
+    return err;
+}
+
+/**
+ * Maps the holes between file blocks *startp and end - 1 to unwritten
+ * extents, a run of contiguous free blocks at a time. Returns -EAGAIN
+ * when the journal is full, with *startp where to go on.
+ */
+int cofs_ext_prealloc(struct inode *inode, unsigned int *startp, unsigned int end)
+{
+    struct super_block *sb = inode->i_sb;
+    struct cofs_ext_path path[COFS_EXT_MAX_DEPTH + 1];
+    struct cofs_extent *ex;
+    unsigned int start = *startp, pblock = 0, count = 0, goal;
+    int depth, err;
+
+    if ((err = cofs_set_feature(sb, COFS_FEAT_UNWRITTEN)))
+        return err;
+    memset(path, 0, sizeof(path));
+    path[0].eh = cofs_ext_root(inode);
+    if (path[0].eh->eh_magic != COFS_EXT_MAGIC) {
+        cofs_ext_init_root(path[0].eh);
+        mark_inode_dirty(inode);
+    }
+    while (start < end) {
+        cofs_ext_path_release(path + 1, COFS_EXT_MAX_DEPTH - 1);
+        if ((depth = cofs_ext_find(sb, path, start)) < 0) {
+            err = depth;
+            break;
+        }
+        ex = NULL;
+        if (path[depth].idx >= 0)
+            ex = EXT_FIRST_EXTENT(path[depth].eh) + path[depth].idx;
+        if (ex && start < ex->e_lblock + EXT_LEN(ex)) {
+            start = ex->e_lblock + EXT_LEN(ex);
+            continue;
+        }
+        // a hole up to the next extent; kept across a retried insert
+        if (!count) {
+            if ((err = cofs_journal_extend(sb, COFS_JNL_MAP_CREDITS)))
+                break;
+            count = cofs_min(end, cofs_ext_next(path, depth)) - start;
+            count = cofs_min(count, cofs_avail_blocks(sb));
+            goal = ex ? ex->e_pblock + (start - ex->e_lblock) : cofs_inode_goal(inode);
+            if (!count || !(pblock = cofs_new_blocks(sb, goal, &count))) {
+                err = -ENOSPC;
+                break;
+            }
+        }
+        err = cofs_ext_insert(inode, path, depth, start, pblock, count | COFS_EXT_UNWRITTEN);
+        if (err == 1)
+            continue;
+        if (err) {
+            cofs_blocks_free(sb, pblock, count);
+            break;
+        }
+        start += count;
+        count = 0;
+    }
+    cofs_ext_path_release(path, COFS_EXT_MAX_DEPTH);
+    *startp = start;
+    return err;
+}
+
+/*
+ * Frees the blocks from start to end - 1, keeping what is mapped after them.
+ * Extents are cut or dropped from their leaf one at a time; a leaf left empty
+ * stays in the tree until the file is truncated. Stops with -EAGAIN when the
+ * journal is full; what is punched already reads as a hole.
+ */
+static int cofs_ext_punch(struct inode *inode, unsigned int start, unsigned int end)
+{
+    struct super_block *sb = inode->i_sb;
+    struct cofs_ext_path path[COFS_EXT_MAX_DEPTH + 1];
+    struct cofs_extent_header *eh;
+    struct cofs_extent *ex;
+    unsigned int from, to, elen, pfrom;
+    int depth, idx, err = 0;
+
+    memset(path, 0, sizeof(path));
+    path[0].eh = cofs_ext_root(inode);
+    while (start < end) {
+        cofs_ext_path_release(path + 1, COFS_EXT_MAX_DEPTH - 1);
+        if ((depth = cofs_ext_find(sb, path, start)) < 0) {
+            err = depth;
+            break;
+        }
+        if ((err = cofs_journal_extend(sb, COFS_JNL_MAP_CREDITS)))
+            break;
+        eh = path[depth].eh;
+        idx = path[depth].idx;
+        ex = EXT_FIRST_EXTENT(eh) + idx;
+        if (idx < 0 || ex->e_lblock + EXT_LEN(ex) <= start) {
+            // start is in a hole, go to the next extent
+            if (idx + 1 < eh->eh_entries) {
+                idx++;
+                ex++;
+            } else {
+                start = cofs_ext_next(path, depth);
+                continue;
+            }
+        }
+        elen = EXT_LEN(ex);
+        from = cofs_max(start, ex->e_lblock);
+        to = cofs_min(end, ex->e_lblock + elen);
+        if (from >= to)
+            break;
+        pfrom = ex->e_pblock + from - ex->e_lblock;
+        if (from > ex->e_lblock && to < ex->e_lblock + elen) {
+            // a hole in the middle: the right part becomes a new extent
+            path[depth].idx = idx;
+            err = cofs_ext_insert(inode, path, depth, to, ex->e_pblock + to - ex->e_lblock,
+                    (ex->e_lblock + elen - to) | EXT_UNWRITTEN(ex));
+            if (err == 1)
+                continue;
+            if (err)
+                break;
+            ex->e_len = (from - ex->e_lblock) | EXT_UNWRITTEN(ex);
+        } else if (from > ex->e_lblock) {
+            ex->e_len = (from - ex->e_lblock) | EXT_UNWRITTEN(ex);
+        } else if (to < ex->e_lblock + elen) {
+            ex->e_pblock += to - ex->e_lblock;
+            ex->e_len -= to - ex->e_lblock;
+            ex->e_lblock = to;
+        } else {
+            memmove(ex, ex + 1, (eh->eh_entries - idx - 1) * sizeof(*ex));
+            eh->eh_entries--;
+            memset(EXT_FIRST_EXTENT(eh) + eh->eh_entries, 0, sizeof(*ex));
+        }
+        cofs_blocks_free(sb, pfrom, to - from);
+        cofs_ext_dirty(inode, path[depth].bh);
+        start = to;
+    }
+    cofs_ext_path_release(path, COFS_EXT_MAX_DEPTH);
+    return err;
+}
+
+/**
+ * Frees the blocks of inode from file block start to end - 1; COFS_EXT_END
+ * for end cuts the file there. -EAGAIN: the journal is full, restart the
+ * handle and call again for the rest.
+ */
+int cofs_ext_truncate(struct inode *inode, unsigned int start, unsigned int end)
+{
+    struct cofs_extent_header *root = cofs_ext_root(inode);
+    int err;
+
+    if (root->eh_magic != COFS_EXT_MAGIC)
+        return 0;
+    if (end != COFS_EXT_END)
+        return cofs_ext_punch(inode, start, end);
+    err = cofs_ext_remove(inode, NULL, root, start);
+    if (root->eh_entries == 0) {
+        cofs_ext_init_root(root);
+        mark_inode_dirty(inode);
+    }
+    return err;
+}
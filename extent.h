@@ -0,0 +1,12 @@
+#ifndef _EXTENT_H
+#define _EXTENT_H
+
+// no end: cofs_ext_truncate up to the end of file
+#define COFS_EXT_END    (~0U)
+
+unsigned int cofs_ext_map(struct inode *inode, unsigned int ino_block,
+        int create, int *new, unsigned int *count);
+int cofs_ext_truncate(struct inode *inode, unsigned int start, unsigned int end);
+int cofs_ext_prealloc(struct inode *inode, unsigned int *startp, unsigned int end);
+
+#endif
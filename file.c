@@ -1,93 +1,665 @@
 #include <linux/module.h>
 #include <linux/fs.h>
 #include <linux/buffer_head.h>
+#include <linux/mpage.h>
+#include <linux/bio.h>
+#include <linux/writeback.h>
+#include <linux/falloc.h>
 #include "cofs_common.h"
+#include "super.h"
 #include "inode.h"
 #include "block.h"
+#include "journal.h"
 
 /**
- * Reads a file content into the buffer having max size, starting from offset
- *  We can only read one physical block at a time from hard drive, so we must
- *  ajust the max bytes to read.
- *  Returns the number of bytes read and updates the offset
+ * Regular files live in the page cache. Reads, writes and mmap go through
+ * the generic helpers, which call back into cofs_get_block to map each
+ * file block to a disk block. Inline files (COFS_FEAT_INLINE) have no
+ * blocks: their page 0 is filled from the inode and copied back into it.
  */
-ssize_t cofs_file_read(struct file *file, char *buffer, size_t max, loff_t *offset)
+
+/*
+ * Fills a page of an inline file from the inode. Only page 0 has data,
+ * past i_size and the inline room it reads as zeros.
+ */
+static int cofs_inline_readpage(struct inode *inode, struct page *page)
 {
-    unsigned int block_no, num_bytes, total;
     struct buffer_head *bh;
-    struct inode *inode = file_inode(file);
+    unsigned int size = 0;
+    char *data, *kaddr;
+
+    if (!(data = cofs_inline_data(inode, &bh)))
+        return -EIO;
+    if (page->index == 0)
+        size = cofs_min(i_size_read(inode), cofs_inline_max(inode->i_sb));
+    kaddr = kmap_atomic(page);
+    memcpy(kaddr, data, size);
+    memset(kaddr + size, 0, PAGE_SIZE - size);
+    kunmap_atomic(kaddr);
+    brelse(bh);
+    flush_dcache_page(page);
+    SetPageUptodate(page);
+    return 0;
+}
 
-    // check if we are trying to read outside the file size limit //
-    if (*offset > inode->i_size) {
+/*
+ * Copies bytes from..to-1 of page 0 of an inline file into the inode
+ */
+static int cofs_inline_write(struct inode *inode, struct page *page,
+        unsigned int from, unsigned int to)
+{
+    struct buffer_head *bh;
+    char *data, *kaddr;
+    int err = 0;
+
+    to = cofs_min(to, cofs_inline_max(inode->i_sb));
+    if (page->index || from >= to)
         return 0;
-    }
-    // adjust the maximum number of bytes //
-    if (*offset + max > inode->i_size) {
-        max = inode->i_size - *offset;
-    }
-    
-    for (total = 0; total < max; total += num_bytes) {
-        block_no = cofs_get_real_block(inode, *offset / COFS_BLOCK_SIZE);
-        bh = sb_bread(inode->i_sb, block_no);
-        num_bytes = cofs_min(max - total, COFS_BLOCK_SIZE - *offset % COFS_BLOCK_SIZE);
-        memcpy(buffer, bh->b_data + *offset % COFS_BLOCK_SIZE, num_bytes);
-        *offset += num_bytes;
-        buffer += num_bytes; // use it only once
+    cofs_journal_join(inode->i_sb);
+    if ((data = cofs_inline_data(inode, &bh))) {
+        kaddr = kmap_atomic(page);
+        memcpy(data + from, kaddr + from, to - from);
+        kunmap_atomic(kaddr);
+        cofs_journal_dirty_inode(bh, inode);
         brelse(bh);
+    } else {
+        err = -EIO;
     }
-    
-    return total;
+    cofs_journal_stop(inode->i_sb);
+    return err;
 }
 
-ssize_t cofs_file_write(struct file *file, const char *buffer, size_t max, loff_t *offset)
+/*
+ * Moves the data of an inline file into it's block 0, before a write it
+ * has no room for. The page holds the data, from the inode if it was not
+ * read yet, and goes to the new block with the next writeback.
+ * Called with the inode locked.
+ */
+static int cofs_inline_convert(struct inode *inode, get_block_t *get_block)
 {
-    unsigned int block_no, total, num_bytes;
-    struct buffer_head *bh;
-    struct inode *inode = file_inode(file);
-    
-    pr_debug("cofs_file_write - inode: %lu, offset: %llu, max: %lu\n", 
-            inode->i_ino, *offset, max);
-   
-    if (*offset > inode->i_size) {
-        pr_debug("writing at offset > size... should be allowed?!\n");
-        return 0;
+    struct page *page;
+    unsigned int size = cofs_min(inode->i_size, cofs_inline_max(inode->i_sb));
+    int err = 0;
+
+    if (!(page = grab_cache_page_write_begin(inode->i_mapping, 0, 0)))
+        return -ENOMEM;
+    if (!cofs_inode_inline(inode))
+        goto out;
+    if (!PageUptodate(page) && (err = cofs_inline_readpage(inode, page)))
+        goto out;
+    COFS_I(inode)->i_flags &= ~COFS_INODE_INLINE;
+    if ((err = __block_write_begin(page, 0, size, get_block))) {
+        // the data is still inline, drop the blocks mapped for it
+        unlock_page(page);
+        put_page(page);
+        truncate_pagecache(inode, 0);
+        cofs_truncate(inode, 0, inode->i_sb->s_maxbytes);
+        COFS_I(inode)->i_flags |= COFS_INODE_INLINE;
+        return err;
     }
-    if (*offset + max > MAX_FILE_SIZE * COFS_BLOCK_SIZE) {
-        return -1;
+    block_commit_write(page, 0, size);
+    cofs_inline_zero(inode, 0);
+    mark_inode_dirty(inode);
+    pr_debug("cofs: inode %lu moved out of the inode\n", inode->i_ino);
+out:
+    unlock_page(page);
+    put_page(page);
+    return err;
+}
+
+static int cofs_readpage(struct file *file, struct page *page)
+{
+    struct inode *inode = page->mapping->host;
+    int err;
+
+    if (cofs_inode_inline(inode)) {
+        if ((err = cofs_inline_readpage(inode, page)))
+            SetPageError(page);
+        unlock_page(page);
+        return err;
     }
-    for (total = 0; total < max; total += num_bytes) {
-        if(!(block_no = cofs_get_real_block(inode, *offset / COFS_BLOCK_SIZE))) {
-            pr_debug("cofs_get_real_block returned 0\n");
-            return -1;
+    return mpage_readpage(page, cofs_get_block);
+}
+
+static void cofs_readahead(struct readahead_control *rac)
+{
+    // readpage fills the page of an inline file
+    if (cofs_inode_inline(rac->mapping->host))
+        return;
+    mpage_readahead(rac, cofs_get_block);
+}
+
+static int cofs_writepage(struct page *page, struct writeback_control *wbc)
+{
+    struct inode *inode = page->mapping->host;
+    int err;
+
+    // written by mmap, the inline data is the page
+    if (cofs_inode_inline(inode)) {
+        err = cofs_inline_write(inode, page, 0, cofs_min(i_size_read(inode), PAGE_SIZE));
+        if (err)
+            mapping_set_error(page->mapping, err);
+        set_page_writeback(page);
+        unlock_page(page);
+        end_page_writeback(page);
+        return err;
+    }
+    return block_write_full_page(page, cofs_get_block, wbc);
+}
+
+static int cofs_writepages(struct address_space *mapping, 
+        struct writeback_control *wbc)
+{
+    if (cofs_inode_inline(mapping->host))
+        return generic_writepages(mapping, wbc);
+    return mpage_writepages(mapping, wbc, cofs_get_block);
+}
+
+/*
+ * Allocates the delayed buffers of a locked page, as block_write_full_page
+ * would have
+ */
+static int cofs_da_map_page(struct inode *inode, struct page *page)
+{
+    struct buffer_head *head, *bh;
+    sector_t iblock = (sector_t) page->index << (PAGE_SHIFT - inode->i_blkbits);
+    int err;
+
+    head = bh = page_buffers(page);
+    do {
+        if (buffer_delay(bh) && buffer_dirty(bh)) {
+            if ((err = cofs_get_block(inode, iblock, bh, 1)))
+                return err;
+            clear_buffer_delay(bh);
+            if (buffer_new(bh)) {
+                clear_buffer_new(bh);
+                clean_bdev_bh_alias(bh);
+            }
         }
-        pr_debug("cofs-write inode: %lu, relative_block: %llu, block_no:%u\n", 
-                inode->i_ino, *offset/COFS_BLOCK_SIZE, block_no);
-        num_bytes = cofs_min(max - total, COFS_BLOCK_SIZE - *offset % COFS_BLOCK_SIZE);
-        bh = sb_bread(inode->i_sb, block_no);
-        memcpy(bh->b_data + *offset % COFS_BLOCK_SIZE, buffer, num_bytes);
-        *offset += num_bytes;
-        buffer += num_bytes;
-        mark_buffer_dirty(bh);
-        brelse(bh);
+        iblock++;
+    } while ((bh = bh->b_this_page) != head);
+    return 0;
+}
+
+// the bio cofs_da_writepages is building
+struct cofs_wp {
+    struct bio *bio;
+    sector_t next;              // disk block that would continue it
+};
+
+static void cofs_wp_end_io(struct bio *bio)
+{
+    struct bio_vec *bv;
+    struct bvec_iter_all iter;
+
+    bio_for_each_segment_all(bv, bio, iter) {
+        if (bio->bi_status) {
+            SetPageError(bv->bv_page);
+            mapping_set_error(bv->bv_page->mapping, -EIO);
+        }
+        end_page_writeback(bv->bv_page);
+    }
+    bio_put(bio);
+}
+
+static void cofs_wp_submit(struct cofs_wp *wp)
+{
+    if (wp->bio)
+        submit_bio(wp->bio);
+    wp->bio = NULL;
+}
+
+/*
+ * The write_cache_pages callback of cofs_da_writepages, for a locked page.
+ * It's delayed blocks are allocated first; then a page inside the file,
+ * all dirty and mapped to contiguous blocks, goes in the bio when it
+ * continues it on disk. Any other page is written by block_write_full_page.
+ */
+static int cofs_da_writepage(struct page *page, struct writeback_control *wbc,
+        void *data)
+{
+    struct cofs_wp *wp = data;
+    struct inode *inode = page->mapping->host;
+    struct buffer_head *head, *bh;
+    sector_t first = 0;
+    unsigned int n = 0;
+
+    if (!page_has_buffers(page) || page_offset(page) + PAGE_SIZE > i_size_read(inode)
+            || cofs_da_map_page(inode, page))
+        goto single;
+    head = bh = page_buffers(page);
+    do {
+        if (!buffer_mapped(bh) || buffer_delay(bh) || !buffer_dirty(bh) 
+                || !buffer_uptodate(bh) || (n && bh->b_blocknr != first + n))
+            goto single;
+        if (!n++)
+            first = bh->b_blocknr;
+    } while ((bh = bh->b_this_page) != head);
+
+    if (wp->bio && wp->next != first)
+        cofs_wp_submit(wp);
+again:
+    if (!wp->bio) {
+        wp->bio = bio_alloc(GFP_NOFS, BIO_MAX_PAGES);
+        bio_set_dev(wp->bio, inode->i_sb->s_bdev);
+        wp->bio->bi_iter.bi_sector = first << (inode->i_blkbits - 9);
+        wp->bio->bi_opf = REQ_OP_WRITE | wbc_to_write_flags(wbc);
+        wp->bio->bi_end_io = cofs_wp_end_io;
+        wbc_init_bio(wbc, wp->bio);
+    }
+    if (bio_add_page(wp->bio, page, PAGE_SIZE, 0) < PAGE_SIZE) {
+        cofs_wp_submit(wp);
+        goto again;
+    }
+    wbc_account_cgroup_owner(wbc, page, PAGE_SIZE);
+    do {
+        clear_buffer_dirty(bh);
+    } while ((bh = bh->b_this_page) != head);
+    set_page_writeback(page);
+    unlock_page(page);
+    wp->next = first + n;
+    return 0;
+
+single:
+    cofs_wp_submit(wp);
+    return block_write_full_page(page, cofs_get_block, wbc);
+}
+
+/*
+ * mpage_writepages would send delayed buffers to their fake block number,
+ * so delalloc has it's own: the delayed blocks of each page are allocated
+ * when the page is locked for writing, in file order. One after the other,
+ * they come from the file's reservation window and are contiguous on disk,
+ * so the pages go out in bios as large as the runs, like with mpage.
+ */
+static int cofs_da_writepages(struct address_space *mapping, 
+        struct writeback_control *wbc)
+{
+    struct cofs_wp wp = { NULL, 0 };
+    struct blk_plug plug;
+    int ret;
+
+    if (cofs_inode_inline(mapping->host))
+        return generic_writepages(mapping, wbc);
+    blk_start_plug(&plug);
+    ret = write_cache_pages(mapping, wbc, cofs_da_writepage, &wp);
+    cofs_wp_submit(&wp);
+    blk_finish_plug(&plug);
+    return ret;
+}
+
+/*
+ * Pages cut by truncate or dropped with the inode, give back the space
+ * reserved for their delayed buffers.
+ */
+static void cofs_da_invalidatepage(struct page *page, unsigned int offset,
+        unsigned int length)
+{
+    struct buffer_head *head, *bh;
+    unsigned int pos = 0, stop = offset + length, count = 0;
+
+    if (page_has_buffers(page)) {
+        head = bh = page_buffers(page);
+        do {
+            if (pos + bh->b_size > stop)
+                break;
+            if (pos >= offset && buffer_delay(bh)) {
+                clear_buffer_delay(bh);
+                count++;
+            }
+            pos += bh->b_size;
+        } while ((bh = bh->b_this_page) != head);
+    }
+    if (count)
+        cofs_da_release(page->mapping->host->i_sb, count);
+    block_invalidatepage(page, offset, length);
+}
+
+/*
+ * A failed write may leave pages (and blocks) past the end of file.
+ * Drop the pages, so they are not written back.
+ */
+static void cofs_write_failed(struct address_space *mapping, loff_t to)
+{
+    struct inode *inode = mapping->host;
+
+    if (to > inode->i_size) {
+        truncate_pagecache(inode, inode->i_size);
+        cofs_truncate(inode, inode->i_size, to);
+    }
+}
+
+/*
+ * A write into the inline room of an inline file only needs page 0 read,
+ * cofs_write_end copies it into the inode. A write past it moves the file
+ * to blocks first. Returns 1 when *pagep is the inline page.
+ */
+static int cofs_inline_write_begin(struct address_space *mapping, loff_t pos,
+        unsigned len, unsigned flags, struct page **pagep, get_block_t *get_block)
+{
+    struct inode *inode = mapping->host;
+    struct page *page;
+    int err;
+
+    if (pos + len > cofs_inline_max(inode->i_sb))
+        return cofs_inline_convert(inode, get_block);
+    if (!(page = grab_cache_page_write_begin(mapping, 0, flags)))
+        return -ENOMEM;
+    if (!PageUptodate(page) && (err = cofs_inline_readpage(inode, page))) {
+        unlock_page(page);
+        put_page(page);
+        return err;
     }
-    if (max > 0 && *offset > inode->i_size) {
+    *pagep = page;
+    return 1;
+}
+
+static int cofs_write_begin(struct file *file, struct address_space *mapping,
+        loff_t pos, unsigned len, unsigned flags, 
+        struct page **pagep, void **fsdata)
+{
+    int ret;
+
+    if (cofs_inode_inline(mapping->host)
+            && (ret = cofs_inline_write_begin(mapping, pos, len, flags, pagep, cofs_get_block)))
+        return ret < 0 ? ret : 0;
+    ret = block_write_begin(mapping, pos, len, flags, pagep, cofs_get_block);
+    if (unlikely(ret)) {
+        cofs_write_failed(mapping, pos + len);
+    }
+    return ret;
+}
+
+static int cofs_da_write_begin(struct file *file, struct address_space *mapping,
+        loff_t pos, unsigned len, unsigned flags, 
+        struct page **pagep, void **fsdata)
+{
+    int ret;
+
+    if (cofs_inode_inline(mapping->host)
+            && (ret = cofs_inline_write_begin(mapping, pos, len, flags, pagep, cofs_da_get_block)))
+        return ret < 0 ? ret : 0;
+    ret = block_write_begin(mapping, pos, len, flags, pagep, cofs_da_get_block);
+    if (unlikely(ret)) {
+        cofs_write_failed(mapping, pos + len);
+    }
+    return ret;
+}
+
+static int cofs_write_end(struct file *file, struct address_space *mapping,
+        loff_t pos, unsigned len, unsigned copied, 
+        struct page *page, void *fsdata)
+{
+    struct inode *inode = mapping->host;
+    loff_t old_size = inode->i_size;
+    int ret;
+
+    if (cofs_inode_inline(inode)) {
+        // the page was read whole by write_begin, a short copy is fine
+        if (pos + copied > old_size)
+            i_size_write(inode, pos + copied);
+        ret = cofs_inline_write(inode, page, pos, pos + copied);
+        unlock_page(page);
+        put_page(page);
+        mark_inode_dirty(inode);
+        return ret ? ret : copied;
+    }
+    ret = generic_write_end(file, mapping, pos, len, copied, page, fsdata);
+    if (inode->i_size > old_size) {
         pr_debug("Update inode size: inode: %lu, size: %llu, new_size: %llu\n",
-                inode->i_ino, inode->i_size, *offset);
-        inode->i_size = *offset;
-        cofs_iput(inode);
+                inode->i_ino, old_size, inode->i_size);
+        mark_inode_dirty(inode);
+    }
+    if (ret < len) {
+        cofs_write_failed(mapping, pos + len);
+    }
+    return ret;
+}
+
+/*
+ * O_DIRECT reads and writes go between the user buffer and the disk, 
+ * without the page cache. Writes into holes are left to the buffered path
+ * (DIO_SKIP_HOLES), so only writes extending the file allocate here.
+ */
+static ssize_t cofs_direct_IO(struct kiocb *iocb, struct iov_iter *iter)
+{
+    struct address_space *mapping = iocb->ki_filp->f_mapping;
+    struct inode *inode = mapping->host;
+    size_t count = iov_iter_count(iter);
+    loff_t offset = iocb->ki_pos;
+    ssize_t ret;
+
+    // inline data has no blocks, it takes the buffered path
+    if (cofs_inode_inline(inode))
+        return 0;
+    ret = blockdev_direct_IO(iocb, inode, iter, cofs_get_block);
+    if (ret < 0 && iov_iter_rw(iter) == WRITE) {
+        cofs_write_failed(mapping, offset + count);
+    }
+    return ret;
+}
+
+static sector_t cofs_bmap(struct address_space *mapping, sector_t block)
+{
+    if (cofs_inode_inline(mapping->host))
+        return 0;
+    return generic_block_bmap(mapping, block, cofs_get_block);
+}
+
+/*
+ * Cutting a file frees the blocks past the new end. Growing it only moves
+ * the end, the new space is a hole that reads as zeros.
+ */
+static int cofs_setattr(struct dentry *dentry, struct iattr *attr)
+{
+    struct inode *inode = d_inode(dentry);
+    loff_t old_size = inode->i_size;
+    int err;
+
+    if ((err = setattr_prepare(dentry, attr)))
+        return err;
+    if ((attr->ia_valid & ATTR_SIZE) && attr->ia_size != old_size) {
+        // O_DIRECT in flight must not reach blocks truncate frees
+        inode_dio_wait(inode);
+        // an inline file keeps only what fits in the inode, give it blocks
+        if (cofs_inode_inline(inode) && attr->ia_size > cofs_inline_max(inode->i_sb)
+                && (err = cofs_inline_convert(inode, cofs_get_block)))
+            return err;
+        if (attr->ia_size < old_size && !cofs_inode_inline(inode)) {
+            // zero the tail of the last block, a later extend must read zeros
+            err = block_truncate_page(inode->i_mapping, attr->ia_size, cofs_get_block);
+            if (err)
+                return err;
+        }
+        truncate_setsize(inode, attr->ia_size);
+        // blocks preallocated past the old end go too
+        if (attr->ia_size < old_size && cofs_inode_inline(inode))
+            cofs_inline_zero(inode, attr->ia_size);
+        else if (attr->ia_size < old_size)
+            cofs_truncate(inode, attr->ia_size, inode->i_sb->s_maxbytes);
+    }
+    setattr_copy(inode, attr);
+    mark_inode_dirty(inode);
+    return 0;
+}
+
+/*
+ * Zeroes bytes from..to-1 of a single block, if the block is on disk. It is
+ * done through the page cache, so the zeros reach the disk with the page.
+ * Holes (and delayed blocks) only need the page cache cleared, which the
+ * caller does with truncate_pagecache_range.
+ */
+static int cofs_zero_partial(struct file *file, loff_t from, loff_t to)
+{
+    struct address_space *mapping = file->f_mapping;
+    struct inode *inode = mapping->host;
+    struct page *page;
+    void *fsdata;
+    unsigned int len;
+    int err;
+
+    to = cofs_min(to, inode->i_size);
+    if (from >= to || !cofs_lookup_block(inode, from >> inode->i_blkbits))
+        return 0;
+    len = to - from;
+    err = pagecache_write_begin(file, mapping, from, len, 0, &page, &fsdata);
+    if (err)
+        return err;
+    zero_user(page, offset_in_page(from), len);
+    err = pagecache_write_end(file, mapping, from, len, len, page, fsdata);
+    return err < 0 ? err : 0;
+}
+
+/*
+ * Frees the blocks fully inside offset..end-1 and zeroes the partial ones
+ */
+static int cofs_punch_hole(struct file *file, loff_t offset, loff_t end)
+{
+    struct inode *inode = file_inode(file);
+    loff_t bstart = round_up(offset, inode->i_sb->s_blocksize);
+    loff_t bend = round_down(end, inode->i_sb->s_blocksize);
+    int err;
+
+    if (bstart > bend) {
+        // inside a single block
+        err = cofs_zero_partial(file, offset, end);
+    } else if (!(err = cofs_zero_partial(file, offset, bstart))) {
+        err = cofs_zero_partial(file, bend, end);
+    }
+    if (err)
+        return err;
+    truncate_pagecache_range(inode, offset, end - 1);
+    if (bstart < bend)
+        cofs_truncate(inode, bstart, bend);
+    return 0;
+}
+
+/**
+ * fallocate: preallocates blocks (mode 0 or FALLOC_FL_KEEP_SIZE), punches
+ * holes (FALLOC_FL_PUNCH_HOLE) or zeroes a range (FALLOC_FL_ZERO_RANGE).
+ * Zeroing punches the whole blocks of the range and preallocates them again,
+ * so on an extents file system it writes nothing but the partial blocks.
+ */
+static long cofs_fallocate(struct file *file, int mode, loff_t offset, loff_t len)
+{
+    struct inode *inode = file_inode(file);
+    loff_t end = offset + len;
+    int err = 0;
+
+    if (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE))
+        return -EOPNOTSUPP;
+    if (!S_ISREG(inode->i_mode))
+        return -ENODEV;
+
+    inode_lock(inode);
+    if (!(mode & FALLOC_FL_KEEP_SIZE) && end > inode->i_size
+            && (err = inode_newsize_ok(inode, end)))
+        goto out;
+    if (end > inode->i_sb->s_maxbytes) {
+        err = -EFBIG;
+        goto out;
+    }
+    inode_dio_wait(inode);
+    // the blocks of the range are worked on, give the file blocks
+    if (cofs_inode_inline(inode) && (err = cofs_inline_convert(inode, cofs_get_block)))
+        goto out;
+    if (mode & (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE)) {
+        if ((err = cofs_punch_hole(file, offset, end)))
+            goto out;
+        inode->i_mtime = inode->i_ctime = current_time(inode);
+    }
+    if (!(mode & FALLOC_FL_PUNCH_HOLE)) {
+        err = cofs_prealloc(inode, offset >> inode->i_blkbits,
+                (end + inode->i_sb->s_blocksize - 1) >> inode->i_blkbits);
+        if (err)
+            goto out;
+        if (!(mode & FALLOC_FL_KEEP_SIZE) && end > inode->i_size) {
+            i_size_write(inode, end);
+            inode->i_ctime = current_time(inode);
+        }
     }
-    return total;
+out:
+    mark_inode_dirty(inode);
+    inode_unlock(inode);
+    return err;
 }
 
+/**
+ * Writes the dirty pages of the range, the indirect tables or extent nodes
+ * of the file (on the mapping's buffer list, see mark_buffer_dirty_inode),
+ * it's inode table block and the bitmaps, then flushes the disk cache once.
+ * Other files' dirty data stays where it is. With a journal, the metadata
+ * is all in the running transaction: committing it flushes the cache, and
+ * fsyncs running together share the commit.
+ */
+int cofs_fsync(struct file *file, loff_t start, loff_t end, int datasync)
+{
+    struct inode *inode = file->f_mapping->host;
+    struct super_block *sb = inode->i_sb;
+    int err, ret;
+
+    if (cofs_has_journal(sb)) {
+        if ((ret = file_write_and_wait_range(file, start, end)))
+            return ret;
+        if ((ret = cofs_update_inode(inode)))
+            return ret;
+        return cofs_journal_commit(sb);
+    }
+    ret = __generic_file_fsync(file, start, end, datasync);
+    err = cofs_bitmap_sync(sb, 1);
+    if (ret || (ret = err))
+        return ret;
+    return blkdev_issue_flush(sb->s_bdev, GFP_KERNEL);
+}
+
+/*
+ * The last writer is gone; give back the blocks reserved ahead for the file
+ */
+static int cofs_release_file(struct inode *inode, struct file *file)
+{
+    // other writers, or the next append, still grow the file in the window
+    if ((file->f_mode & FMODE_WRITE) && atomic_read(&inode->i_writecount) == 1) {
+        cofs_discard_reservation(inode);
+    }
+    return 0;
+}
+
+struct address_space_operations cofs_aops = {
+	.readpage       = cofs_readpage,
+	.readahead      = cofs_readahead,
+	.writepage      = cofs_writepage,
+	.writepages     = cofs_writepages,
+	.write_begin    = cofs_write_begin,
+	.write_end      = cofs_write_end,
+	.bmap           = cofs_bmap,
+	.direct_IO      = cofs_direct_IO,
+};
+
+// with mount -o delalloc
+struct address_space_operations cofs_da_aops = {
+	.readpage       = cofs_readpage,
+	.readahead      = cofs_readahead,
+	.writepage      = cofs_writepage,
+	.writepages     = cofs_da_writepages,
+	.write_begin    = cofs_da_write_begin,
+	.write_end      = cofs_write_end,
+	.bmap           = cofs_bmap,
+	.direct_IO      = cofs_direct_IO,
+	.invalidatepage = cofs_da_invalidatepage,
+};
+
 struct inode_operations cofs_file_inode_ops = {
+	.setattr        = cofs_setattr,
 	.getattr        = simple_getattr,
 };
 
 struct file_operations cofs_file_operations = {
-	.read           = cofs_file_read,
-	.write          = cofs_file_write,
-	.mmap           = generic_file_mmap,
-	.fsync          = noop_fsync,
 	.llseek         = generic_file_llseek,
+	.read_iter      = generic_file_read_iter,
+	.write_iter     = generic_file_write_iter,
+	.mmap           = generic_file_mmap,
+	.fsync          = cofs_fsync,
+	.splice_read    = generic_file_splice_read,
+	.fallocate      = cofs_fallocate,
+	.release        = cofs_release_file,
 };
-
@@ -1,63 +1,184 @@
 #include <linux/buffer_head.h>
+#include <linux/slab.h>
+#include <linux/random.h>
 #include "cofs_common.h"
+#include "super.h"
+#include "inode.h"
 #include "block.h"
+#include "extent.h"
+#include "dircache.h"
+#include "orphan.h"
+#include "journal.h"
 
 extern struct inode_operations cofs_dir_inode_ops;
 extern struct file_operations cofs_dir_operations;
 extern struct inode_operations cofs_file_inode_ops;
 extern struct file_operations cofs_file_operations;
+extern struct address_space_operations cofs_aops;
+extern struct address_space_operations cofs_da_aops;
 
 /**
- * Reads physical inode ino from disk, save the buffer into bh
+ * Reads physical inode ino from disk, save the buffer into *bh
  * and returns a pointer in this buffer to the inode
  * It is the caller duty to brelse this buffer
  * It can return NULL if cannot read this block number
  */
 cofs_inode_t *cofs_raw_inode(struct super_block *sb, unsigned long ino, 
-              struct buffer_head *bh)
+              struct buffer_head **bh)
 {
-    unsigned int block_no; 
-    cofs_inode_t *dino = NULL;
-    block_no = ((cofs_superblock_t *)sb->s_fs_info)->inode_start;
-    block_no += ino / NUM_INOPB;
-    if (!(bh = sb_bread(sb, block_no))) {
+    unsigned int block_no, isz = cofs_inode_size(sb); 
+    block_no = COFS_SB(sb)->s_sb->inode_start;
+    block_no += ino / NUM_INOPB(sb->s_blocksize, isz);
+    if (!(*bh = sb_bread(sb, block_no))) {
         return NULL;
     }
 
-    dino = (cofs_inode_t *) bh->b_data;
-    dino += (ino % NUM_INOPB);
-    
-    return dino;
+    return (cofs_inode_t *) ((*bh)->b_data + ino % NUM_INOPB(sb->s_blocksize, isz) * isz);
+}
+
+/**
+ * Returns the inline data of inode, in the buffer of it's disk inode,
+ * saved into *bh. It is the caller duty to brelse it.
+ */
+char *cofs_inline_data(struct inode *inode, struct buffer_head **bh)
+{
+    cofs_inode_t *dino;
+
+    if (!(dino = cofs_raw_inode(inode->i_sb, inode->i_ino, bh)))
+        return NULL;
+    return COFS_INLINE_DATA(dino);
+}
+
+/**
+ * Clears the inline data of inode from offset from, after a truncate,
+ * so growing it again reads zeroes
+ */
+void cofs_inline_zero(struct inode *inode, loff_t from)
+{
+    struct buffer_head *bh;
+    unsigned int max = cofs_inline_max(inode->i_sb);
+    char *data;
+
+    if (from >= max)
+        return;
+    cofs_journal_join(inode->i_sb);
+    if ((data = cofs_inline_data(inode, &bh))) {
+        memset(data + from, 0, max - from);
+        cofs_journal_dirty_inode(bh, inode);
+        brelse(bh);
+    }
+    cofs_journal_stop(inode->i_sb);
+}
+
+/**
+ * Reads block of a directory, for a walk of it's dirents. Returns the first
+ * one and sets *end after the last, NULL for a hole, or an error. An inline
+ * directory has only block 0, in the inode. It is the caller duty to brelse
+ * *bh.
+ */
+struct cofs_dirent *cofs_dir_block(struct inode *dir, unsigned int block,
+        struct buffer_head **bh, struct cofs_dirent **end)
+{
+    unsigned int block_no;
+    char *data;
+
+    if (cofs_inode_inline(dir)) {
+        if (!(data = cofs_inline_data(dir, bh)))
+            return ERR_PTR(-EIO);
+        *end = (struct cofs_dirent *) (data + dir->i_size);
+        return (struct cofs_dirent *) data;
+    }
+    if (!(block_no = cofs_lookup_block(dir, block)))
+        return NULL;
+    if (!(*bh = sb_bread(dir->i_sb, block_no)))
+        return ERR_PTR(-EIO);
+    *end = (struct cofs_dirent *) ((*bh)->b_data + dir->i_sb->s_blocksize);
+    return (struct cofs_dirent *) (*bh)->b_data;
 }
 
 /**
- * Puts back to disk the inode / updates it
+ * Copies the inode into it's disk inode, and writes it if sync. With a
+ * journal, the copy joins the running transaction instead.
  */
-void cofs_iput(struct inode *inode) 
+static int __cofs_write_inode(struct inode *inode, int sync)
 {
     cofs_inode_t *dino; // the disk inode
     struct buffer_head *bh;
-    // cofs superblock //
-    cofs_superblock_t *cofs_sb = (cofs_superblock_t *) inode->i_sb->s_fs_info;
-    // block containing this inode //
-    unsigned int block_no = (inode->i_ino) / NUM_INOPB + cofs_sb->inode_start;
+    int err = 0;
     
     // read the buffer containing this disk inode
-    bh = sb_bread(inode->i_sb, block_no);
-    dino = (cofs_inode_t *) bh->b_data + inode->i_ino % NUM_INOPB;
+    if (!(dino = cofs_raw_inode(inode->i_sb, inode->i_ino, &bh)))
+        return -EIO;
     dino->type = inode->i_mode & S_IFMT; // not very sure...
-    pr_debug("cofs_iput: inode: %lu, mode: %u, ino mode: %u\n", 
+    pr_debug("cofs_write_inode: inode: %lu, mode: %u, ino mode: %u\n", 
             inode->i_ino, dino->type, inode->i_mode);
     dino->uid = inode->i_uid.val;
     dino->gid = inode->i_gid.val;
     dino->num_links = inode->i_nlink;
-    dino->atime = inode->i_atime.tv_sec;
+    // COFS_ORPHAN_NEXT lives there when there are no links
+    if (inode->i_nlink)
+        dino->atime = inode->i_atime.tv_sec;
     dino->ctime = inode->i_ctime.tv_sec;
     dino->mtime = inode->i_mtime.tv_sec;
     dino->size = inode->i_size;
-    //--- addrs ? ---//
-    mark_buffer_dirty(bh);
+    // not under i_map_sem, called with it held; a change of the map is
+    // followed by mark_inode_dirty, so it is copied again
+    memcpy(dino->addrs, COFS_I(inode)->i_addrs, sizeof(dino->addrs));
+    if (cofs_has_inline(inode->i_sb))
+        COFS_INODE_TAIL(dino)->flags = COFS_I(inode)->i_flags;
+    cofs_journal_dirty(inode->i_sb, bh);
+    if (sync && !cofs_has_journal(inode->i_sb)) {
+        sync_dirty_buffer(bh);
+        if (buffer_req(bh) && !buffer_uptodate(bh))
+            err = -EIO;
+    }
     brelse(bh);
+    return err;
+}
+
+/**
+ * Called by the VFS for inodes marked dirty, like after the block
+ * mapping, the size or the links changed. Nobody writes the disk inode
+ * directly, so a run of small appends copies it in the buffer only once,
+ * at writeback. With lazytime, timestamp only changes wait here until
+ * the inode is dirtied for something else, or they expire.
+ */
+int cofs_write_inode(struct inode *inode, struct writeback_control *wbc)
+{
+    // for sync(2), the inode table blocks are written together by sync_fs
+    int sync = wbc->sync_mode == WB_SYNC_ALL && !wbc->for_sync;
+    int err;
+
+    if (!cofs_has_journal(inode->i_sb))
+        return __cofs_write_inode(inode, sync);
+    if ((err = cofs_update_inode(inode)) || !sync)
+        return err;
+    return cofs_journal_commit(inode->i_sb);
+}
+
+/**
+ * Copies the inode into the running transaction, for a journal
+ */
+int cofs_update_inode(struct inode *inode)
+{
+    int err;
+
+    cofs_journal_join(inode->i_sb);
+    err = __cofs_write_inode(inode, 0);
+    cofs_journal_stop(inode->i_sb);
+    return err;
+}
+
+/**
+ * The dirty_inode of cofs. With a journal, a change to the inode goes in
+ * the transaction of the change that made it, like the blocks it mapped;
+ * waiting for writeback, a commit could take the blocks without the inode.
+ * Timestamp only changes of lazytime still wait.
+ */
+void cofs_dirty_inode(struct inode *inode, int flags)
+{
+    if (cofs_has_journal(inode->i_sb) && (flags & I_DIRTY_INODE))
+        cofs_update_inode(inode);
 }
 
 struct inode *cofs_iget(struct super_block *sb, unsigned long ino)
@@ -74,7 +195,7 @@ struct inode *cofs_iget(struct super_block *sb, unsigned long ino)
     if (!(inode->i_state & I_NEW))
         return inode;
     
-    if (!(dino = cofs_raw_inode(sb, ino, bh))) {
+    if (!(dino = cofs_raw_inode(sb, ino, &bh))) {
         iget_failed(inode);
         return ERR_PTR(-EIO);
     }
@@ -88,6 +209,15 @@ struct inode *cofs_iget(struct super_block *sb, unsigned long ino)
     i_uid_write(inode, dino->uid);
 	i_gid_write(inode, dino->gid);
 	set_nlink(inode, dino->num_links);
+    inode->i_atime.tv_sec = dino->atime;
+    inode->i_mtime.tv_sec = dino->mtime;
+    inode->i_ctime.tv_sec = dino->ctime;
+    inode->i_atime.tv_nsec = inode->i_mtime.tv_nsec = inode->i_ctime.tv_nsec = 0;
+    // the block map is kept in memory, cofs_write_inode writes it back
+    memcpy(COFS_I(inode)->i_addrs, dino->addrs, sizeof(dino->addrs));
+    COFS_I(inode)->i_flags = 0;
+    if (cofs_has_inline(sb))
+        COFS_I(inode)->i_flags = COFS_INODE_TAIL(dino)->flags;
 
     switch (inode->i_mode & S_IFMT) {
         case S_IFDIR:
@@ -100,6 +230,10 @@ struct inode *cofs_iget(struct super_block *sb, unsigned long ino)
             pr_debug("cofs: inode %lu describe a regular file\n", ino);
             inode->i_op = &cofs_file_inode_ops;
             inode->i_fop = &cofs_file_operations;
+            if (cofs_test_opt(sb, COFS_MOUNT_DELALLOC))
+                inode->i_mapping->a_ops = &cofs_da_aops;
+            else
+                inode->i_mapping->a_ops = &cofs_aops;
             break;
             
         case S_IFLNK:
@@ -116,121 +250,449 @@ struct inode *cofs_iget(struct super_block *sb, unsigned long ino)
     return inode;
 }
 
-// Allocates a free inode on disk //
-struct inode *cofs_inode_alloc(struct super_block *sb, unsigned short int type)
+/*
+ * Takes the first free inode number of a group in the inode bitmap.
+ * Returns 0 if there is none.
+ */
+static unsigned long cofs_imap_alloc(struct super_block *sb, unsigned int group)
+{
+    struct cofs_sb_info *sbi = COFS_SB(sb);
+    struct cofs_group *grp = &sbi->s_groups[group];
+    unsigned long ino = group * sbi->s_inodes_per_group,
+                  end = cofs_min(ino + sbi->s_inodes_per_group, sbi->s_sb->num_inodes);
+    unsigned int i, bit, to, bpb = BITS_PER_BLOCK(sb->s_blocksize);
+
+    if (!READ_ONCE(grp->g_free_inodes))
+        return 0;
+    spin_lock(&grp->g_lock);
+    // a group may end in the next inode bitmap block
+    while (ino < end) {
+        i = ino / bpb;
+        to = cofs_min(bpb, end - i * bpb);
+        bit = find_next_zero_bit_le(sbi->s_imap[i]->b_data, to, ino % bpb);
+        if (bit < to) {
+            __set_bit_le(bit, sbi->s_imap[i]->b_data);
+            grp->g_free_inodes--;
+            spin_unlock(&grp->g_lock);
+            cofs_journal_dirty(sb, sbi->s_imap[i]);
+            return i * bpb + bit;
+        }
+        ino = (i + 1) * bpb;
+    }
+    spin_unlock(&grp->g_lock);
+    return 0;
+}
+
+/*
+ * Chooses the group of a new inode, in the Orlov way. Directories made at
+ * the top spread over the disk: from a random group, the first having more
+ * free inodes and blocks than the average. Other directories stay in their
+ * parent's group while it has a fair share of room left, else go to the
+ * next that has. Files go in the group of their directory, or one found by
+ * hashing it's number, so the files of a directory end up together and
+ * directories do not fill each other's groups.
+ */
+static unsigned int cofs_find_group(struct inode *dir, int is_dir)
+{
+    struct cofs_sb_info *sbi = COFS_SB(dir->i_sb);
+    struct cofs_group *groups = sbi->s_groups;
+    unsigned int ngroups = sbi->s_bmap_blocks, parent = cofs_ino_group(dir->i_sb, dir->i_ino);
+    unsigned int avg_inodes = percpu_counter_read_positive(&sbi->s_free_inodes) / ngroups,
+                 avg_blocks = percpu_counter_read_positive(&sbi->s_free_blocks) / ngroups,
+                 g, i, start;
+
+    if (is_dir && dir == d_inode(dir->i_sb->s_root)) {
+        start = prandom_u32() % ngroups;
+        for (i = 0; i < ngroups; i++) {
+            g = (start + i) % ngroups;
+            if (READ_ONCE(groups[g].g_free_inodes) > avg_inodes
+                    && READ_ONCE(groups[g].g_free_blocks) >= avg_blocks)
+                return g;
+        }
+    } else if (is_dir) {
+        for (i = 0; i < ngroups; i++) {
+            g = (parent + i) % ngroups;
+            if (READ_ONCE(groups[g].g_free_inodes) > avg_inodes / 4
+                    && READ_ONCE(groups[g].g_free_blocks) > avg_blocks / 4)
+                return g;
+        }
+    } else {
+        if (READ_ONCE(groups[parent].g_free_inodes) && READ_ONCE(groups[parent].g_free_blocks))
+            return parent;
+        // like ext2, a quadratic walk from a group given by the directory
+        g = (parent + dir->i_ino) % ngroups;
+        for (i = 1; i < ngroups; i <<= 1) {
+            g = (g + i) % ngroups;
+            if (READ_ONCE(groups[g].g_free_inodes) && READ_ONCE(groups[g].g_free_blocks))
+                return g;
+        }
+    }
+    // any group with a free inode, the caller goes on from there
+    return parent;
+}
+
+/*
+ * Looks for a free inode walking the inode table, for file systems made
+ * without an inode bitmap. Returns 0 if there is none.
+ */
+static unsigned long cofs_itable_alloc(struct super_block *sb)
 {
     struct buffer_head *bh;
     cofs_inode_t *dino;
-    cofs_superblock_t *cofs_sb = (cofs_superblock_t *) sb->s_fs_info;
+    cofs_superblock_t *cofs_sb = COFS_SB(sb)->s_sb;
  
-    // Slow thing. TODO - use an inode map on disk, like the bit block //
-    unsigned int block, i;
-    for (block = 0; block < cofs_sb->num_inodes / NUM_INOPB; block++)
+    // Slow thing. New file systems have an inode bitmap //
+    unsigned int block, i, isz = cofs_inode_size(sb), ipb = NUM_INOPB(sb->s_blocksize, isz);
+    for (block = 0; block < cofs_sb->num_inodes / ipb; block++)
     {
         bh = sb_bread(sb, cofs_sb->inode_start + block);
-        dino = (cofs_inode_t *) bh->b_data;
-        for (i = 0; i < NUM_INOPB; i++, dino++) {
+        for (i = 0; i < ipb; i++) {
             if (block == 0 && i == 0)
                 continue;
+            dino = (cofs_inode_t *) (bh->b_data + i * isz);
             if (dino->type == 0) {
-                memset(dino, 0, sizeof(*dino));
-                dino->type = type;
-                mark_buffer_dirty(bh);
                 brelse(bh);
-                printk("COFS: allocating inode: %lu\n", block * NUM_INOPB + i);
-                return cofs_iget(sb, block * NUM_INOPB + i);
+                return block * ipb + i;
             }
         }
         brelse(bh);
     }
-    pr_debug("cofs: inode_alloc - no free inodes!\n");
-    return NULL;
+    return 0;
 }
 
-static int cofs_truncate(struct inode *inode, unsigned int length)
+/**
+ * Allocates a free inode on disk, of type, for a new entry of dir. With an
+ * inode bitmap, it is taken in the group cofs_find_group chooses, or the
+ * first one after it with a free inode; without, the inode table walk is
+ * done by one at a time.
+ */
+struct inode *cofs_inode_alloc(struct inode *dir, unsigned short int type)
 {
-    unsigned int fbn, fbs, fbe; // file block num, start, end
-    unsigned int *blocks, sidx, didx, rel_b, pblock;
-    struct buffer_head *buf, *dino_buf = NULL;
-    struct super_block *sb = inode->i_sb;
+    struct super_block *sb = dir->i_sb;
+    struct cofs_sb_info *sbi = COFS_SB(sb);
+    int imap = COFS_HAS_FEATURE(sbi->s_sb, COFS_FEAT_IMAP);
+    struct buffer_head *bh = NULL;
     cofs_inode_t *dino;
-    
-    pr_debug("truncating inode %lu to %u length\n", inode->i_ino, length);
-    if (length > inode->i_size) {
-        return -1;
-    }
-    fbs = length / COFS_BLOCK_SIZE;
-    fbe = (inode->i_size / COFS_BLOCK_SIZE) + 1;
-    dino = cofs_raw_inode(inode->i_sb, inode->i_ino, dino_buf);
-
-    for (fbn = fbs; fbn < fbe; fbn++) {
-        if (fbn < NUM_DIRECT) {
-            if (dino->addrs[fbn]) {
-                cofs_block_free(sb, dino->addrs[fbn]);
-                dino->addrs[fbn] = 0;
+    unsigned long ino = 0;
+    unsigned int g, i;
+
+    if (imap) {
+        g = cofs_find_group(dir, S_ISDIR(type));
+        for (i = 0; i < sbi->s_bmap_blocks && !ino; i++, g = (g + 1) % sbi->s_bmap_blocks)
+            ino = cofs_imap_alloc(sb, g);
+    } else {
+        mutex_lock(&sbi->s_itable_lock);
+        ino = cofs_itable_alloc(sb);
+    }
+    if (!ino) {
+        pr_debug("cofs: inode_alloc - no free inodes!\n");
+        goto out;
+    }
+    if (!(dino = cofs_raw_inode(sb, ino, &bh))) {
+        ino = 0;
+        goto out;
+    }
+    memset(dino, 0, cofs_inode_size(sb));
+    dino->type = type;
+    // new files and directories start inline, if there is room
+    if (cofs_has_inline(sb) && (S_ISREG(type) || S_ISDIR(type))) {
+        COFS_INODE_TAIL(dino)->flags = COFS_INODE_INLINE;
+        if (S_ISDIR(type))
+            dino->size = COFS_INLINE_DIR_SIZE(cofs_inode_size(sb));
+    }
+    cofs_journal_dirty(sb, bh);
+    brelse(bh);
+    percpu_counter_dec(&sbi->s_free_inodes);
+out:
+    if (!imap)
+        mutex_unlock(&sbi->s_itable_lock);
+    if (!ino)
+        return NULL;
+    pr_debug("cofs: allocating inode: %lu\n", ino);
+    return cofs_iget(sb, ino);
+}
+
+/*
+ * The inode is deleted; it's number can be used again
+ */
+static void cofs_inode_free(struct super_block *sb, unsigned long ino)
+{
+    struct cofs_sb_info *sbi = COFS_SB(sb);
+    struct cofs_group *grp = &sbi->s_groups[cofs_ino_group(sb, ino)];
+    struct buffer_head *bh;
+
+    percpu_counter_inc(&sbi->s_free_inodes);
+    if (!COFS_HAS_FEATURE(sbi->s_sb, COFS_FEAT_IMAP))
+        return;
+    bh = sbi->s_imap[ino / BITS_PER_BLOCK(sb->s_blocksize)];
+    spin_lock(&grp->g_lock);
+    if (!__test_and_clear_bit_le(ino % BITS_PER_BLOCK(sb->s_blocksize), bh->b_data)) {
+        spin_unlock(&grp->g_lock);
+        pr_err("cofs: inode %lu allready free\n", ino);
+        return;
+    }
+    grp->g_free_inodes++;
+    spin_unlock(&grp->g_lock);
+    cofs_journal_dirty(sb, bh);
+}
+
+/*
+ * Reads the inode bitmap and counts the free inodes of each group in it
+ */
+static int cofs_imap_load(struct super_block *sb, unsigned int *free)
+{
+    struct cofs_sb_info *sbi = COFS_SB(sb);
+    unsigned int i, bit, to, bpb = BITS_PER_BLOCK(sb->s_blocksize);
+
+    sbi->s_imap_blocks = DIV_ROUND_UP(sbi->s_sb->num_inodes, bpb);
+    sbi->s_imap = kcalloc(sbi->s_imap_blocks, sizeof(*sbi->s_imap), GFP_KERNEL);
+    if (!sbi->s_imap)
+        return -ENOMEM;
+    for (i = 0; i < sbi->s_imap_blocks; i++) {
+        if (!(sbi->s_imap[i] = sb_bread(sb, sbi->s_sb->imap_start + i))) {
+            pr_err("cofs: cannot read inode bitmap block %u\n", i);
+            return -EIO;
+        }
+        to = cofs_min(bpb, sbi->s_sb->num_inodes - i * bpb);
+        bit = find_next_zero_bit_le(sbi->s_imap[i]->b_data, to, 0);
+        while (bit < to) {
+            sbi->s_groups[cofs_ino_group(sb, i * bpb + bit)].g_free_inodes++;
+            (*free)++;
+            bit = find_next_zero_bit_le(sbi->s_imap[i]->b_data, to, bit + 1);
+        }
+    }
+    return 0;
+}
+
+/**
+ * Counts the free inodes at mount time, after cofs_bitmap_load made the
+ * groups. The inode bitmap stays in memory, like the block bitmap.
+ */
+int cofs_inodes_load(struct super_block *sb)
+{
+    struct cofs_sb_info *sbi = COFS_SB(sb);
+    cofs_superblock_t *cofs_sb = sbi->s_sb;
+    struct buffer_head *bh;
+    cofs_inode_t *dino;
+    unsigned int block, i, free = 0, isz = cofs_inode_size(sb),
+                 ipb = NUM_INOPB(sb->s_blocksize, isz);
+    int err;
+
+    mutex_init(&sbi->s_itable_lock);
+    if (COFS_HAS_FEATURE(cofs_sb, COFS_FEAT_IMAP)) {
+        if ((err = cofs_imap_load(sb, &free)))
+            return err;
+    } else {
+        for (block = 0; block < cofs_sb->num_inodes / ipb; block++) {
+            if (!(bh = sb_bread(sb, cofs_sb->inode_start + block))) {
+                return -EIO;
             }
-        } else if (fbn < NUM_DIRECT + NUM_SIND) {
-            buf = sb_bread(sb, dino->addrs[SIND_IDX]);
-            blocks = (unsigned int *) buf->b_data;
-            sidx = fbn - NUM_DIRECT;
-            cofs_block_free(sb, blocks[sidx]);
-            blocks[sidx] = 0;
-            mark_buffer_dirty(buf);
-            brelse(buf);
-            if (cofs_scan_block(sb, dino->addrs[SIND_IDX]) == 0) {
-                cofs_block_free(sb, dino->addrs[SIND_IDX]);
-                dino->addrs[SIND_IDX] = 0;
+            for (i = 0; i < ipb; i++) {
+                dino = (cofs_inode_t *) (bh->b_data + i * isz);
+                if (dino->type == 0 && (block || i)) {
+                    free++;
+                }
             }
-        } else if (fbn < MAX_FILE_SIZE) {
-            rel_b = fbn - NUM_DIRECT - NUM_SIND;
-            sidx = fbn / NUM_EINB;
-            didx = fbn % NUM_EINB;
-
-            buf = sb_bread(sb, dino->addrs[DIND_IDX]);
-            blocks = (unsigned int *) buf->b_data;
-            pblock = blocks[sidx];
-            brelse(buf);
-            
-            buf = sb_bread(sb, pblock);
-            blocks = (unsigned int *) buf->b_data;
-            cofs_block_free(sb, blocks[didx]);
-            blocks[didx] = 0;
-            mark_buffer_dirty(buf);
-            brelse(buf);
+            brelse(bh);
+        }
+    }
+    return percpu_counter_init(&sbi->s_free_inodes, free, GFP_KERNEL);
+}
 
-            if (cofs_scan_block(sb, pblock) == 0) {
-                cofs_block_free(sb, pblock);
-                buf = sb_bread(sb, dino->addrs[DIND_IDX]);
-                blocks = (unsigned int *) buf->b_data;
-                blocks[sidx] = 0;
-                mark_buffer_dirty(buf);
-                brelse(buf);
-            }
+void cofs_inodes_release(struct super_block *sb)
+{
+    struct cofs_sb_info *sbi = COFS_SB(sb);
+    unsigned int i;
 
-            if (cofs_scan_block(sb, dino->addrs[DIND_IDX]) == 0) {
-                cofs_block_free(sb, dino->addrs[DIND_IDX]);
-                dino->addrs[DIND_IDX] = 0;
-            }
+    if (sbi->s_imap) {
+        for (i = 0; i < sbi->s_imap_blocks; i++)
+            brelse(sbi->s_imap[i]);
+    }
+    kfree(sbi->s_imap);
+    sbi->s_imap = NULL;
+    percpu_counter_destroy(&sbi->s_free_inodes);
+}
+
+// a run of contiguous blocks to free, given to cofs_blocks_free at once
+struct cofs_free_run {
+    unsigned int start, len;
+};
+
+static void cofs_free_flush(struct super_block *sb, struct cofs_free_run *run)
+{
+    if (run->len)
+        cofs_blocks_free(sb, run->start, run->len);
+    run->len = 0;
+}
+
+static void cofs_free_add(struct super_block *sb, struct cofs_free_run *run,
+        unsigned int block)
+{
+    if (run->len && run->start + run->len == block) {
+        run->len++;
+        return;
+    }
+    cofs_free_flush(sb, run);
+    run->start = block;
+    run->len = 1;
+}
+
+static int cofs_table_empty(struct super_block *sb, unsigned int *blocks)
+{
+    unsigned int i;
+
+    for (i = 0; i < NUM_EINB(sb->s_blocksize); i++) {
+        if (blocks[i])
+            return 0;
+    }
+    return 1;
+}
+
+/*
+ * Frees the blocks of entries from..to-1 of the indirect table *table, in a
+ * single pass. A table left empty is freed too and *table is cleared.
+ */
+static void cofs_free_table(struct inode *inode, struct cofs_free_run *run,
+        unsigned int *table, unsigned int from, unsigned int to)
+{
+    struct super_block *sb = inode->i_sb;
+    struct buffer_head *buf;
+    unsigned int *blocks, i;
+
+    if (!(buf = sb_bread(sb, *table))) {
+        pr_err("cofs: cannot read indirect table %u\n", *table);
+        return;
+    }
+    blocks = (unsigned int *) buf->b_data;
+    for (i = from; i < to; i++) {
+        if (blocks[i]) {
+            cofs_free_add(sb, run, blocks[i]);
+            blocks[i] = 0;
         }
     }
-    inode->i_size = length;
-    cofs_iput(inode);
+    if (cofs_table_empty(sb, blocks)) {
+        bforget(buf);
+        cofs_free_add(sb, run, *table);
+        *table = 0;
+        return;
+    }
+    cofs_journal_dirty_inode(buf, inode);
+    brelse(buf);
+}
+
+/**
+ * Frees the blocks of a file cut at byte from, that used to end at byte to.
+ * The block holding byte from - 1 is kept. Unmapped blocks (holes) are
+ * skipped. The caller sets the new i_size. A to of s_maxbytes also frees
+ * blocks preallocated past the end of file; a to inside the file punches
+ * a hole.
+ * Every indirect table is read once, whole second level tables in the range
+ * are dropped with their blocks, and contiguous blocks are freed together.
+ * The block map is held exclusive (i_map_sem) meanwhile, but for the journal
+ * restarts a large extent tree needs.
+ */
+int cofs_truncate(struct inode *inode, loff_t from, loff_t to)
+{
+    unsigned int fbn, fbs, fbe, fbl; // file block num, start, end, last + 1
+    unsigned int *blocks, sidx, first, last;
+    struct buffer_head *buf;
+    struct super_block *sb = inode->i_sb;
+    unsigned int epb = NUM_EINB(sb->s_blocksize);
+    unsigned int *addrs = COFS_I(inode)->i_addrs;
+    struct cofs_free_run run = { 0, 0 };
+    
+    pr_debug("truncating inode %lu from %llu to %llu\n", inode->i_ino, from, to);
+    // inline data has no blocks, it goes with the inode
+    if (from >= to || cofs_inode_inline(inode)) {
+        return 0;
+    }
+    cofs_journal_start(sb);
+    cofs_discard_reservation(inode);
+    down_write(&COFS_I(inode)->i_map_sem);
+    fbs = (from + sb->s_blocksize - 1) >> sb->s_blocksize_bits;
+    fbl = (to + sb->s_blocksize - 1) >> sb->s_blocksize_bits;
+    if (COFS_HAS_FEATURE(COFS_SB(sb)->s_sb, COFS_FEAT_EXTENTS)) {
+        // one leaf after the other, in as many transactions as it takes
+        while (cofs_ext_truncate(inode, fbs, to >= sb->s_maxbytes ? COFS_EXT_END : fbl)
+                == -EAGAIN) {
+            up_write(&COFS_I(inode)->i_map_sem);
+            cofs_journal_restart(sb);
+            down_write(&COFS_I(inode)->i_map_sem);
+        }
+        goto out;
+    }
+    fbe = cofs_min(fbl, MAX_FILE_SIZE(sb->s_blocksize));
+
+    for (fbn = fbs; fbn < cofs_min(fbe, NUM_DIRECT); fbn++) {
+        if (addrs[fbn]) {
+            cofs_free_add(sb, &run, addrs[fbn]);
+            addrs[fbn] = 0;
+        }
+    }
+    // directories may have holes, skip the tables not mapped
+    if (addrs[SIND_IDX] && fbs < NUM_DIRECT + epb && fbe > NUM_DIRECT) {
+        cofs_free_table(inode, &run, &addrs[SIND_IDX], 
+                cofs_max(fbs, NUM_DIRECT) - NUM_DIRECT,
+                cofs_min(fbe, NUM_DIRECT + epb) - NUM_DIRECT);
+    }
+    if (addrs[DIND_IDX] && fbe > NUM_DIRECT + epb) {
+        // relative to the double indirect zone
+        first = cofs_max(fbs, NUM_DIRECT + epb) - NUM_DIRECT - epb;
+        last = fbe - NUM_DIRECT - epb;
+        if (!(buf = sb_bread(sb, addrs[DIND_IDX]))) {
+            pr_err("cofs: cannot read indirect table %u\n", addrs[DIND_IDX]);
+            goto out;
+        }
+        blocks = (unsigned int *) buf->b_data;
+        for (sidx = first / epb; sidx < DIV_ROUND_UP(last, epb); sidx++) {
+            if (!blocks[sidx])
+                continue;
+            cofs_free_table(inode, &run, &blocks[sidx], 
+                    cofs_max(first, sidx * epb) - sidx * epb,
+                    cofs_min(last, (sidx + 1) * epb) - sidx * epb);
+        }
+        if (cofs_table_empty(sb, blocks)) {
+            bforget(buf);
+            cofs_free_add(sb, &run, addrs[DIND_IDX]);
+            addrs[DIND_IDX] = 0;
+        } else {
+            cofs_journal_dirty_inode(buf, inode);
+            brelse(buf);
+        }
+    }
+out:
+    cofs_free_flush(sb, &run);
+    up_write(&COFS_I(inode)->i_map_sem);
+    mark_inode_dirty(inode);
+    cofs_journal_stop(sb);
     return 0;
 }
 
 void cofs_inode_evict(struct inode *inode) 
 {
-    truncate_inode_pages_final(&inode->i_data);
-    clear_inode(inode);
     pr_debug("cofs_inode_evict called for inode: %lu\n", inode->i_ino); 
-    if (inode->i_nlink) {
-        return;
-    }
+    cofs_orphan_dequeue(inode);
+    truncate_inode_pages_final(&inode->i_data);
+    cofs_discard_reservation(inode);
+    cofs_dircache_release(inode);
     // if this node has no more links to it, delete it //
-    pr_debug("cofs_inode_evict: deleting from disk inode: %lu, size: %llu, links: %u\n",
-            inode->i_ino, inode->i_size, inode->i_nlink);
-
-    inode->i_mode = 0;
-    cofs_truncate(inode, 0);
-    //cofs_iput(inode);
+    // before clear_inode, freeing the blocks dirties the inode
+    if (!inode->i_nlink) {
+        pr_debug("cofs_inode_evict: deleting from disk inode: %lu, size: %llu, links: %u\n",
+                inode->i_ino, inode->i_size, inode->i_nlink);
+        inode->i_mode = 0;
+        inode->i_size = 0;
+        // usually done by the orphan worker, then there is nothing left
+        cofs_truncate(inode, 0, inode->i_sb->s_maxbytes);
+    }
+    invalidate_inode_buffers(inode);
+    if (!inode->i_nlink) {
+        cofs_journal_start(inode->i_sb);
+        cofs_orphan_del(inode);
+        // the VFS does not write back an inode being freed, clear it here
+        __cofs_write_inode(inode, 0);
+        cofs_inode_free(inode->i_sb, inode->i_ino);
+        cofs_journal_stop(inode->i_sb);
+    }
+    clear_inode(inode);
 }
@@ -1,15 +1,63 @@
 #ifndef _INODE_H
 #define _INODE_H
 
+/**
+ * The in memory inode - what cofs keeps about an inode, besides the
+ * Linux struct inode embedded in it.
+ */
+struct cofs_inode_info {
+    unsigned int i_addrs[NUM_ADDRS];    // addrs[] of the disk inode
+    unsigned int i_last_block;      // last block allocated to this inode
+    unsigned int i_rsv_start;       // first free block of the reservation window
+    unsigned int i_rsv_len;         // blocks left in the window
+    unsigned int i_rsv_size;        // size of the last window
+    struct rw_semaphore i_map_sem;  // protects the block map and the window
+    unsigned int i_dir_format;      // COFS_DIR_*, for directories
+    struct cofs_dircache *i_dircache;   // names of a linear directory, or NULL
+    struct mutex i_dir_lock;        // protects i_dircache
+    struct list_head i_orphan_queue;    // waiting for the orphan worker
+    int i_orphan;                   // on the on disk orphan list
+    int i_deleted;                  // blocks freed by the orphan worker
+    unsigned int i_flags;           // COFS_INODE_* of the inode tail
+    struct inode vfs_inode;
+};
+
+// directory formats, i_dir_format is unknown until block 0 was read
+#define COFS_DIR_UNKNOWN    0
+#define COFS_DIR_LINEAR     1
+#define COFS_DIR_HASHED     2
+
+static inline struct cofs_inode_info *COFS_I(struct inode *inode)
+{
+    return container_of(inode, struct cofs_inode_info, vfs_inode);
+}
+
+// is the data of the inode inline, in the inode table?
+static inline int cofs_inode_inline(struct inode *inode)
+{
+    return COFS_I(inode)->i_flags & COFS_INODE_INLINE;
+}
+
 cofs_inode_t *cofs_raw_inode(struct super_block *sb, unsigned long ino,
-        struct buffer_head *bh);
+        struct buffer_head **bh);
+char *cofs_inline_data(struct inode *inode, struct buffer_head **bh);
+void cofs_inline_zero(struct inode *inode, loff_t from);
+struct cofs_dirent *cofs_dir_block(struct inode *dir, unsigned int block,
+        struct buffer_head **bh, struct cofs_dirent **end);
 
 struct inode *cofs_iget(struct super_block *sb, unsigned long ino);
 
-void cofs_iput(struct inode *inode); 
+int cofs_write_inode(struct inode *inode, struct writeback_control *wbc);
+int cofs_update_inode(struct inode *inode);
+void cofs_dirty_inode(struct inode *inode, int flags);
+int cofs_fsync(struct file *file, loff_t start, loff_t end, int datasync);
 
-struct inode *cofs_inode_alloc(struct super_block *sb, unsigned short int type);
+struct inode *cofs_inode_alloc(struct inode *dir, unsigned short int type);
 
+int cofs_truncate(struct inode *inode, loff_t from, loff_t to);
 void cofs_inode_evict(struct inode *inode);
 
+int cofs_inodes_load(struct super_block *sb);
+void cofs_inodes_release(struct super_block *sb);
+
 #endif
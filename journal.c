@@ -0,0 +1,786 @@
+/**
+ *  The metadata journal
+ *
+ *  On a COFS_FEAT_JOURNAL file system, the buffers of metadata (bitmaps,
+ *  inode table, indirect tables, extent nodes, directories, super block) are
+ *  not marked dirty when changed: cofs_journal_dirty puts them in the running
+ *  transaction. cofs_journal_commit writes them in the journal, then a commit
+ *  block, then in their place. After a crash, the last committed transaction
+ *  is written again at mount, so either all of it is on disk or none.
+ *
+ *  Each change runs in a handle, so a commit never takes half of it. Many
+ *  changes go in a transaction, committed every COFS_JNL_INTERVAL, when it
+ *  is nearly full, or when fsync / sync ask for it: a burst of creates and
+ *  unlinks costs one journal write and one cache flush.
+ *
+ *  A transaction must fit in half of the journal, so a handle reserves room
+ *  (credits) for the buffers it may add when it starts, and waits for a
+ *  commit if there is not enough. Long changes, like truncating a large
+ *  file, ask for more as they go (cofs_journal_extend) and restart their
+ *  handle in a new transaction when there is none. The end of a transaction
+ *  is kept for joining handles, which cannot commit. Nothing is ever written
+ *  around the journal: a handle past it's credits in a full transaction
+ *  aborts the journal, and the file system stays as the last commit left it.
+ *
+ *  Blocks freed by a transaction are only given back to the bitmap when it
+ *  is committed: until then, the journal may still put back what they held,
+ *  over new data.
+ */
+#include <linux/buffer_head.h>
+#include <linux/crc32.h>
+#include <linux/sched/mm.h>
+#include <linux/slab.h>
+#include "cofs_common.h"
+#include "super.h"
+#include "block.h"
+#include "journal.h"
+
+#define COFS_JNL_INTERVAL   (5 * HZ)
+
+// credits of a started handle: a directory insert may double the hash table
+#define COFS_JNL_CREDITS(bs)    (COFS_DX_FIRST_BUCKET(bs) + COFS_JNL_MAP_CREDITS + 8)
+// kept for joining handles, which get COFS_JNL_MAP_CREDITS each, and for
+// the frees applied at commit
+#define COFS_JNL_ROOM(j)        ((j)->j_max / 4)
+// then for handles past their credits
+#define COFS_JNL_SLACK          COFS_JNL_MAP_CREDITS
+// most buffers used or reserved, when a handle starts or joins
+#define COFS_JNL_START_MAX(j)   ((j)->j_max - COFS_JNL_ROOM(j) - COFS_JNL_SLACK)
+#define COFS_JNL_JOIN_MAX(j)    ((j)->j_max - COFS_JNL_SLACK)
+
+// a buffer in the running transaction
+enum { BH_CofsJournal = BH_PrivateStart };
+BUFFER_FNS(CofsJournal, cofs_journal)
+
+struct cofs_journal {
+    struct super_block *j_sb;
+    unsigned int j_start;           // first block of the journal
+    unsigned int j_half;            // blocks in each half
+    unsigned int j_seq;             // sequence number of the running transaction
+    unsigned int j_next;            // half it goes in, not the last committed
+    spinlock_t j_lock;              // protects the fields up to j_wait
+    int j_locked;                   // COFS_JNL_*
+    int j_updates;                  // handles running
+    struct buffer_head **j_bhs;     // buffers of the running transaction
+    unsigned int j_nr;              // how many
+    unsigned int j_reserved;        // credits of the running handles, not used yet
+    struct list_head j_freed;       // blocks it freed, struct cofs_jnl_free
+    wait_queue_head_t j_wait;       // for j_locked and j_updates
+    struct mutex j_commit_lock;     // one commit at a time, protects what follows
+    unsigned int j_max;             // buffers fitting in half of the journal
+    unsigned int j_credits;         // of a started handle, less on small journals
+    struct buffer_head **j_cp;      // buffers of the committed transaction
+    unsigned int j_ncp;             // how many
+    struct buffer_head **j_log;     // journal blocks being written
+    unsigned int j_nlog;
+    struct cofs_jnl_header *j_desc; // a descriptor or commit block being made
+    struct delayed_work j_commit_work;
+    int j_aborted;                  // a transaction did not fit, nothing is written
+};
+
+// j_locked
+#define COFS_JNL_RUNNING    0
+#define COFS_JNL_LOCKING    1       // new handles wait, joining ones go on
+#define COFS_JNL_LOCKED     2       // the commit has the transaction
+
+struct cofs_jnl_free {
+    struct list_head list;
+    unsigned int block, count;
+};
+
+// current->journal_info, while in a handle
+struct cofs_handle {
+    struct cofs_journal *h_journal;
+    int h_ref;                      // nested starts
+    unsigned int h_credits;         // buffers it may still add
+    unsigned int h_nofs;            // what memalloc_nofs_save returned
+};
+
+// handles start and frees come on every block mapped or inode dirtied
+static struct kmem_cache *cofs_handle_cachep;
+static struct kmem_cache *cofs_jnl_free_cachep;
+
+int cofs_journal_init(void)
+{
+    cofs_handle_cachep = kmem_cache_create("cofs_handle",
+            sizeof(struct cofs_handle), 0, 0, NULL);
+    cofs_jnl_free_cachep = kmem_cache_create("cofs_jnl_free",
+            sizeof(struct cofs_jnl_free), 0, 0, NULL);
+    if (!cofs_handle_cachep || !cofs_jnl_free_cachep) {
+        cofs_journal_exit();
+        return -ENOMEM;
+    }
+    return 0;
+}
+
+void cofs_journal_exit(void)
+{
+    kmem_cache_destroy(cofs_handle_cachep);
+    kmem_cache_destroy(cofs_jnl_free_cachep);
+}
+
+static struct cofs_journal *cofs_journal(struct super_block *sb)
+{
+    return COFS_SB(sb)->s_journal;
+}
+
+/*
+ * Enters a handle. A new one waits while a commit has the transaction, or
+ * wants it if wait is set, and commits first if the transaction has no
+ * room for it's credits. Joining handles (!wait) are for callers that may
+ * hold a page lock, like writeback: they go on while a commit waits for
+ * the handles running, and take their credits from the room kept for them.
+ * Only when it is used up, one waits for the commit to end; started handles
+ * never wait for a page, so the commit does not wait for this one's.
+ * Inside, allocations do not recurse in file systems.
+ */
+static void __cofs_journal_start(struct super_block *sb, int wait)
+{
+    struct cofs_journal *j = cofs_journal(sb);
+    struct cofs_handle *h = current->journal_info;
+    int limit = wait ? COFS_JNL_LOCKING : COFS_JNL_LOCKED;
+    unsigned int used, seq;
+
+    if (!j)
+        return;
+    if (h) {
+        WARN_ON(h->h_journal != j);
+        h->h_ref++;
+        return;
+    }
+    h = kmem_cache_alloc(cofs_handle_cachep, GFP_NOFS | __GFP_NOFAIL);
+    spin_lock(&j->j_lock);
+    for (;;) {
+        if (j->j_locked >= limit) {
+            spin_unlock(&j->j_lock);
+            wait_event(j->j_wait, READ_ONCE(j->j_locked) < limit);
+            spin_lock(&j->j_lock);
+            continue;
+        }
+        used = j->j_nr + j->j_reserved;
+        if (j->j_aborted || (wait ? used + j->j_credits <= COFS_JNL_START_MAX(j)
+                    : used + COFS_JNL_MAP_CREDITS <= COFS_JNL_JOIN_MAX(j)))
+            break;
+        seq = j->j_seq;
+        spin_unlock(&j->j_lock);
+        if (wait) {
+            cofs_journal_commit(sb);
+        } else {
+            mod_delayed_work(system_wq, &j->j_commit_work, 0);
+            wait_event(j->j_wait, READ_ONCE(j->j_seq) != seq || READ_ONCE(j->j_aborted));
+        }
+        spin_lock(&j->j_lock);
+    }
+    h->h_credits = wait ? j->j_credits : COFS_JNL_MAP_CREDITS;
+    j->j_reserved += h->h_credits;
+    j->j_updates++;
+    spin_unlock(&j->j_lock);
+    h->h_journal = j;
+    h->h_ref = 1;
+    h->h_nofs = memalloc_nofs_save();
+    current->journal_info = h;
+}
+
+/**
+ * Starts a change; no page may be locked by the caller
+ */
+void cofs_journal_start(struct super_block *sb)
+{
+    __cofs_journal_start(sb, 1);
+}
+
+/**
+ * Starts a change from writeback or mark_inode_dirty
+ */
+void cofs_journal_join(struct super_block *sb)
+{
+    __cofs_journal_start(sb, 0);
+}
+
+void cofs_journal_stop(struct super_block *sb)
+{
+    struct cofs_journal *j = cofs_journal(sb);
+    struct cofs_handle *h = current->journal_info;
+
+    if (!j || WARN_ON(!h) || --h->h_ref)
+        return;
+    current->journal_info = NULL;
+    memalloc_nofs_restore(h->h_nofs);
+    spin_lock(&j->j_lock);
+    j->j_reserved -= h->h_credits;
+    if (!--j->j_updates && j->j_locked)
+        wake_up_all(&j->j_wait);
+    spin_unlock(&j->j_lock);
+    kmem_cache_free(cofs_handle_cachep, h);
+}
+
+/**
+ * Makes sure the handle may still add credits buffers. Returns -EAGAIN if
+ * the transaction has no room left: the caller ends what it is doing in a
+ * consistent state, drops it's locks and calls cofs_journal_restart.
+ * A nested handle cannot restart, it goes on with the room of the journal.
+ */
+int cofs_journal_extend(struct super_block *sb, unsigned int credits)
+{
+    struct cofs_journal *j = cofs_journal(sb);
+    struct cofs_handle *h = current->journal_info;
+    int err = 0;
+
+    if (!j || WARN_ON(!h) || h->h_credits >= credits || h->h_ref > 1)
+        return 0;
+    spin_lock(&j->j_lock);
+    if (j->j_locked == COFS_JNL_RUNNING && j->j_nr + j->j_reserved + credits
+            - h->h_credits <= COFS_JNL_START_MAX(j)) {
+        j->j_reserved += credits - h->h_credits;
+        h->h_credits = credits;
+    } else {
+        err = -EAGAIN;
+    }
+    spin_unlock(&j->j_lock);
+    return err;
+}
+
+/**
+ * Ends the handle and starts another, in a new transaction if the running
+ * one is full. What was done so far may be committed alone.
+ */
+void cofs_journal_restart(struct super_block *sb)
+{
+    cofs_journal_stop(sb);
+    cofs_journal_start(sb);
+}
+
+/*
+ * A transaction does not fit in the journal. Like jbd2, the journal stops
+ * there: nothing more is committed or written in place, and the file
+ * system goes read only, as the last commit left it on disk.
+ */
+static void cofs_journal_abort(struct cofs_journal *j)
+{
+    spin_lock(&j->j_lock);
+    if (j->j_aborted) {
+        spin_unlock(&j->j_lock);
+        return;
+    }
+    j->j_aborted = 1;
+    wake_up_all(&j->j_wait);
+    spin_unlock(&j->j_lock);
+    WARN(1, "cofs: transaction %u too large, journal aborted\n", j->j_seq);
+    j->j_sb->s_flags |= SB_RDONLY;
+}
+
+static void cofs_journal_add(struct cofs_journal *j, struct buffer_head *bh)
+{
+    struct cofs_handle *h = current->journal_info;
+
+    spin_lock(&j->j_lock);
+    if (buffer_cofs_journal(bh) || j->j_aborted) {
+        spin_unlock(&j->j_lock);
+        return;
+    }
+    // a handle out of credits takes the slack nobody reserved
+    if (h && h->h_credits) {
+        h->h_credits--;
+        j->j_reserved--;
+    } else if (j->j_nr + j->j_reserved >= j->j_max) {
+        spin_unlock(&j->j_lock);
+        cofs_journal_abort(j);
+        return;
+    }
+    set_buffer_cofs_journal(bh);
+    get_bh(bh);
+    j->j_bhs[j->j_nr++] = bh;
+    // joining handles do not commit, start it now if new ones would wait
+    if (j->j_nr + j->j_reserved > COFS_JNL_START_MAX(j))
+        mod_delayed_work(system_wq, &j->j_commit_work, 0);
+    else if (j->j_nr == 1)
+        schedule_delayed_work(&j->j_commit_work, COFS_JNL_INTERVAL);
+    spin_unlock(&j->j_lock);
+}
+
+/**
+ * bh, a metadata block, was changed. With a journal it joins the running
+ * transaction; it is not made dirty, nothing may write it before the
+ * transaction is committed.
+ */
+void cofs_journal_dirty(struct super_block *sb, struct buffer_head *bh)
+{
+    struct cofs_journal *j = cofs_journal(sb);
+
+    if (!j) {
+        mark_buffer_dirty(bh);
+        return;
+    }
+    WARN_ON_ONCE(!current->journal_info && READ_ONCE(j->j_locked) != COFS_JNL_LOCKED);
+    cofs_journal_add(j, bh);
+}
+
+/**
+ * Same, for a block of inode; without a journal, fsync finds it on the
+ * inode's mapping (mark_buffer_dirty_inode).
+ */
+void cofs_journal_dirty_inode(struct buffer_head *bh, struct inode *inode)
+{
+    if (!cofs_journal(inode->i_sb)) {
+        mark_buffer_dirty_inode(bh, inode);
+        return;
+    }
+    cofs_journal_dirty(inode->i_sb, bh);
+}
+
+/**
+ * Keeps count blocks from block on aside, until the running transaction is
+ * committed. Returns 0 without a journal: the caller frees them now.
+ */
+int cofs_journal_free(struct super_block *sb, unsigned int block, unsigned int count)
+{
+    struct cofs_journal *j = cofs_journal(sb);
+    struct cofs_jnl_free *f, *last;
+
+    if (!j)
+        return 0;
+    spin_lock(&j->j_lock);
+    // a file is mostly freed in runs following each other, either way
+    if (!list_empty(&j->j_freed)) {
+        last = list_last_entry(&j->j_freed, struct cofs_jnl_free, list);
+        if (last->block + last->count == block || block + count == last->block) {
+            last->block = cofs_min(last->block, block);
+            last->count += count;
+            spin_unlock(&j->j_lock);
+            return 1;
+        }
+    }
+    spin_unlock(&j->j_lock);
+    f = kmem_cache_alloc(cofs_jnl_free_cachep, GFP_NOFS | __GFP_NOFAIL);
+    f->block = block;
+    f->count = count;
+    spin_lock(&j->j_lock);
+    list_add_tail(&f->list, &j->j_freed);
+    spin_unlock(&j->j_lock);
+    schedule_delayed_work(&j->j_commit_work, COFS_JNL_INTERVAL);
+    return 1;
+}
+
+/*
+ * Starts writing a copy of data to block of the journal
+ */
+static int cofs_journal_log(struct cofs_journal *j, unsigned int block,
+        const void *data, int op_flags)
+{
+    struct buffer_head *bh = sb_getblk(j->j_sb, block);
+
+    if (!bh)
+        return -ENOMEM;
+    lock_buffer(bh);
+    memcpy(bh->b_data, data, j->j_sb->s_blocksize);
+    set_buffer_uptodate(bh);
+    unlock_buffer(bh);
+    mark_buffer_dirty(bh);
+    write_dirty_buffer(bh, REQ_SYNC | op_flags);
+    j->j_log[j->j_nlog++] = bh;
+    return 0;
+}
+
+static int cofs_journal_log_wait(struct cofs_journal *j)
+{
+    unsigned int i;
+    int err = 0;
+
+    for (i = 0; i < j->j_nlog; i++) {
+        wait_on_buffer(j->j_log[i]);
+        if (!buffer_uptodate(j->j_log[i]))
+            err = -EIO;
+        brelse(j->j_log[i]);
+    }
+    j->j_nlog = 0;
+    return err;
+}
+
+static void cofs_journal_header(struct cofs_journal *j, unsigned int type,
+        unsigned int count)
+{
+    memset(j->j_desc, 0, j->j_sb->s_blocksize);
+    j->j_desc->jh_magic = COFS_JNL_MAGIC;
+    j->j_desc->jh_type = type;
+    j->j_desc->jh_seq = j->j_seq;
+    j->j_desc->jh_count = count;
+}
+
+/*
+ * Gives the blocks in freed back to the bitmap, as long as the bitmap
+ * blocks they are in fit in the transaction. What does not fit goes back
+ * to j_freed, for the next one.
+ */
+static void cofs_journal_free_apply(struct cofs_journal *j, struct list_head *freed)
+{
+    struct super_block *sb = j->j_sb;
+    unsigned int n, bpb = BITS_PER_BLOCK(sb->s_blocksize);
+    struct cofs_jnl_free *f, *tmp;
+
+    list_for_each_entry_safe(f, tmp, freed, list) {
+        while (f->count) {
+            // j_nr does not change, nobody else is in the transaction
+            if (j->j_nr == j->j_max && !buffer_cofs_journal(
+                        COFS_SB(sb)->s_bmap[cofs_block_group(sb, f->block)]))
+                goto out;
+            n = cofs_min(f->count, bpb - f->block % bpb);
+            __cofs_blocks_free(sb, f->block, n);
+            f->block += n;
+            f->count -= n;
+        }
+        list_del(&f->list);
+        kmem_cache_free(cofs_jnl_free_cachep, f);
+    }
+out:
+    if (list_empty(freed))
+        return;
+    spin_lock(&j->j_lock);
+    list_splice(freed, &j->j_freed);
+    spin_unlock(&j->j_lock);
+    mod_delayed_work(system_wq, &j->j_commit_work, 0);
+}
+
+/*
+ * Writes the transaction in it's half of the journal, with nobody changing
+ * metadata. The blocks it freed go back to the bitmap first, so the bitmap
+ * is in it; buffers of blocks freed meanwhile are stale and left out.
+ * The transaction moves to j_cp, for cofs_journal_checkpoint.
+ */
+static int cofs_journal_write(struct cofs_journal *j)
+{
+    struct super_block *sb = j->j_sb;
+    unsigned int start = j->j_start + j->j_next * j->j_half;
+    unsigned int i, k, n, nr = 0, pos = 0, *tags;
+    struct buffer_head **bhs;
+    LIST_HEAD(freed);
+    u32 crc = ~0U;
+    int err = 0;
+
+    spin_lock(&j->j_lock);
+    list_splice_init(&j->j_freed, &freed);
+    spin_unlock(&j->j_lock);
+    cofs_journal_free_apply(j, &freed);
+    spin_lock(&j->j_lock);
+    bhs = j->j_cp;
+    j->j_cp = j->j_bhs;
+    j->j_ncp = j->j_nr;
+    j->j_bhs = bhs;
+    j->j_nr = 0;
+    spin_unlock(&j->j_lock);
+
+    bhs = j->j_cp;
+    for (i = 0; i < j->j_ncp; i++) {
+        clear_buffer_cofs_journal(bhs[i]);
+        if (cofs_block_used(sb, bhs[i]->b_blocknr))
+            bhs[nr++] = bhs[i];
+        else
+            brelse(bhs[i]);
+    }
+    j->j_ncp = nr;
+    if (!nr)
+        return 0;
+
+    for (i = 0; i < nr; i += n) {
+        n = cofs_min(nr - i, NUM_JTAGS(sb->s_blocksize));
+        cofs_journal_header(j, COFS_JNL_DESC, n);
+        tags = (unsigned int *) (j->j_desc + 1);
+        for (k = 0; k < n; k++)
+            tags[k] = bhs[i + k]->b_blocknr;
+        crc = crc32_le(crc, (void *) j->j_desc, sb->s_blocksize);
+        if ((err = cofs_journal_log(j, start + pos++, j->j_desc, 0)))
+            goto out;
+        for (k = 0; k < n; k++) {
+            crc = crc32_le(crc, bhs[i + k]->b_data, sb->s_blocksize);
+            if ((err = cofs_journal_log(j, start + pos++, bhs[i + k]->b_data, 0)))
+                goto out;
+        }
+    }
+    // the commit block must not reach the disk before the rest
+    if ((err = cofs_journal_log_wait(j)))
+        goto out;
+    cofs_journal_header(j, COFS_JNL_COMMIT, nr);
+    j->j_desc->jh_crc = crc;
+    if ((err = cofs_journal_log(j, start + pos, j->j_desc, REQ_PREFLUSH | REQ_FUA)))
+        goto out;
+    if (!(err = cofs_journal_log_wait(j)))
+        j->j_next ^= 1;
+out:
+    if (err) {
+        cofs_journal_log_wait(j);
+        pr_err("cofs: cannot commit transaction %u: %d\n", j->j_seq, err);
+        // written in place, like without a journal
+        for (i = 0; i < nr; i++) {
+            mark_buffer_dirty(bhs[i]);
+            brelse(bhs[i]);
+        }
+        j->j_ncp = 0;
+    }
+    return err;
+}
+
+/*
+ * The transaction is committed, it's buffers can go in their place. This
+ * runs along with the next transaction, which may change them again; then
+ * they are in it too, and what is written here does not matter. They must
+ * be on disk before the next commit, which writes over the other half.
+ * With nothing to write, the cache is flushed, for the data of fsync.
+ */
+static int cofs_journal_checkpoint(struct cofs_journal *j)
+{
+    unsigned int i;
+    int err = 0;
+
+    if (!j->j_ncp)
+        return blkdev_issue_flush(j->j_sb->s_bdev, GFP_KERNEL);
+    for (i = 0; i < j->j_ncp; i++) {
+        mark_buffer_dirty(j->j_cp[i]);
+        write_dirty_buffer(j->j_cp[i], REQ_SYNC);
+    }
+    for (i = 0; i < j->j_ncp; i++) {
+        wait_on_buffer(j->j_cp[i]);
+        if (!buffer_uptodate(j->j_cp[i]))
+            err = -EIO;
+        brelse(j->j_cp[i]);
+    }
+    j->j_ncp = 0;
+    return err;
+}
+
+/**
+ * Commits the running transaction, unless the one running at the call was
+ * committed by someone else while we waited, and a later one too: then
+ * what we want is on disk already. Concurrent fsyncs so share a commit.
+ * Everything written before the call is on disk when it returns.
+ * Must not be called from a handle, that one would never end.
+ */
+int cofs_journal_commit(struct super_block *sb)
+{
+    struct cofs_journal *j = cofs_journal(sb);
+    unsigned int seq;
+    int err;
+
+    if (!j || current->journal_info)
+        return 0;
+    seq = READ_ONCE(j->j_seq);
+    mutex_lock(&j->j_commit_lock);
+    if (j->j_seq - seq >= 2 || READ_ONCE(j->j_aborted)) {
+        mutex_unlock(&j->j_commit_lock);
+        return READ_ONCE(j->j_aborted) ? -EROFS : 0;
+    }
+    spin_lock(&j->j_lock);
+    j->j_locked = COFS_JNL_LOCKING;
+    while (j->j_updates) {
+        spin_unlock(&j->j_lock);
+        wait_event(j->j_wait, !READ_ONCE(j->j_updates));
+        spin_lock(&j->j_lock);
+    }
+    j->j_locked = COFS_JNL_LOCKED;
+    spin_unlock(&j->j_lock);
+
+    err = cofs_journal_write(j);
+
+    spin_lock(&j->j_lock);
+    j->j_seq++;
+    j->j_locked = COFS_JNL_RUNNING;
+    wake_up_all(&j->j_wait);
+    spin_unlock(&j->j_lock);
+
+    if (!err)
+        err = cofs_journal_checkpoint(j);
+    mutex_unlock(&j->j_commit_lock);
+    return err;
+}
+
+static void cofs_journal_work(struct work_struct *work)
+{
+    struct cofs_journal *j = container_of(to_delayed_work(work),
+            struct cofs_journal, j_commit_work);
+
+    cofs_journal_commit(j->j_sb);
+}
+
+/*
+ * Looks at the transaction in the half of the journal at start. Sets *seq
+ * to it's sequence number, if it has a descriptor, and returns 1 if it was
+ * committed. With apply, it's blocks are copied in their place.
+ */
+static int cofs_journal_scan(struct super_block *sb, unsigned int start,
+        unsigned int half, unsigned int *seq, int apply)
+{
+    struct buffer_head *bh, *dbh, *hbh;
+    struct cofs_jnl_header *jh;
+    unsigned int pos = 0, total = 0, n, k, *tags;
+    u32 crc = ~0U;
+    int ret = 0;
+
+    for (;;) {
+        if (pos >= half)
+            return 0;
+        if (!(bh = sb_bread(sb, start + pos)))
+            return -EIO;
+        jh = (struct cofs_jnl_header *) bh->b_data;
+        if (jh->jh_magic != COFS_JNL_MAGIC || (pos && jh->jh_seq != *seq))
+            break;
+        *seq = jh->jh_seq;
+        if (jh->jh_type == COFS_JNL_COMMIT) {
+            ret = jh->jh_crc == crc && jh->jh_count == total;
+            break;
+        }
+        n = jh->jh_count;
+        if (jh->jh_type != COFS_JNL_DESC || n > NUM_JTAGS(sb->s_blocksize)
+                || pos + n + 1 >= half)
+            break;
+        crc = crc32_le(crc, bh->b_data, sb->s_blocksize);
+        tags = (unsigned int *) (jh + 1);
+        for (k = 0; k < n; k++) {
+            if (!(dbh = sb_bread(sb, start + pos + 1 + k))) {
+                brelse(bh);
+                return -EIO;
+            }
+            crc = crc32_le(crc, dbh->b_data, sb->s_blocksize);
+            if (apply && tags[k] < COFS_SB(sb)->s_sb->size
+                    && (hbh = sb_getblk(sb, tags[k]))) {
+                lock_buffer(hbh);
+                memcpy(hbh->b_data, dbh->b_data, sb->s_blocksize);
+                set_buffer_uptodate(hbh);
+                unlock_buffer(hbh);
+                mark_buffer_dirty(hbh);
+                brelse(hbh);
+            }
+            brelse(dbh);
+        }
+        total += n;
+        pos += n + 1;
+        brelse(bh);
+    }
+    brelse(bh);
+    return ret;
+}
+
+/*
+ * Writes again the last committed transaction, it may not have reached
+ * it's place. Sets *next to the sequence number to continue with, and
+ * *half to the half the next transaction goes in.
+ */
+static int cofs_journal_replay(struct super_block *sb, unsigned int *next,
+        unsigned int *half_next)
+{
+    cofs_superblock_t *cofs_sb = COFS_SB(sb)->s_sb;
+    unsigned int half = cofs_sb->journal_blocks / 2, seq[2] = { 0, 0 }, h;
+    struct buffer_head *bh;
+    int ok[2], err;
+
+    for (h = 0; h < 2; h++) {
+        ok[h] = cofs_journal_scan(sb, cofs_sb->journal_start + h * half, half, &seq[h], 0);
+        if (ok[h] < 0)
+            return ok[h];
+    }
+    *next = ((int) (seq[1] - seq[0]) > 0 ? seq[1] : seq[0]) + 1;
+    h = ok[1] && (!ok[0] || (int) (seq[1] - seq[0]) > 0);
+    *half_next = h ^ 1;
+    if (!ok[h])
+        return 0;
+    pr_info("cofs: replaying journal transaction %u\n", seq[h]);
+    err = cofs_journal_scan(sb, cofs_sb->journal_start + h * half, half, &seq[h], 1);
+    if (err < 0 || (err = sync_blockdev(sb->s_bdev))
+            || (err = blkdev_issue_flush(sb->s_bdev, GFP_KERNEL)))
+        return err;
+    // the super block may have been in it
+    if (!(bh = sb_bread(sb, COFS_SB_BLOCK)))
+        return -EIO;
+    memcpy(cofs_sb, bh->b_data, sizeof(*cofs_sb));
+    brelse(bh);
+    return 0;
+}
+
+/**
+ * Replays the journal, if the file system has one, and starts using it.
+ * Called at mount, before anything else reads metadata.
+ */
+int cofs_journal_load(struct super_block *sb)
+{
+    struct cofs_sb_info *sbi = COFS_SB(sb);
+    cofs_superblock_t *cofs_sb = sbi->s_sb;
+    struct cofs_journal *j;
+    unsigned int half, seq, next, ntags = NUM_JTAGS(sb->s_blocksize);
+    int err;
+
+    if (!COFS_HAS_FEATURE(cofs_sb, COFS_FEAT_JOURNAL))
+        return 0;
+    half = cofs_sb->journal_blocks / 2;
+    if (half < 3 || cofs_sb->journal_start < 2
+            || cofs_sb->journal_start + cofs_sb->journal_blocks > cofs_sb->size) {
+        pr_err("cofs: invalid journal, %u blocks at %u\n",
+                cofs_sb->journal_blocks, cofs_sb->journal_start);
+        return -EINVAL;
+    }
+    if ((err = cofs_journal_replay(sb, &seq, &next)))
+        return err;
+
+    if (!(j = kzalloc(sizeof(*j), GFP_KERNEL)))
+        return -ENOMEM;
+    j->j_sb = sb;
+    j->j_start = cofs_sb->journal_start;
+    j->j_half = half;
+    j->j_seq = seq;
+    j->j_next = next;
+    // descriptors and a commit block take room too
+    j->j_max = (half - 2) * ntags / (ntags + 1);
+    if (j->j_max < 4 * COFS_JNL_MAP_CREDITS) {
+        pr_err("cofs: journal of %u blocks is too small\n", cofs_sb->journal_blocks);
+        kfree(j);
+        return -EINVAL;
+    }
+    j->j_credits = cofs_min(COFS_JNL_CREDITS(sb->s_blocksize), COFS_JNL_START_MAX(j));
+    spin_lock_init(&j->j_lock);
+    INIT_LIST_HEAD(&j->j_freed);
+    init_waitqueue_head(&j->j_wait);
+    mutex_init(&j->j_commit_lock);
+    INIT_DELAYED_WORK(&j->j_commit_work, cofs_journal_work);
+    j->j_bhs = kcalloc(j->j_max, sizeof(*j->j_bhs), GFP_KERNEL);
+    j->j_cp = kcalloc(j->j_max, sizeof(*j->j_cp), GFP_KERNEL);
+    j->j_log = kcalloc(half, sizeof(*j->j_log), GFP_KERNEL);
+    j->j_desc = kmalloc(sb->s_blocksize, GFP_KERNEL);
+    sbi->s_journal = j;
+    if (!j->j_bhs || !j->j_cp || !j->j_log || !j->j_desc) {
+        cofs_journal_release(sb);
+        return -ENOMEM;
+    }
+    pr_debug("cofs: journal of %u blocks at %u, transaction %u\n",
+            cofs_sb->journal_blocks, j->j_start, j->j_seq);
+    return 0;
+}
+
+/**
+ * Commits what is left and stops using the journal
+ */
+void cofs_journal_release(struct super_block *sb)
+{
+    struct cofs_journal *j = cofs_journal(sb);
+    struct cofs_jnl_free *f, *tmp;
+
+    if (!j)
+        return;
+    cancel_delayed_work_sync(&j->j_commit_work);
+    // frees that did not fit in a transaction take more of them
+    if (j->j_bhs && j->j_cp && j->j_log && j->j_desc) {
+        do {
+            cofs_journal_commit(sb);
+        } while (!list_empty(&j->j_freed) && !j->j_aborted);
+    }
+    // the commit may have scheduled another one
+    cancel_delayed_work_sync(&j->j_commit_work);
+    // an aborted transaction is dropped
+    while (j->j_nr) {
+        clear_buffer_cofs_journal(j->j_bhs[--j->j_nr]);
+        brelse(j->j_bhs[j->j_nr]);
+    }
+    list_for_each_entry_safe(f, tmp, &j->j_freed, list)
+        kmem_cache_free(cofs_jnl_free_cachep, f);
+    COFS_SB(sb)->s_journal = NULL;
+    kfree(j->j_bhs);
+    kfree(j->j_cp);
+    kfree(j->j_log);
+    kfree(j->j_desc);
+    kfree(j);
+}
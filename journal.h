@@ -0,0 +1,30 @@
+#ifndef _JOURNAL_H
+#define _JOURNAL_H
+
+/**
+ * The metadata journal, on COFS_FEAT_JOURNAL file systems. Changes to
+ * metadata run in a handle (cofs_journal_start / cofs_journal_stop) and
+ * their buffers are dirtied with cofs_journal_dirty*, which puts them in the
+ * running transaction. Without a journal, handles do nothing and
+ * cofs_journal_dirty* are mark_buffer_dirty*.
+ */
+
+// buffers mapping a run of blocks may change: bitmaps, tables or an extent
+// path split up to the root, the inode
+#define COFS_JNL_MAP_CREDITS    16
+
+int cofs_journal_init(void);
+void cofs_journal_exit(void);
+int cofs_journal_load(struct super_block *sb);
+void cofs_journal_release(struct super_block *sb);
+void cofs_journal_start(struct super_block *sb);
+void cofs_journal_join(struct super_block *sb);
+void cofs_journal_stop(struct super_block *sb);
+int cofs_journal_extend(struct super_block *sb, unsigned int credits);
+void cofs_journal_restart(struct super_block *sb);
+void cofs_journal_dirty(struct super_block *sb, struct buffer_head *bh);
+void cofs_journal_dirty_inode(struct buffer_head *bh, struct inode *inode);
+int cofs_journal_free(struct super_block *sb, unsigned int block, unsigned int count);
+int cofs_journal_commit(struct super_block *sb);
+
+#endif
@@ -2,6 +2,7 @@
  * Creates the file system
  * Inspired from Unix V6 and xv6 reimplementation
  */
+#define _POSIX_C_SOURCE 200809L
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -25,16 +26,19 @@
 
 int fd;
 struct cofs_superblock sb;
+uint32_t block_size = COFS_BLOCK_SIZE;
+uint32_t inode_size = sizeof(cofs_inode_t);
 uint32_t free_block = 0;
+uint32_t free_inode = 1;
 
 void write_block(uint32_t block, void *buf)
 {
     block += PARTITION_OFFSET;
-    if (lseek(fd, block * COFS_BLOCK_SIZE, 0) < 0) {
+    if (lseek(fd, (off_t) block * block_size, 0) < 0) {
         perror("lseek");
         exit(1);
     }
-    if (write(fd, buf, COFS_BLOCK_SIZE) != COFS_BLOCK_SIZE) {
+    if (write(fd, buf, block_size) != (ssize_t) block_size) {
         perror("write");
         exit(1);
     }
@@ -43,11 +47,11 @@ void write_block(uint32_t block, void *buf)
 void read_block(uint32_t block, void *buf)
 {
     block += PARTITION_OFFSET;
-	if (lseek(fd, block * COFS_BLOCK_SIZE, 0) < 0) {
+	if (lseek(fd, (off_t) block * block_size, 0) < 0) {
 		perror("lseek");
 		exit(1);
 	}
-	if (read(fd, buf, COFS_BLOCK_SIZE) != COFS_BLOCK_SIZE) {
+	if (read(fd, buf, block_size) != (ssize_t) block_size) {
 		perror("read");
 		exit(1);
 	}
@@ -55,26 +59,25 @@ void read_block(uint32_t block, void *buf)
 
 void write_inode(uint32_t inum, cofs_inode_t *dino)
 {
-	uint8_t buf[COFS_BLOCK_SIZE];
-	uint32_t block = INO_BLOCK(inum, sb); // block which contains this inum
+	uint8_t buf[COFS_MAX_BLOCK_SIZE];
+	uint32_t block = INO_BLOCK(inum, &sb); // block which contains this inum
 	read_block(block, buf);
-	cofs_inode_t *inode = ((cofs_inode_t*)buf) + (inum % NUM_INOPB);
+	cofs_inode_t *inode = (cofs_inode_t *) (buf + inum % NUM_INOPB(block_size, inode_size) * inode_size);
 	*inode = *dino; //
 	write_block(block, buf);
 }
 
 void read_inode(unsigned int inum, cofs_inode_t *dino)
 {
-	char buf[COFS_BLOCK_SIZE];
-	uint32_t block = INO_BLOCK(inum, sb);
+	char buf[COFS_MAX_BLOCK_SIZE];
+	uint32_t block = INO_BLOCK(inum, &sb);
 	read_block(block, buf);
-	cofs_inode_t *inode = ((cofs_inode_t *)buf) + (inum % NUM_INOPB);
+	cofs_inode_t *inode = (cofs_inode_t *) (buf + inum % NUM_INOPB(block_size, inode_size) * inode_size);
 	*dino = *inode;
 }
 
 uint32_t inode_alloc(uint16_t type)
 {
-    static uint32_t free_inode = 1;
 	uint32_t inum = free_inode++;
 	struct cofs_inode dino;
 	memset(&dino, 0, sizeof(dino));
@@ -86,87 +89,258 @@ uint32_t inode_alloc(uint16_t type)
 	return inum;
 }
 
-// mark bitmap as used up to block //
-void block_alloc(uint32_t used)
+// mark the bitmap starting at block start as used up to bit used //
+void bitmap_fill(uint32_t start, uint32_t used)
 {
-	char buf[COFS_BLOCK_SIZE];
+	char buf[COFS_MAX_BLOCK_SIZE];
 	uint32_t i;
 	uint32_t bitmap_block;
-	for (bitmap_block = 0; bitmap_block < (used / BITS_PER_BLOCK); bitmap_block++) {
-	    printf("Writing bitmap block %u\n", bitmap_block);
+	for (bitmap_block = 0; bitmap_block < (used / BITS_PER_BLOCK(block_size)); bitmap_block++) {
+	    printf("Writing bitmap block %u\n", start + bitmap_block);
 	    memset(&buf, 0xFF, sizeof(buf));
-	    write_block(sb.bitmap_start + bitmap_block, buf);
+	    write_block(start + bitmap_block, buf);
 	}
-	used = used % BITS_PER_BLOCK;
-	memset(&buf, 0, COFS_BLOCK_SIZE);
+	used = used % BITS_PER_BLOCK(block_size);
+	memset(&buf, 0, sizeof(buf));
 	for(i = 0; i < used; i++) {
 		buf[i / 8] = buf[i / 8] | (0x1 << ( i % 8));
 	}
-	write_block(sb.bitmap_start + bitmap_block, buf);
+	write_block(start + bitmap_block, buf);
+}
+
+// mark bitmap as used up to block //
+void block_alloc(uint32_t used)
+{
+	bitmap_fill(sb.bitmap_start, used);
+}
+
+// mark inode bitmap as used up to inode, 0 included //
+void inode_bitmap_alloc(uint32_t used)
+{
+	bitmap_fill(sb.imap_start, used);
 }
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
 
+// returns the disk block of file_block_number in a direct/indirect inode //
+uint32_t indirect_map(struct cofs_inode *dino, uint32_t file_block_number)
+{
+	uint32_t sind_buf[COFS_MAX_BLOCK_SIZE/sizeof(uint32_t)]; // single indirect buffer
+	uint32_t dind_buf[COFS_MAX_BLOCK_SIZE/sizeof(uint32_t)]; // double indirect buffer
+
+	if(file_block_number >= MAX_FILE_SIZE(block_size)) {
+		printf("File too large > %lu blocks\n", MAX_FILE_SIZE(block_size));
+		exit(1);
+	}
+	// direct //
+	if (file_block_number < NUM_DIRECT) {
+		if(dino->addrs[file_block_number] == 0) {
+			dino->addrs[file_block_number] = free_block++;
+		}
+		return dino->addrs[file_block_number];
+	}
+	// single indirect //
+	if(file_block_number < NUM_DIRECT + NUM_SIND(block_size)){
+		if(dino->addrs[SIND_IDX] == 0) { // alloc a block for single indirect
+			dino->addrs[SIND_IDX] = free_block++;
+		}
+		read_block(dino->addrs[SIND_IDX], sind_buf);
+		if(sind_buf[file_block_number - NUM_DIRECT] == 0) {
+			sind_buf[file_block_number - NUM_DIRECT] = free_block++;
+			write_block(dino->addrs[SIND_IDX], sind_buf);
+		}
+		return sind_buf[file_block_number - NUM_DIRECT];
+	}
+	// double indirect //
+	if(dino->addrs[DIND_IDX] == 0) { // alloc a block for double indirect
+		dino->addrs[DIND_IDX] = free_block++;
+	}
+	uint32_t rel_b = file_block_number - NUM_DIRECT - NUM_SIND(block_size);
+	uint32_t midx = rel_b / NUM_SIND(block_size);
+	uint32_t sidx = rel_b % NUM_SIND(block_size);
+	read_block(dino->addrs[DIND_IDX], sind_buf);
+	if(sind_buf[midx] == 0) { // alloc 1'st level block
+		sind_buf[midx] = free_block++;
+		write_block(dino->addrs[DIND_IDX], sind_buf);
+	}
+	read_block(sind_buf[midx], dind_buf);
+	if(dind_buf[sidx] == 0) { // alloc 2'nd level block
+		dind_buf[sidx] = free_block++;
+		write_block(sind_buf[midx], dind_buf);
+	}
+	return dind_buf[sidx];
+}
+
+#define EXT_MAX_DEPTH 5
+
+// a new, empty extent tree node, depth levels above the leaves //
+uint32_t ext_new_node(uint32_t *buf, uint16_t depth)
+{
+	struct cofs_extent_header *eh = (struct cofs_extent_header *) buf;
+	memset(buf, 0, block_size);
+	eh->eh_magic = COFS_EXT_MAGIC;
+	eh->eh_max = depth ? NUM_IDXPB(block_size) : NUM_EXTPB(block_size);
+	eh->eh_depth = depth;
+	return free_block++;
+}
+
+// the disk block of an already mapped file_block_number, 0 if not mapped //
+uint32_t ext_lookup(struct cofs_inode *dino, uint32_t file_block_number)
+{
+	uint32_t buf[COFS_MAX_BLOCK_SIZE/sizeof(uint32_t)];
+	struct cofs_extent_header *eh = COFS_EXT_ROOT(dino);
+	struct cofs_extent_idx *ix;
+	struct cofs_extent *ex;
+	int i;
+
+	if (eh->eh_magic != COFS_EXT_MAGIC)
+		return 0;
+	while (eh->eh_depth) {
+		ix = EXT_FIRST_INDEX(eh);
+		for (i = 1; i < eh->eh_entries && ix[i].ei_lblock <= file_block_number; i++)
+			;
+		read_block(ix[i - 1].ei_block, buf);
+		eh = (struct cofs_extent_header *) buf;
+	}
+	ex = EXT_FIRST_EXTENT(eh);
+	for (i = 0; i < eh->eh_entries; i++) {
+		if (file_block_number >= ex[i].e_lblock
+				&& file_block_number < ex[i].e_lblock + ex[i].e_len)
+			return ex[i].e_pblock + file_block_number - ex[i].e_lblock;
+	}
+	return 0;
+}
+
+/*
+ * Returns the disk block of file_block_number in an extents inode.
+ * Blocks are only added at the end of files here, so a new block always goes
+ * at the end of the rightmost leaf; the kernel (extent.c) knows how to do
+ * the rest. Blocks already mapped are looked up.
+ */
+uint32_t ext_map(struct cofs_inode *dino, uint32_t file_block_number)
+{
+	uint32_t bufs[EXT_MAX_DEPTH + 1][COFS_MAX_BLOCK_SIZE/sizeof(uint32_t)];
+	uint32_t blocks[EXT_MAX_DEPTH + 1]; // where each level lives, 0 for root
+	struct cofs_extent_header *nodes[EXT_MAX_DEPTH + 1], *root, *eh;
+	struct cofs_extent *ex;
+	struct cofs_extent_idx *ix;
+	uint32_t entry_size, block_no, child;
+	int depth, level, l;
+
+	if ((block_no = ext_lookup(dino, file_block_number)))
+		return block_no;
+	root = COFS_EXT_ROOT(dino);
+	if (root->eh_magic != COFS_EXT_MAGIC) {
+		memset(dino->addrs, 0, sizeof(dino->addrs));
+		root->eh_magic = COFS_EXT_MAGIC;
+		root->eh_max = NUM_IEXT;
+	}
+again:
+	depth = root->eh_depth;
+	nodes[0] = root;
+	blocks[0] = 0;
+	for (level = 0; level < depth; level++) {
+		ix = EXT_FIRST_INDEX(nodes[level]) + nodes[level]->eh_entries - 1;
+		blocks[level + 1] = ix->ei_block;
+		read_block(ix->ei_block, bufs[level + 1]);
+		nodes[level + 1] = (struct cofs_extent_header *) bufs[level + 1];
+	}
+	eh = nodes[depth];
+	ex = EXT_FIRST_EXTENT(eh) + eh->eh_entries - 1;
+	if (eh->eh_entries) {
+		if (file_block_number < ex->e_lblock + ex->e_len) {
+			return ex->e_pblock + file_block_number - ex->e_lblock;
+		}
+		if (file_block_number == ex->e_lblock + ex->e_len
+				&& free_block == ex->e_pblock + ex->e_len) {
+			ex->e_len++;
+			if (depth)
+				write_block(blocks[depth], eh);
+			return free_block++;
+		}
+	}
+	if (eh->eh_entries < eh->eh_max) {
+		ex++;
+		ex->e_lblock = file_block_number;
+		ex->e_len = 1;
+		ex->e_pblock = free_block;
+		eh->eh_entries++;
+		if (depth)
+			write_block(blocks[depth], eh);
+		return free_block++;
+	}
+	// full leaf - find the lowest node with room for one more child //
+	for (level = depth - 1; level >= 0; level--) {
+		if (nodes[level]->eh_entries < nodes[level]->eh_max)
+			break;
+	}
+	if (level < 0) {
+		// all full up to the root - move the root into a block //
+		if (depth == EXT_MAX_DEPTH) {
+			printf("Extent tree too deep\n");
+			exit(1);
+		}
+		block_no = ext_new_node(bufs[0], depth);
+		eh = (struct cofs_extent_header *) bufs[0];
+		entry_size = depth ? sizeof(*ix) : sizeof(*ex);
+		memcpy(eh + 1, root + 1, root->eh_entries * entry_size);
+		eh->eh_entries = root->eh_entries;
+		write_block(block_no, bufs[0]);
+		memset(root + 1, 0, NUM_ROOT_BYTES);
+		root->eh_entries = 1;
+		root->eh_max = NUM_IIDX;
+		root->eh_depth++;
+		EXT_FIRST_INDEX(root)->ei_lblock = 0;
+		EXT_FIRST_INDEX(root)->ei_block = block_no;
+		goto again;
+	}
+	// a new branch, from the leaf up to that node //
+	child = ext_new_node(bufs[depth], 0);
+	ex = EXT_FIRST_EXTENT((struct cofs_extent_header *) bufs[depth]);
+	ex->e_lblock = file_block_number;
+	ex->e_len = 1;
+	ex->e_pblock = free_block++;
+	((struct cofs_extent_header *) bufs[depth])->eh_entries = 1;
+	write_block(child, bufs[depth]);
+	block_no = ex->e_pblock;
+	for (l = depth - 1; l > level; l--) {
+		uint32_t node = ext_new_node(bufs[l], depth - l);
+		ix = EXT_FIRST_INDEX((struct cofs_extent_header *) bufs[l]);
+		ix->ei_lblock = file_block_number;
+		ix->ei_block = child;
+		((struct cofs_extent_header *) bufs[l])->eh_entries = 1;
+		write_block(node, bufs[l]);
+		child = node;
+	}
+	ix = EXT_FIRST_INDEX(nodes[level]) + nodes[level]->eh_entries;
+	ix->ei_lblock = file_block_number;
+	ix->ei_block = child;
+	nodes[level]->eh_entries++;
+	if (level)
+		write_block(blocks[level], nodes[level]);
+	return block_no;
+}
+
 // appends from ptr, size bytes int inode number inum
 void inode_append(uint32_t inum, void *ptr, uint32_t size)
 {
 	char *p = (char *) ptr;
-	char buf[COFS_BLOCK_SIZE];
+	char buf[COFS_MAX_BLOCK_SIZE];
 	struct cofs_inode dino;
-	uint32_t sind_buf[COFS_BLOCK_SIZE/sizeof(uint32_t)]; // single indirect buffer
-    uint32_t dind_buf[COFS_BLOCK_SIZE/sizeof(uint32_t)]; // double indirect buffer
 	uint32_t offset, file_block_number, block_no, n;
 
 	read_inode(inum, &dino);
 	offset = dino.size;
 	while(size > 0) {
-		file_block_number = offset / COFS_BLOCK_SIZE;
-		if(file_block_number > MAX_FILE_SIZE) {
-			printf("File too large > %lu blocks\n", MAX_FILE_SIZE);
-			exit(1);
-		}
-		// direct //
-		if (file_block_number < NUM_DIRECT) {
-			if(dino.addrs[file_block_number] == 0) {
-				dino.addrs[file_block_number] = free_block++;
-			}
-			block_no = dino.addrs[file_block_number];
-		}
-		// single indirect //
-		else if(file_block_number < NUM_DIRECT + NUM_SIND){
-			if(dino.addrs[SIND_IDX] == 0) { // alloc a block for single indirect
-				dino.addrs[SIND_IDX] = free_block++;
-			}
-			read_block(dino.addrs[SIND_IDX], sind_buf);
-			if(sind_buf[file_block_number - NUM_DIRECT] == 0) {
-				sind_buf[file_block_number - NUM_DIRECT] = free_block++;
-				write_block(dino.addrs[SIND_IDX], sind_buf);
-			}
-			block_no = sind_buf[file_block_number - NUM_DIRECT];
+		file_block_number = offset / block_size;
+		if (COFS_HAS_FEATURE(&sb, COFS_FEAT_EXTENTS)) {
+			block_no = ext_map(&dino, file_block_number);
+		} else {
+			block_no = indirect_map(&dino, file_block_number);
 		}
-		// double indirect //
-		else {
-			if(dino.addrs[DIND_IDX] == 0) { // alloc a block for double indirect
-				dino.addrs[DIND_IDX] = free_block++;
-			}
-			uint32_t rel_b = file_block_number - NUM_DIRECT - NUM_SIND;
-			uint32_t midx = rel_b / NUM_SIND;
-			uint32_t sidx = rel_b % NUM_SIND;
-			read_block(dino.addrs[DIND_IDX], sind_buf);
-			if(sind_buf[midx] == 0) { // alloc 1'st level block
-				sind_buf[midx] = free_block++;
-				write_block(dino.addrs[DIND_IDX], sind_buf);
-			}
-			read_block(sind_buf[midx], dind_buf);
-			if(dind_buf[sidx] == 0) { // alloc 2'nd level block
-				dind_buf[sidx] = free_block++;
-				write_block(sind_buf[midx], dind_buf);
-			}
-			block_no = dind_buf[sidx];
-		}
-		n = min(size, (file_block_number + 1) * COFS_BLOCK_SIZE - offset);
+		n = min(size, (file_block_number + 1) * block_size - offset);
 		read_block(block_no, buf);
-		memcpy(buf + offset - (file_block_number * COFS_BLOCK_SIZE), p, n);
+		memcpy(buf + offset - (file_block_number * block_size), p, n);
 		write_block(block_no, buf);
 		size -= n;
 		offset += n;
@@ -177,41 +351,257 @@ void inode_append(uint32_t inum, void *ptr, uint32_t size)
 	write_inode(inum, &dino);
 }
 
+// maps block file_block_number of inode inum, allocating it if needed
+uint32_t inode_bmap(uint32_t inum, uint32_t file_block_number)
+{
+	struct cofs_inode dino;
+	uint32_t block_no;
+
+	read_inode(inum, &dino);
+	if (COFS_HAS_FEATURE(&sb, COFS_FEAT_EXTENTS)) {
+		block_no = ext_map(&dino, file_block_number);
+	} else {
+		block_no = indirect_map(&dino, file_block_number);
+	}
+	write_inode(inum, &dino);
+	return block_no;
+}
+
+/**
+ * Makes inum an empty hashed directory. All the table blocks are mapped
+ * ahead, so the extents stay in order while buckets are appended
+ */
+void dx_init(uint32_t inum)
+{
+	char buf[COFS_MAX_BLOCK_SIZE];
+	struct cofs_dx_header *dx = (struct cofs_dx_header *) buf;
+	struct cofs_dx_bucket *db = (struct cofs_dx_bucket *) buf;
+	struct cofs_inode dino;
+	uint32_t i;
+
+	for (i = 0; i < COFS_DX_FIRST_BUCKET(block_size); i++)
+		inode_bmap(inum, i);
+	memset(buf, 0, sizeof(buf));
+	dx->dx_magic = COFS_DX_MAGIC;
+	dx->dx_depth = 0;
+	dx->dx_buckets = 1;
+	write_block(inode_bmap(inum, 0), buf);
+
+	memset(buf, 0, sizeof(buf));
+	db->db_magic = COFS_DX_MAGIC;
+	db->db_depth = 0;
+	write_block(inode_bmap(inum, COFS_DX_FIRST_BUCKET(block_size)), buf);
+
+	read_inode(inum, &dino);
+	dino.size = (COFS_DX_FIRST_BUCKET(block_size) + 1) * block_size;
+	write_inode(inum, &dino);
+}
+
+// reads or writes entry i of the bucket table of inum
+uint32_t dx_entry(uint32_t inum, uint32_t i, uint32_t *value)
+{
+	char buf[COFS_MAX_BLOCK_SIZE];
+	uint32_t offset = COFS_DX_ENTRY_OFFSET(i);
+	uint32_t block_no = inode_bmap(inum, offset / block_size);
+	uint32_t *entry = (uint32_t *) (buf + offset % block_size);
+
+	read_block(block_no, buf);
+	if (value) {
+		*entry = *value;
+		write_block(block_no, buf);
+	}
+	return *entry;
+}
+
+// splits bucket of inum, where names with hash go, see dir.c
+void dx_split(uint32_t inum, uint32_t bucket, uint32_t hash)
+{
+	char hbuf[COFS_MAX_BLOCK_SIZE], buf[COFS_MAX_BLOCK_SIZE], nbuf[COFS_MAX_BLOCK_SIZE];
+	struct cofs_dx_header *dx = (struct cofs_dx_header *) hbuf;
+	struct cofs_dx_bucket *db = (struct cofs_dx_bucket *) buf;
+	struct cofs_dx_bucket *ndb = (struct cofs_dx_bucket *) nbuf;
+	struct cofs_dirent *cdir, *ndir;
+	struct cofs_inode dino;
+	uint32_t i, ldepth, nbucket, block_no;
+	int ft = COFS_HAS_FEATURE(&sb, COFS_FEAT_FILETYPE);
+
+	read_block(inode_bmap(inum, 0), hbuf);
+	block_no = inode_bmap(inum, COFS_DX_FIRST_BUCKET(block_size) + bucket);
+	read_block(block_no, buf);
+	ldepth = db->db_depth;
+	if (ldepth == dx->dx_depth) {
+		if (dx->dx_depth == COFS_DX_MAX_DEPTH) {
+			printf("Root directory is full\n");
+			exit(1);
+		}
+		for (i = 0; i < (1U << dx->dx_depth); i++) {
+			uint32_t entry = dx_entry(inum, i, NULL);
+			dx_entry(inum, i + (1U << dx->dx_depth), &entry);
+		}
+		// table may share the header block
+		read_block(inode_bmap(inum, 0), hbuf);
+		dx->dx_depth++;
+	}
+	nbucket = dx->dx_buckets++;
+	write_block(inode_bmap(inum, 0), hbuf);
+
+	memset(nbuf, 0, sizeof(nbuf));
+	ndb->db_magic = COFS_DX_MAGIC;
+	ndb->db_depth = ldepth + 1;
+	db->db_depth = ldepth + 1;
+	ndir = (struct cofs_dirent *) nbuf + 1;
+	for (cdir = (struct cofs_dirent *) buf + 1;
+			cdir < (struct cofs_dirent *) (buf + block_size); cdir++) {
+		if (cdir->d_ino &&
+				(cofs_dirent_hash(cdir, ft) >> ldepth) & 1) {
+			*ndir++ = *cdir;
+			memset(cdir, 0, sizeof(*cdir));
+		}
+	}
+	write_block(block_no, buf);
+	write_block(inode_bmap(inum, COFS_DX_FIRST_BUCKET(block_size) + nbucket), nbuf);
+
+	hash &= (1U << ldepth) - 1;
+	for (i = hash | (1U << ldepth); i < (1U << dx->dx_depth); i += 1U << (ldepth + 1))
+		dx_entry(inum, i, &nbucket);
+
+	read_inode(inum, &dino);
+	dino.size = (COFS_DX_FIRST_BUCKET(block_size) + nbucket + 1) * block_size;
+	write_inode(inum, &dino);
+}
+
+// adds dir to the hashed directory inum
+void dx_add(uint32_t inum, struct cofs_dirent *dir)
+{
+	char hbuf[COFS_MAX_BLOCK_SIZE], buf[COFS_MAX_BLOCK_SIZE];
+	struct cofs_dx_header *dx = (struct cofs_dx_header *) hbuf;
+	struct cofs_dirent *cdir;
+	uint32_t hash = cofs_dirent_hash(dir, COFS_HAS_FEATURE(&sb, COFS_FEAT_FILETYPE));
+	uint32_t bucket, block_no;
+
+	for (;;) {
+		read_block(inode_bmap(inum, 0), hbuf);
+		bucket = dx_entry(inum, hash & ((1U << dx->dx_depth) - 1), NULL);
+		block_no = inode_bmap(inum, COFS_DX_FIRST_BUCKET(block_size) + bucket);
+		read_block(block_no, buf);
+		for (cdir = (struct cofs_dirent *) buf + 1;
+				cdir < (struct cofs_dirent *) (buf + block_size); cdir++) {
+			if (!cdir->d_ino) {
+				*cdir = *dir;
+				write_block(block_no, buf);
+				return;
+			}
+		}
+		dx_split(inum, bucket, hash);
+	}
+}
+
+// adds an entry to directory inum
+void dir_add(uint32_t inum, uint32_t ino, const char *name, uint16_t type)
+{
+	struct cofs_dirent dir;
+
+	cofs_dirent_set(&dir, COFS_HAS_FEATURE(&sb, COFS_FEAT_FILETYPE), ino,
+			name, strlen(name), type);
+	if (COFS_HAS_FEATURE(&sb, COFS_FEAT_DIR_HASH)) {
+		dx_add(inum, &dir);
+	} else {
+		inode_append(inum, &dir, sizeof(dir));
+	}
+}
+
+void usage(char *prog)
+{
+	printf("Usage:\n %s [-e] [-d] [-t] [-j] [-b size] [-i size] <image> <files..>\n\n"
+	        "Options:\n"
+	        " -b    - block size: 512 (default), 1024, 2048 or 4096 bytes\n"
+	        " -i    - inode size: 64 (default) up to the block size; larger inodes\n"
+	        "         keep the data of small new files and directories inline\n"
+	        " -e    - map file data by extents instead of indirect blocks\n"
+	        " -d    - index directories by a hash of the names\n"
+	        " -t    - keep the file type in directory entries\n"
+	        " -j    - keep a journal of the meta data changes\n"
+	        " image - image to format (file or device)\n"
+	        " files - optional space separated list of files to be copied to partition\n",
+	            prog);
+}
+
 int main(int argc, char *argv[])
 {
-	if(argc < 2) {
-		printf("Usage:\n %s <image> <files..>\n\n"
-		        "Options:\n"
-		        " image - image to format (file or device)\n"
-		        " files - optional space separated list of files to be copied to partition\n",
-		            argv[0]);
+	int opt;
+	uint32_t features = 0;
 
+	while ((opt = getopt(argc, argv, "edtjb:i:")) != -1) {
+		switch (opt) {
+			case 'e':
+				features |= COFS_FEAT_EXTENTS;
+				break;
+			case 'd':
+				features |= COFS_FEAT_DIR_HASH;
+				break;
+			case 't':
+				features |= COFS_FEAT_FILETYPE;
+				break;
+			case 'j':
+				features |= COFS_FEAT_JOURNAL;
+				break;
+			case 'b':
+				block_size = strtoul(optarg, NULL, 0);
+				if (block_size < COFS_BLOCK_SIZE || block_size > COFS_MAX_BLOCK_SIZE
+						|| (block_size & (block_size - 1))) {
+					printf("Invalid block size %s\n", optarg);
+					return 1;
+				}
+				break;
+			case 'i':
+				inode_size = strtoul(optarg, NULL, 0);
+				break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+	if(argc - optind < 1) {
+		usage(argv[0]);
 		return 1;
 	}
+	argv += optind - 1;
+	argc -= optind - 1;
 
-	printf("Max supported file size: %lu bytes\n", MAX_FILE_SIZE * COFS_BLOCK_SIZE);
+	if (features & COFS_FEAT_EXTENTS) {
+		printf("Max supported file size: %llu bytes\n", COFS_EXT_MAX_BYTES);
+	} else {
+		// the inode size is 32 bits, with large blocks the map goes further
+		printf("Max supported file size: %llu bytes\n",
+				min((unsigned long long) MAX_FILE_SIZE(block_size) * block_size,
+					COFS_EXT_MAX_BYTES));
+	}
 	struct stat st;
 	uint32_t cofs_size,		// total fs size in blocks
 	         bitmap_size,	// free bitmap size in blocks
+	         imap_size,	// inode bitmap size in blocks
 	         inodes_size,	// size of inodes in blocks
+	         journal_size = 0,	// size of the journal in blocks
 	         num_inodes,
 	         num_meta_blocks,
 	         num_data_blocks;
 
 	uint32_t i;
-    char buf[COFS_BLOCK_SIZE];
+    char buf[COFS_MAX_BLOCK_SIZE];
 	struct cofs_inode dino;
-	struct cofs_dirent dir;
 
 	if (sizeof(int) != 4) {
 		printf("Sizeof int should be 4, got %lu\n", sizeof(int));
 		return 1;
 	}
-	if (COFS_BLOCK_SIZE % sizeof(cofs_inode_t) != 0) {
-		printf("Block size is not multiple of inode size\n");
+	if (inode_size < sizeof(cofs_inode_t) || inode_size > block_size
+			|| (inode_size & (inode_size - 1))) {
+		printf("Invalid inode size %u\n", inode_size);
 		return 1;
 	}
-	if (COFS_BLOCK_SIZE % sizeof(sizeof(struct cofs_dirent)) != 0) {
+	if (inode_size > sizeof(cofs_inode_t))
+		features |= COFS_FEAT_INLINE;
+	if (block_size % sizeof(struct cofs_dirent) != 0) {
 		printf("Block size is not multiple of dirent size\n");
 		return 1;
 	}
@@ -225,7 +615,7 @@ int main(int argc, char *argv[])
 		return 1;
 	}
     if (S_ISREG(st.st_mode)) {
-    	cofs_size = st.st_size / COFS_BLOCK_SIZE;
+    	cofs_size = st.st_size / block_size;
     } else if (S_ISBLK(st.st_mode)) {
         uint64_t size;
         if (ioctl(fd, BLKGETSIZE64,&size) == -1) {
@@ -233,16 +623,23 @@ int main(int argc, char *argv[])
             close(fd);
             return 1;
         }
-        cofs_size = size / COFS_BLOCK_SIZE;
+        cofs_size = size / block_size;
     }
 	cofs_size -= PARTITION_OFFSET;
 	// assuming one file has ~4096 bytes, 1 inode per file //
-	num_inodes = cofs_size * COFS_BLOCK_SIZE / 4096; 
-	bitmap_size = 1 + cofs_size / BITS_PER_BLOCK;
-	inodes_size = 1 + num_inodes / NUM_INOPB;
+	num_inodes = (uint64_t) cofs_size * block_size / 4096; 
+	bitmap_size = 1 + cofs_size / BITS_PER_BLOCK(block_size);
+	imap_size = 1 + num_inodes / BITS_PER_BLOCK(block_size);
+	inodes_size = 1 + num_inodes / NUM_INOPB(block_size, inode_size);
+	// 1/64 of the disk, in two halves of 128 to 8192 blocks //
+	if (features & COFS_FEAT_JOURNAL) {
+		journal_size = cofs_size / 64;
+		journal_size = journal_size < 256 ? 256 : journal_size > 16384 ? 16384 : journal_size;
+		journal_size &= ~1U;
+	}
 
 	// 1'st block unused, 2'nd block superblock //
-	num_meta_blocks = 2 + inodes_size + bitmap_size;
+	num_meta_blocks = 2 + inodes_size + bitmap_size + imap_size + journal_size;
 	num_data_blocks = cofs_size - num_meta_blocks;
 
 	sb.magic = COFS_MAGIC;
@@ -250,36 +647,48 @@ int main(int argc, char *argv[])
 	sb.num_blocks = num_data_blocks;
 	sb.num_inodes = num_inodes;
 	sb.bitmap_start = 2;
-	sb.inode_start = 2 + bitmap_size;
+	sb.imap_start = 2 + bitmap_size;
+	sb.inode_start = 2 + bitmap_size + imap_size;
+	sb.journal_start = journal_size ? sb.inode_start + inodes_size : 0;
+	sb.journal_blocks = journal_size;
 	sb.data_block = num_meta_blocks;
+	sb.features = features | COFS_FEAT_IMAP;
+	sb.block_size = block_size;
+	sb.inode_size = inode_size;
 	free_block = num_meta_blocks;
 
 	printf("Superblock:\n"
 	        " Block size: %u\n"
+	        " Inode size: %u\n"
 	        " Size: %u blocks\n"
 	        " Data blocks: %u blocks\n"
 	        " Number of inodes: %u\n"
 	        " Block bitmap starts at: %u block\n"
+	        " Inode bitmap starts at: %u block\n"
 	        " Inode table starts at: %u block\n"
+	        " Journal: %u blocks at block %u\n"
 	        " Size of partition meta data: %u blocks\n"
-	        " First data block: %u\n",
-		COFS_BLOCK_SIZE, sb.size, sb.num_blocks, sb.num_inodes, 
-		sb.bitmap_start, sb.inode_start, sb.data_block, num_meta_blocks);
+	        " First data block: %u\n"
+	        " Features: %X\n",
+		sb.block_size, sb.inode_size, sb.size, sb.num_blocks, sb.num_inodes, 
+		sb.bitmap_start, sb.imap_start, sb.inode_start, sb.journal_blocks, sb.journal_start,
+		num_meta_blocks, sb.data_block,
+		sb.features);
 
 	// check if we already have cofs fs //
-	read_block(1, buf);
+	read_block(COFS_SB_BLOCK, buf);
 	if(((uint32_t*) buf) [0] == COFS_MAGIC) {
 		printf("Already formated\n");
 		// exit(0);
 	}
 	// bzero fs //
-	memset(buf, 0, COFS_BLOCK_SIZE);
+	memset(buf, 0, block_size);
 	for(i = 0; i < sb.size; i++) {
 		write_block(i, buf);
 	}
 	// write superblock //
 	memcpy(buf, (void *)&sb, sizeof(sb));
-	write_block(1, buf);
+	write_block(COFS_SB_BLOCK, buf);
 
 	// root inode //
     uint32_t root_inode = inode_alloc(FS_DIRECTORY | 0755);
@@ -287,15 +696,11 @@ int main(int argc, char *argv[])
 		printf("Invalid root inode - expected 1\n");
 		exit(1);
 	}
-	memset(&dir, 0, sizeof(dir));
-	dir.d_ino = root_inode;
-	strcpy(dir.d_name, ".");
-	inode_append(root_inode, &dir, sizeof(dir));
-
-	memset(&dir, 0, sizeof(dir));
-	dir.d_ino = root_inode;
-	strcpy(dir.d_name, "..");
-	inode_append(root_inode, &dir, sizeof(dir));
+	if (COFS_HAS_FEATURE(&sb, COFS_FEAT_DIR_HASH)) {
+		dx_init(root_inode);
+	}
+	dir_add(root_inode, root_inode, ".", FS_DIRECTORY);
+	dir_add(root_inode, root_inode, "..", FS_DIRECTORY);
 	
 	int file_fd, inode_num, num_bytes;
 	for(i = 2; i < (unsigned int) argc; i++) {
@@ -304,10 +709,7 @@ int main(int argc, char *argv[])
 			exit(1);
 		}
 		inode_num = inode_alloc(FS_FILE | 0666);
-		memset(&dir, 0, sizeof(dir));
-		dir.d_ino = inode_num;
-		strncpy(dir.d_name, basename(argv[i]), COFS_FILE_NAME_MAX_LEN);
-		inode_append(root_inode, &dir, sizeof(dir));
+		dir_add(root_inode, inode_num, basename(argv[i]), FS_FILE);
 
 		while ((num_bytes = read(file_fd, buf, sizeof(buf))) > 0) {
 			inode_append(inode_num, buf, num_bytes);
@@ -315,13 +717,17 @@ int main(int argc, char *argv[])
 		close(file_fd);
 	}
 
-	read_inode(root_inode, &dino);
+	// hashed directories are always made of whole blocks
+	if (!COFS_HAS_FEATURE(&sb, COFS_FEAT_DIR_HASH)) {
+		read_inode(root_inode, &dino);
 
-	uint32_t offset = dino.size;
-	offset = ((offset / COFS_BLOCK_SIZE) + 1) * COFS_BLOCK_SIZE;
-	dino.size = offset;
-	write_inode(root_inode, &dino);
+		uint32_t offset = dino.size;
+		offset = ((offset / block_size) + 1) * block_size;
+		dino.size = offset;
+		write_inode(root_inode, &dino);
+	}
 	block_alloc(free_block);
+	inode_bitmap_alloc(free_inode);
 
 	printf("First free block is %d\n", free_block);
 	close(fd);
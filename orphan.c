@@ -0,0 +1,221 @@
+/**
+ *  Orphan inodes
+ *
+ *  An inode losing it's last link is added to a list starting in the super
+ *  block (orphan_head) and linked through the disk inodes (COFS_ORPHAN_NEXT).
+ *  When the last reference goes, cofs_orphan_drop keeps the inode cached and
+ *  queues it for s_orphan_work, which frees the blocks in background; the
+ *  eviction that follows only releases the inode and takes it off the list.
+ *  After a crash, the inodes left on the list are freed at mount.
+ */
+#include <linux/buffer_head.h>
+#include <linux/fs.h>
+#include <linux/pagemap.h>
+#include "cofs_common.h"
+#include "super.h"
+#include "inode.h"
+#include "orphan.h"
+#include "journal.h"
+
+static void cofs_orphan_work(struct work_struct *work);
+
+void cofs_orphan_init(struct super_block *sb)
+{
+    struct cofs_sb_info *sbi = COFS_SB(sb);
+
+    sbi->s_vfs_sb = sb;
+    mutex_init(&sbi->s_orphan_lock);
+    spin_lock_init(&sbi->s_orphan_queue_lock);
+    INIT_LIST_HEAD(&sbi->s_orphan_queue);
+    INIT_WORK(&sbi->s_orphan_work, cofs_orphan_work);
+}
+
+/**
+ * Puts inode, which has no more links, at the head of the orphan list
+ */
+int cofs_orphan_add(struct inode *inode)
+{
+    struct super_block *sb = inode->i_sb;
+    struct cofs_sb_info *sbi = COFS_SB(sb);
+    struct buffer_head *bh;
+    cofs_inode_t *dino;
+    int err;
+
+    if (COFS_I(inode)->i_orphan)
+        return 0;
+    if ((err = cofs_set_feature(sb, COFS_FEAT_ORPHAN)))
+        return err;
+    mutex_lock(&sbi->s_orphan_lock);
+    if (!(dino = cofs_raw_inode(sb, inode->i_ino, &bh))) {
+        mutex_unlock(&sbi->s_orphan_lock);
+        return -EIO;
+    }
+    COFS_ORPHAN_NEXT(dino) = sbi->s_sb->orphan_head;
+    cofs_journal_dirty(sb, bh);
+    brelse(bh);
+    sbi->s_sb->orphan_head = inode->i_ino;
+    cofs_commit_super(sb, 0);
+    COFS_I(inode)->i_orphan = 1;
+    mutex_unlock(&sbi->s_orphan_lock);
+    pr_debug("cofs: inode %lu is an orphan\n", inode->i_ino);
+    return 0;
+}
+
+/**
+ * Takes inode off the orphan list; the list is short, it's walked to find
+ * the previous inode.
+ */
+void cofs_orphan_del(struct inode *inode)
+{
+    struct super_block *sb = inode->i_sb;
+    struct cofs_sb_info *sbi = COFS_SB(sb);
+    struct buffer_head *bh, *pbh;
+    cofs_inode_t *dino, *pdino;
+    unsigned int next, prev, n;
+
+    if (!COFS_I(inode)->i_orphan)
+        return;
+    mutex_lock(&sbi->s_orphan_lock);
+    if (!(dino = cofs_raw_inode(sb, inode->i_ino, &bh)))
+        goto out;
+    next = COFS_ORPHAN_NEXT(dino);
+    COFS_ORPHAN_NEXT(dino) = 0;
+    cofs_journal_dirty(sb, bh);
+    brelse(bh);
+    if (sbi->s_sb->orphan_head == inode->i_ino) {
+        sbi->s_sb->orphan_head = next;
+        cofs_commit_super(sb, 0);
+        goto out;
+    }
+    // a corrupted list may loop, it can't be longer than num_inodes
+    prev = sbi->s_sb->orphan_head;
+    for (n = 0; prev && n < sbi->s_sb->num_inodes; n++) {
+        if (!(pdino = cofs_raw_inode(sb, prev, &pbh)))
+            break;
+        if (COFS_ORPHAN_NEXT(pdino) == inode->i_ino) {
+            COFS_ORPHAN_NEXT(pdino) = next;
+            cofs_journal_dirty(sb, pbh);
+            brelse(pbh);
+            goto out;
+        }
+        prev = COFS_ORPHAN_NEXT(pdino);
+        brelse(pbh);
+    }
+    pr_err("cofs: inode %lu not found on the orphan list\n", inode->i_ino);
+out:
+    COFS_I(inode)->i_orphan = 0;
+    mutex_unlock(&sbi->s_orphan_lock);
+}
+
+/**
+ * The drop_inode of cofs. The last reference to an unlinked inode is gone:
+ * instead of evicting it now, which frees all it's blocks, keep it cached
+ * and let the worker do it. Called with inode->i_lock held.
+ */
+int cofs_orphan_drop(struct inode *inode)
+{
+    struct cofs_sb_info *sbi = COFS_SB(inode->i_sb);
+    struct cofs_inode_info *ci = COFS_I(inode);
+
+    // while mounting or unmounting, the inode is evicted anyway
+    if (inode->i_nlink || ci->i_deleted || !(inode->i_sb->s_flags & SB_ACTIVE))
+        return generic_drop_inode(inode);
+    spin_lock(&sbi->s_orphan_queue_lock);
+    if (list_empty(&ci->i_orphan_queue))
+        list_add_tail(&ci->i_orphan_queue, &sbi->s_orphan_queue);
+    spin_unlock(&sbi->s_orphan_queue_lock);
+    schedule_work(&sbi->s_orphan_work);
+    return 0;
+}
+
+/**
+ * The inode is evicted, the worker must not look for it
+ */
+void cofs_orphan_dequeue(struct inode *inode)
+{
+    struct cofs_sb_info *sbi = COFS_SB(inode->i_sb);
+    struct cofs_inode_info *ci = COFS_I(inode);
+
+    spin_lock(&sbi->s_orphan_queue_lock);
+    list_del_init(&ci->i_orphan_queue);
+    spin_unlock(&sbi->s_orphan_queue_lock);
+}
+
+/*
+ * Frees the blocks of the queued inodes, then lets them go. The queue only
+ * gives the inode number: a queued inode can be evicted meanwhile, so it is
+ * looked up again. Nothing is done while the file system is unmounted,
+ * the eviction of the inodes frees them then.
+ */
+static void cofs_orphan_work(struct work_struct *work)
+{
+    struct cofs_sb_info *sbi = container_of(work, struct cofs_sb_info, s_orphan_work);
+    struct super_block *sb = sbi->s_vfs_sb;
+    struct cofs_inode_info *ci;
+    struct inode *inode;
+    unsigned long ino;
+
+    if (!down_read_trylock(&sb->s_umount))
+        return;
+    spin_lock(&sbi->s_orphan_queue_lock);
+    while (!list_empty(&sbi->s_orphan_queue)) {
+        ci = list_first_entry(&sbi->s_orphan_queue, struct cofs_inode_info, i_orphan_queue);
+        list_del_init(&ci->i_orphan_queue);
+        ino = ci->vfs_inode.i_ino;
+        spin_unlock(&sbi->s_orphan_queue_lock);
+
+        inode = ilookup(sb, ino);
+        if (inode) {
+            if (!inode->i_nlink && !COFS_I(inode)->i_deleted) {
+                pr_debug("cofs: freeing orphan inode %lu\n", ino);
+                inode_lock(inode);
+                truncate_inode_pages(&inode->i_data, 0);
+                cofs_truncate(inode, 0, sb->s_maxbytes);
+                COFS_I(inode)->i_deleted = 1;
+                inode_unlock(inode);
+            }
+            iput(inode);
+        }
+        cond_resched();
+        spin_lock(&sbi->s_orphan_queue_lock);
+    }
+    spin_unlock(&sbi->s_orphan_queue_lock);
+    up_read(&sb->s_umount);
+}
+
+/**
+ * Frees the inodes left on the orphan list, by a crash. Called at mount, 
+ * before SB_ACTIVE is set, so iput evicts them right away.
+ */
+void cofs_orphan_replay(struct super_block *sb)
+{
+    struct cofs_sb_info *sbi = COFS_SB(sb);
+    struct inode *inode;
+    unsigned int ino;
+
+    while ((ino = sbi->s_sb->orphan_head)) {
+        pr_info("cofs: freeing orphan inode %u\n", ino);
+        inode = cofs_iget(sb, ino);
+        if (IS_ERR(inode)) {
+            pr_err("cofs: cannot read orphan inode %u\n", ino);
+            return;
+        }
+        COFS_I(inode)->i_orphan = 1;
+        // linked again before the crash, only take it off the list
+        if (inode->i_nlink) {
+            cofs_journal_start(sb);
+            cofs_orphan_del(inode);
+            cofs_journal_stop(sb);
+        }
+        iput(inode);
+        if (sbi->s_sb->orphan_head == ino) {
+            pr_err("cofs: orphan inode %u stays on the list\n", ino);
+            return;
+        }
+    }
+}
+
+void cofs_orphan_stop(struct super_block *sb)
+{
+    cancel_work_sync(&COFS_SB(sb)->s_orphan_work);
+}
@@ -0,0 +1,17 @@
+#ifndef _ORPHAN_H
+#define _ORPHAN_H
+
+/**
+ * Unlinked inodes are kept on an on disk list until their blocks are freed,
+ * which is done by a worker, out of the unlink / close path. Whatever is
+ * still on the list at mount time is freed by cofs_orphan_replay.
+ */
+void cofs_orphan_init(struct super_block *sb);
+int cofs_orphan_add(struct inode *inode);
+void cofs_orphan_del(struct inode *inode);
+int cofs_orphan_drop(struct inode *inode);
+void cofs_orphan_dequeue(struct inode *inode);
+void cofs_orphan_replay(struct super_block *sb);
+void cofs_orphan_stop(struct super_block *sb);
+
+#endif
@@ -4,13 +4,26 @@
 #include <linux/statfs.h>
 #include <linux/buffer_head.h>
 #include <linux/slab.h>
+#include <linux/parser.h>
+#include <linux/seq_file.h>
 
 #include "cofs_common.h"
+#include "super.h"
 #include "inode.h"
+#include "block.h"
+#include "orphan.h"
+#include "journal.h"
 
+/**
+ * Reads the super block, from block 1 whatever the block size is. We try
+ * each block size, the smallest first, until block 1 has the super block
+ * and it says that is the block size of the file system.
+ * The device is left with that block size.
+ */
 cofs_superblock_t *cofs_super_block_read(struct super_block *sb)
 {
     struct buffer_head *bh;
+    unsigned int bs, isz;
 
     cofs_superblock_t *cofs_sb = kzalloc(sizeof(cofs_superblock_t), GFP_NOFS);
 
@@ -19,27 +32,48 @@ cofs_superblock_t *cofs_super_block_read(struct super_block *sb)
         return NULL;
     }
 
-    bh = sb_bread(sb, 1);
-    if (!bh) {
-        pr_err("cofs: cannot read block 1\n");
-        kfree(cofs_sb);
-        return NULL;
+    for (bs = COFS_BLOCK_SIZE; bs <= COFS_MAX_BLOCK_SIZE; bs <<= 1) {
+        // the device may have larger sectors, or pages be smaller
+        if (sb_set_blocksize(sb, bs) == 0)
+            continue;
+        if (!(bh = sb_bread(sb, COFS_SB_BLOCK)))
+            continue;
+        pr_debug("buffer_head size: %lu, sb size: %lu\n", bh->b_size, sb->s_blocksize);
+        // fill data //
+        // how about disk to cpu and cpu 2 disk conversion little/big endian...
+        memcpy(cofs_sb, bh->b_data, sizeof(cofs_superblock_t));
+        brelse(bh);
+        if (cofs_sb->magic == COFS_MAGIC && COFS_SB_BLOCK_SIZE(cofs_sb) == bs)
+            break;
     }
-    pr_debug("buffer_head size: %lu, sb size: %lu\n", bh->b_size, sb->s_blocksize);
-    // fill data //
-    // how about disk to cpu and cpu 2 disk conversion little/big endian...
-    memcpy(cofs_sb, bh->b_data, sizeof(cofs_superblock_t));
-    brelse(bh);
     
     pr_debug("Magic is: %X\n", cofs_sb->magic);
+    pr_debug("Block size: %u\n", COFS_SB_BLOCK_SIZE(cofs_sb));
+    pr_debug("Inode size: %u\n", (unsigned int) COFS_SB_INODE_SIZE(cofs_sb));
     pr_debug("Size in blocks: %d\n", cofs_sb->size);
     pr_debug("Number of data blocks: %d\n", cofs_sb->num_blocks);
     pr_debug("Number of inodes: %d\n", cofs_sb->num_inodes);
     pr_debug("Bitmap starts at: %d\n", cofs_sb->bitmap_start);
     pr_debug("Innode starts at: %d\n", cofs_sb->inode_start);
+    pr_debug("Features: %X\n", cofs_sb->features);
+    pr_debug("Inode bitmap starts at: %d\n", cofs_sb->imap_start);
 
-    if (cofs_sb->magic != COFS_MAGIC) {
-        pr_err("cofs: invalid filesystem, wrong magic number %X\n", cofs_sb->magic);
+    if (bs > COFS_MAX_BLOCK_SIZE) {
+        pr_err("cofs: invalid filesystem, no super block found\n");
+        kfree(cofs_sb);
+        return NULL;
+    }
+    if (cofs_sb->features & ~COFS_FEAT_SUPPORTED) {
+        pr_err("cofs: unsupported features %X\n", 
+                cofs_sb->features & ~COFS_FEAT_SUPPORTED);
+        kfree(cofs_sb);
+        return NULL;
+    }
+    isz = COFS_SB_INODE_SIZE(cofs_sb);
+    if (isz < sizeof(cofs_inode_t) || isz > bs || (isz & (isz - 1))
+            || (COFS_HAS_FEATURE(cofs_sb, COFS_FEAT_INLINE)
+                && isz <= sizeof(cofs_inode_t) + sizeof(struct cofs_inode_tail))) {
+        pr_err("cofs: invalid inode size %u\n", isz);
         kfree(cofs_sb);
         return NULL;
     }
@@ -47,61 +81,278 @@ cofs_superblock_t *cofs_super_block_read(struct super_block *sb)
     return cofs_sb;
 }
 
+/**
+ * Copies the in memory super block back into it's block, and writes it if sync.
+ * With a journal it goes in the running transaction, with the changes it
+ * describes, and sync is up to the caller's commit.
+ */
+void cofs_commit_super(struct super_block *sb, int sync)
+{
+    struct buffer_head *bh;
+
+    if (!(bh = sb_bread(sb, COFS_SB_BLOCK))) {
+        pr_err("cofs: cannot read the super block\n");
+        return;
+    }
+    memcpy(bh->b_data, COFS_SB(sb)->s_sb, sizeof(cofs_superblock_t));
+    if (cofs_has_journal(sb)) {
+        cofs_journal_join(sb);
+        cofs_journal_dirty(sb, bh);
+        cofs_journal_stop(sb);
+    } else {
+        mark_buffer_dirty(bh);
+        if (sync)
+            sync_dirty_buffer(bh);
+    }
+    brelse(bh);
+}
+
+/**
+ * Turns on a format feature the first time it is used (like the unwritten
+ * extents of fallocate), so modules not knowing it refuse to mount.
+ */
+int cofs_set_feature(struct super_block *sb, unsigned int feature)
+{
+    cofs_superblock_t *cofs_sb = COFS_SB(sb)->s_sb;
+
+    if (COFS_HAS_FEATURE(cofs_sb, feature))
+        return 0;
+    pr_info("cofs: enabling feature %X\n", feature);
+    cofs_sb->features |= feature;
+    cofs_commit_super(sb, 1);
+    return 0;
+}
+
+static struct kmem_cache *cofs_inode_cachep;
+
+static struct inode *cofs_alloc_inode(struct super_block *sb)
+{
+    struct cofs_inode_info *ci = kmem_cache_alloc(cofs_inode_cachep, GFP_KERNEL);
+
+    if (!ci)
+        return NULL;
+    ci->i_last_block = 0;
+    ci->i_rsv_start = 0;
+    ci->i_rsv_len = 0;
+    ci->i_rsv_size = 0;
+    ci->i_dir_format = COFS_DIR_UNKNOWN;
+    ci->i_dircache = NULL;
+    INIT_LIST_HEAD(&ci->i_orphan_queue);
+    ci->i_orphan = 0;
+    ci->i_deleted = 0;
+    ci->i_flags = 0;
+    return &ci->vfs_inode;
+}
+
+static void cofs_free_inode(struct inode *inode)
+{
+    kmem_cache_free(cofs_inode_cachep, COFS_I(inode));
+}
+
+static void cofs_init_once(void *foo)
+{
+    struct cofs_inode_info *ci = (struct cofs_inode_info *) foo;
+    mutex_init(&ci->i_dir_lock);
+    init_rwsem(&ci->i_map_sem);
+    inode_init_once(&ci->vfs_inode);
+}
+
+static int cofs_init_inodecache(void)
+{
+    cofs_inode_cachep = kmem_cache_create("cofs_inode_cache",
+            sizeof(struct cofs_inode_info), 0,
+            SLAB_RECLAIM_ACCOUNT | SLAB_MEM_SPREAD | SLAB_ACCOUNT,
+            cofs_init_once);
+    if (!cofs_inode_cachep)
+        return -ENOMEM;
+    return 0;
+}
+
+static void cofs_destroy_inodecache(void)
+{
+    // make sure all delayed rcu free inodes are flushed before we destroy cache
+    rcu_barrier();
+    kmem_cache_destroy(cofs_inode_cachep);
+}
+
+static void cofs_free_sb_info(struct super_block *sb)
+{
+    struct cofs_sb_info *sbi = COFS_SB(sb);
+
+    if (!sbi)
+        return;
+    cofs_journal_release(sb);
+    cofs_bitmap_release(sb);
+    cofs_inodes_release(sb);
+    kfree(sbi->s_sb);
+    kfree(sbi);
+    sb->s_fs_info = NULL;
+}
+
 static void cofs_put_super(struct super_block *sb) {
     pr_debug("cofs: put super\n");
-    kfree(sb->s_fs_info);
+    cofs_orphan_stop(sb);
+    cofs_free_sb_info(sb);
 }
 
+/*
+ * The free counters are kept up to date by the allocators, no need for I/O.
+ * Their per cpu parts are added up.
+ */
 int cofs_statfs(struct dentry *dentry, struct kstatfs *statfs)
 {
+    struct cofs_sb_info *sbi = COFS_SB(dentry->d_sb);
+    s64 free = percpu_counter_sum_positive(&sbi->s_free_blocks)
+        - percpu_counter_sum_positive(&sbi->s_dirty_blocks);
+
     statfs->f_type = COFS_MAGIC;
-    statfs->f_bsize = COFS_BLOCK_SIZE;
-    statfs->f_bfree = 123;
-    statfs->f_namelen = 28;
+    statfs->f_bsize = dentry->d_sb->s_blocksize;
+    statfs->f_blocks = sbi->s_sb->num_blocks;
+    statfs->f_bfree = free > 0 ? free : 0;
+    statfs->f_bavail = statfs->f_bfree;
+    statfs->f_files = sbi->s_sb->num_inodes;
+    statfs->f_ffree = percpu_counter_sum_positive(&sbi->s_free_inodes);
+    statfs->f_namelen = COFS_FILE_NAME_MAX_LEN;
+    return 0;
+}
+
+/*
+ * Called by sync(2) once the inodes were written back. The inode table
+ * blocks were only dirtied then (see cofs_write_inode), so they go out now
+ * with the bitmaps and the super block in one batch, and the disk cache
+ * is flushed once. With a journal, it's all in the running transaction.
+ */
+static int cofs_sync_fs(struct super_block *sb, int wait)
+{
+    int err;
+
+    if (cofs_has_journal(sb))
+        return wait ? cofs_journal_commit(sb) : 0;
+    if (!wait)
+        return cofs_bitmap_sync(sb, 0);
+    if ((err = sync_blockdev(sb->s_bdev)))
+        return err;
+    return blkdev_issue_flush(sb->s_bdev, GFP_KERNEL);
+}
+
+enum {
+    Opt_delalloc, Opt_nodelalloc, Opt_err
+};
+
+static const match_table_t cofs_tokens = {
+    {Opt_delalloc, "delalloc"},
+    {Opt_nodelalloc, "nodelalloc"},
+    {Opt_err, NULL}
+};
+
+static int cofs_parse_options(char *options, struct cofs_sb_info *sbi)
+{
+    substring_t args[MAX_OPT_ARGS];
+    char *p;
+
+    if (!options)
+        return 0;
+    while ((p = strsep(&options, ",")) != NULL) {
+        if (!*p)
+            continue;
+        switch (match_token(p, cofs_tokens, args)) {
+            case Opt_delalloc:
+                sbi->s_mount_opt |= COFS_MOUNT_DELALLOC;
+                break;
+            case Opt_nodelalloc:
+                sbi->s_mount_opt &= ~COFS_MOUNT_DELALLOC;
+                break;
+            default:
+                pr_err("cofs: unrecognized mount option \"%s\"\n", p);
+                return -EINVAL;
+        }
+    }
+    return 0;
+}
+
+static int cofs_show_options(struct seq_file *seq, struct dentry *root)
+{
+    if (cofs_test_opt(root->d_sb, COFS_MOUNT_DELALLOC))
+        seq_puts(seq, ",delalloc");
     return 0;
 }
 
 struct super_operations cofs_super_ops = {
+    .alloc_inode    = cofs_alloc_inode,
+    .free_inode     = cofs_free_inode,
+    .dirty_inode    = cofs_dirty_inode,
+    .write_inode    = cofs_write_inode,
+    .drop_inode     = cofs_orphan_drop,
     .evict_inode    = cofs_inode_evict,
     .statfs         = cofs_statfs, 
     .put_super      = cofs_put_super,
+    .sync_fs        = cofs_sync_fs,
+    .show_options   = cofs_show_options,
 };
 
 static int cofs_fill_sb(struct super_block *sb, void *data, int silent)
 {
-
+	struct cofs_sb_info *sbi;
 	cofs_superblock_t *cofs_sb;
 	struct inode *root;
-    // Make sure a block is a set of COFS_BLOCK_SIZE //
-	if (sb_set_blocksize(sb, COFS_BLOCK_SIZE) == 0) {
-		pr_err("cofs: cannot set device's blocksize to %d\n", COFS_BLOCK_SIZE);
-		return -EINVAL;
-	}
-    
+	int err;
+
+    // sets the block size too //
     cofs_sb = cofs_super_block_read(sb);
 
     pr_debug("cofs: filling super_block\n");
 	if (!cofs_sb)
 		return -EINVAL;
 
+	sbi = kzalloc(sizeof(*sbi), GFP_KERNEL);
+	if (!sbi) {
+		kfree(cofs_sb);
+		return -ENOMEM;
+	}
+	sbi->s_sb = cofs_sb;
 	sb->s_magic = cofs_sb->magic;
-	sb->s_fs_info = cofs_sb;
+	sb->s_fs_info = sbi;
 	sb->s_op = &cofs_super_ops;
-	sb->s_maxbytes = MAX_FILE_SIZE;
+	// disk inodes keep whole seconds, so a write in the same second does
+	// not dirty the inode only to update the timestamps
+	sb->s_time_gran = NSEC_PER_SEC;
+	sb->s_time_min = 0;
+	sb->s_time_max = U32_MAX;
+	cofs_orphan_init(sb);
+	if ((err = cofs_parse_options(data, sbi)))
+		goto failed;
+	// replays the journal, before anything reads the metadata
+	if ((err = cofs_journal_load(sb)))
+		goto failed;
+	if (COFS_HAS_FEATURE(cofs_sb, COFS_FEAT_EXTENTS))
+		sb->s_maxbytes = COFS_EXT_MAX_BYTES;
+	else
+		// the size of an inode is 32 bits, larger blocks map more than that
+		sb->s_maxbytes = cofs_min(MAX_FILE_SIZE(sb->s_blocksize) * sb->s_blocksize,
+				COFS_EXT_MAX_BYTES);
+
+	if ((err = cofs_bitmap_load(sb)) || (err = cofs_inodes_load(sb)))
+		goto failed;
     
 	root = cofs_iget(sb, 1);
+	if (IS_ERR(root)) {
+	    err = PTR_ERR(root);
+	    goto failed;
+	}
 	pr_debug("root has %u i_nlink\n", root->i_nlink);
-	if (IS_ERR(root))
-	    return PTR_ERR(root);
 	sb->s_root = d_make_root(root);
 	if (!sb->s_root) {
-	    iput(root); // ?!?!?
-	    kfree(cofs_sb);
 		pr_err("cofs cannot create root\n");
-		return -ENOMEM;
+		err = -ENOMEM;
+		goto failed;
 	}
+	cofs_orphan_replay(sb);
 	
 	return 0;
+
+failed:
+	cofs_free_sb_info(sb);
+	return err;
 }
 
 static struct dentry * cofs_mount(
@@ -133,8 +384,21 @@ static struct file_system_type cofs_type = {
 
 static int __init cofs_init(void)
 {
+    int err;
+
     pr_debug("cofs: init\n");
-    return register_filesystem(&cofs_type);
+    if ((err = cofs_init_inodecache()))
+        return err;
+    if ((err = cofs_journal_init()))
+        goto out_inodecache;
+    if ((err = register_filesystem(&cofs_type)))
+        goto out_journal;
+    return 0;
+out_journal:
+    cofs_journal_exit();
+out_inodecache:
+    cofs_destroy_inodecache();
+    return err;
 }
 
 static void __exit cofs_exit(void) 
@@ -142,6 +406,8 @@ static void __exit cofs_exit(void)
     if (unregister_filesystem(&cofs_type) != 0) {
         pr_err("cofs: cannot unregister_filesystem\n");
     }
+    cofs_journal_exit();
+    cofs_destroy_inodecache();
     pr_debug("cofs: unloaded\n");
 }
 
@@ -0,0 +1,98 @@
+#ifndef _SUPER_H
+#define _SUPER_H
+
+#include <linux/percpu_counter.h>
+
+/**
+ * An allocation group: the blocks described by one bitmap block, and a
+ * slice of s_inodes_per_group inodes. Each has it's own lock, so writers
+ * allocating in different groups do not wait for each other.
+ */
+struct cofs_group {
+    spinlock_t g_lock;              // protects it's bits in the bitmaps
+    unsigned int g_free_blocks;
+    unsigned int g_free_inodes;     // if COFS_FEAT_IMAP
+};
+
+/**
+ * The in memory super block, hanging from sb->s_fs_info
+ */
+struct cofs_journal;
+
+struct cofs_sb_info {
+    cofs_superblock_t *s_sb;        // the disk super block
+    struct buffer_head **s_bmap;    // free blocks bitmap, kept while mounted
+    unsigned int s_bmap_blocks;     // number of bitmap blocks, and of groups
+    struct cofs_group *s_groups;    // allocation groups
+    unsigned int s_bmap_cursor;     // hint, groups before it have no free blocks
+    unsigned int s_inodes_per_group;
+    struct buffer_head **s_imap;    // inode bitmap, if COFS_FEAT_IMAP
+    unsigned int s_imap_blocks;     // number of inode bitmap blocks
+    struct mutex s_itable_lock;     // the inode table walk, without it
+    struct percpu_counter s_free_blocks;    // free blocks, in total
+    struct percpu_counter s_free_inodes;    // free inodes, in total
+    struct percpu_counter s_dirty_blocks;   // blocks promised to delayed allocations
+    unsigned int s_mount_opt;       // COFS_MOUNT_* flags
+    struct super_block *s_vfs_sb;   // the VFS super block we hang from
+    struct mutex s_orphan_lock;     // protects the on disk orphan list
+    spinlock_t s_orphan_queue_lock;
+    struct list_head s_orphan_queue;    // orphans waiting for s_orphan_work
+    struct work_struct s_orphan_work;   // frees the blocks of orphans
+    struct cofs_journal *s_journal;     // if COFS_FEAT_JOURNAL
+};
+
+// mount options
+#define COFS_MOUNT_DELALLOC     0x0001  // allocate file blocks at writeback
+
+static inline struct cofs_sb_info *COFS_SB(struct super_block *sb)
+{
+    return sb->s_fs_info;
+}
+
+// do the dirents of sb have a file type? (COFS_FEAT_FILETYPE)
+static inline int cofs_has_filetype(struct super_block *sb)
+{
+    return COFS_HAS_FEATURE(COFS_SB(sb)->s_sb, COFS_FEAT_FILETYPE);
+}
+
+static inline int cofs_test_opt(struct super_block *sb, unsigned int opt)
+{
+    return COFS_SB(sb)->s_mount_opt & opt;
+}
+
+static inline int cofs_has_journal(struct super_block *sb)
+{
+    return COFS_SB(sb)->s_journal != NULL;
+}
+
+// bytes per disk inode, and the room for inline data in it
+static inline unsigned int cofs_inode_size(struct super_block *sb)
+{
+    return COFS_SB_INODE_SIZE(COFS_SB(sb)->s_sb);
+}
+
+static inline int cofs_has_inline(struct super_block *sb)
+{
+    return COFS_HAS_FEATURE(COFS_SB(sb)->s_sb, COFS_FEAT_INLINE);
+}
+
+static inline unsigned int cofs_inline_max(struct super_block *sb)
+{
+    return COFS_INLINE_MAX(cofs_inode_size(sb));
+}
+
+// the allocation group of block, and of inode ino
+static inline unsigned int cofs_block_group(struct super_block *sb, unsigned int block)
+{
+    return block / BITS_PER_BLOCK(sb->s_blocksize);
+}
+
+static inline unsigned int cofs_ino_group(struct super_block *sb, unsigned long ino)
+{
+    return ino / COFS_SB(sb)->s_inodes_per_group;
+}
+
+void cofs_commit_super(struct super_block *sb, int sync);
+int cofs_set_feature(struct super_block *sb, unsigned int feature);
+
+#endif